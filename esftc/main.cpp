@@ -10,6 +10,9 @@
 #include "../libetherstream/libetherstream.hpp"
 #include "getopt_pp.hpp"
 #include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 using namespace std;
 using namespace GetOpt;
@@ -35,9 +38,9 @@ bool put(Client& c, string local, string remote){
 		cerr << "Could not open file: " << strerror(errno) << endl;
 		return false;
 	}else{
-		c.write("put\n", 4);
-		c.write(remote.c_str(), remote.length());
-		c.write("\n", 1);
+		writeBlocking(&c, "put\n", 4);
+		writeBlocking(&c, remote.c_str(), remote.length());
+		writeBlocking(&c, "\n", 1);
 		c.work();
 		FTResult res;
 		readData(&c, (char*)&res, sizeof(res), 0);
@@ -54,27 +57,35 @@ bool put(Client& c, string local, string remote){
 		}
 		ifile.seekg(0, ifstream::end);
 		uint32_t sz = ifile.tellg();
-		c.write((char*)&sz, 4);
+		writeBlocking(&c, (char*)&sz, 4);
 		ifile.seekg(0, ifstream::beg);
 		for(unsigned offs=0;offs<sz;offs+=1000){
 			char buf[1000];
-			int r = ifile.readsome(buf, 1000);
-			c.write((char*)buf, r);
-			c.work();
+			ifile.read(buf, 1000);
+			writeBlocking(&c, buf, ifile.gcount());
 		};
+		// Server confirms once everything was written
+		readData(&c, (char*)&res, sizeof(res), 0);
+		if(!res.res){
+			cerr << "Server could not write file!" << endl;
+			return false;
+		}
 	}
 	return true;
 }
 
-bool get(Client& c, string remote, string local){
+// requested: the command was already sent (along with the CONNECT)
+bool get(Client& c, string remote, string local, bool requested = false){
 	ofstream ofile(local);
 	if(!ofile.is_open()){
 		cerr << "Cannot open local-file: " << local << endl;
 		return false;
 	}
-	c.write("get\n", 4);
-	c.write(remote.data(), remote.length());
-	c.write("\n", 1);
+	if(!requested){
+		writeBlocking(&c, "get\n", 4);
+		writeBlocking(&c, remote.data(), remote.length());
+		writeBlocking(&c, "\n", 1);
+	}
 	c.work();
 	FTResult res;
 	readData(&c, (char*)&res, sizeof(res), 0);
@@ -91,18 +102,22 @@ bool get(Client& c, string remote, string local){
 	}
 	unsigned int got = 0;
 	while(got < res.size){ // Check for timeout
-		char buf[1000];
-		int r = c.read(buf, 1000);
-		ofile.write(buf, r);
-		got += r;
+		c.work();
+		struct iovec iov[2];
+		int cnt = c.peek(iov, res.size-got);
+		for(int i=0; i<cnt; i++){
+			ofile.write((char*)iov[i].iov_base, iov[i].iov_len);
+			c.consume(iov[i].iov_len);
+			got += iov[i].iov_len;
+		}
 	}
 	return true;
 }
 
 bool del(Client& c, string remote){
-	c.write("del\n", 4);
-	c.write(remote.data(), remote.length());
-	c.write("\n", 1);
+	writeBlocking(&c, "del\n", 4);
+	writeBlocking(&c, remote.data(), remote.length());
+	writeBlocking(&c, "\n", 1);
 	c.work();
 	FTResult res;
 	readData(&c, (char*)&res, sizeof(res), 0);
@@ -120,6 +135,46 @@ bool del(Client& c, string remote){
 	return true;
 }
 
+/*
+ * Puts local onto all servers receiving the multicast group at once, returns the number of servers, which got it.
+ * The file is mapped (not read into memory) right behind the remote path preceding it, as with put, so any part
+ * can be sent again when a server missed it. A transfer carries at most 4GB.
+ */
+size_t mput(string iface, mac_t group, string local, string remote, size_t receivers){
+	int fd = open(local.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd == -1){
+		cerr << "Could not open file: " << strerror(errno) << endl;
+		return 0;
+	}
+	string head = remote + "\n";
+	struct stat st;
+	if(fstat(fd, &st) == -1 || (uint64_t)st.st_size + head.size() > UINT32_MAX){
+		cerr << "File too large for a multicast transfer: " << local << endl;
+		close(fd);
+		return 0;
+	}
+	// Anonymous pages for the path, the file mapped over the ones behind them
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t headRoom = (head.size() + page - 1)/page*page;
+	size_t mapLen = headRoom + st.st_size;
+	char* map = (char*)mmap(nullptr, mapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	bool mapped = map != MAP_FAILED
+			&& (!st.st_size || mmap(map + headRoom, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED);
+	close(fd);
+	if(!mapped){
+		cerr << "Could not map file: " << strerror(errno) << endl;
+		if(map != MAP_FAILED)
+			munmap(map, mapLen);
+		return 0;
+	}
+	char* data = map + headRoom - head.size();
+	memcpy(data, head.data(), head.size());
+	MulticastSender s(iface, group);
+	size_t got = s.distribute(data, head.size() + st.st_size, receivers);
+	munmap(map, mapLen);
+	return got;
+}
+
 void watch_put(Client& c, string local, string remote){
 
 	int fd = inotify_init(); //(IN_NONBLOCK);
@@ -201,13 +256,17 @@ int main(int argc, char **argv) {
 		cout << "OPTIONS:" << endl;
 		cout << "\t--help    -h                  		Show this help" << endl;
 		cout << "\t--version -v  --build  -b     		Show build info" << endl;
-		cout << "\t--dest    -d  mac             		Connect to given host (e.g. 12:34:56:78:9A:BC)" << endl;
-		cout << "\t--iface   -i  interface       		Use specified interface" << endl << endl;
+		cout << "\t--dest    -d  mac|name        		Connect to given host (e.g. 12:34:56:78:9A:BC or its name)" << endl;
+		cout << "\t--iface   -i  interface       		Use specified interface" << endl;
+		cout << "\t--capture -c  file            		Write the frames sent and received on iface to file (pcapng)" << endl << endl;
 		cout << "COMMANDS:" << endl;
 		cout << "\tput local-path remote-path    		Copy local-path onto remote as remote-path" << endl;
 		cout << "\tget remote-path local-path    		Get remote-path onto local as local-path" << endl;
 		cout << "\twatch-put local-path remote-path		Watch local file and put/del it on remote accordingly" << endl;
 		cout << "\tdel remote-path				   		Delete remote-path" << endl;
+		cout << "\tdiscover						   		List hosts serving files (without --dest)" << endl;
+		cout << "\tmput local-path remote-path [count]	Copy local-path onto all servers receiving multicast (esftd -m) at once," << endl;
+		cout << "\t								   		until count servers got it. --dest is the group (optional)" << endl;
 		return (0);
 	}
 	if(ops >> OptionPresent('b', "build") || ops >> OptionPresent('v', "version")){
@@ -219,30 +278,40 @@ int main(int argc, char **argv) {
 		cerr << "Interface was not specified!" << endl;
 		return -1;
 	}
+	string capturePath;
+	unique_ptr<Capture> capture;
+	if(ops >> Option('c', "capture", capturePath)){
+		capture.reset(new Capture(capturePath, iface));
+	}
 	string macstr;
-	if(!(ops >> Option('d',"dest", macstr))){
-		cerr << "Destination mac was not specified!" << endl;
-		return -1;
+	bool dest = ops >> Option('d',"dest", macstr);
+	vector<string> args;
+	ops >> GlobalOption(args);
+	if(args.size() == 1 && args[0] == "discover"){
+		for(auto& peer : Discovery(iface).discover(ETHSTR_SERVICE_FILE_TRANSFER))
+			cout << peer.mac << "\t" << peer.name << endl;
+		return 0;
+	}
+	if(args.size() >= 3 && args.size() <= 4 && args[0] == "mput"){
+		mac_t group = multicastGroup;
+		if(dest && !parseMac(macstr, group)){
+			cerr << "Invalid multicast group " << macstr << "!" << endl;
+			return -1;
+		}
+		size_t receivers = args.size() == 4 ? stoul(args[3]) : 0;
+		size_t got = mput(iface, group, args[1], args[2], receivers);
+		cout << "Put file " << args[1] << " onto " << got << " servers" << endl;
+		return receivers && got < receivers ? -1 : 0;
 	}
-	if(macstr.length() != 17){
-		cerr << "Invalid MAC specified (invalid length)!" << endl;
+	if(!dest){
+		cerr << "Destination mac was not specified!" << endl;
 		return -1;
 	}
 	mac_t mac;
-	for(int i = 0; i<6; i++){
-		if(i && macstr[i*2+i-1] != ':'){
-			cerr << "Invalid MAC specified, expected : got " << macstr[i*2+i-1] <<  " !" << endl;
-			return -1;
-		}
-		try{
-			mac.bytes[i] = stoul(macstr.substr(i*2+i, 2), nullptr, 16) & 0xFF;
-		}catch(...){
-			cerr << "Invalid MAC specified, invalid hex: " << macstr.substr(i*2+i, 2) << " !" << endl;
-			return -1;
-		}
+	if(!parseMac(macstr, mac) && !Discovery(iface).resolve(macstr, ETHSTR_SERVICE_FILE_TRANSFER, mac)){ // Not a MAC, but the name of the host
+		cerr << "Host " << macstr << " was not found!" << endl;
+		return -1;
 	}
-	vector<string> args;
-	ops >> GlobalOption(args);
 	if(args.size() == 0){
 		cerr << "No command was given!" << endl;
 		return -1;
@@ -253,7 +322,7 @@ int main(int argc, char **argv) {
 			cerr << "Invalid number of parameters!" << endl;
 			return -1;
 		}
-		Client c(iface, mac, ETHSTR_SERVICE_FILE_TRANSFER);
+		Client c(iface, mac, ETHSTR_SERVICE_FILE_TRANSFER, transferOptions());
 		while(!c.connected()) // TODO: Add tmout
 			c.work();
 		if(put(c, args[1], args[2])){
@@ -267,10 +336,10 @@ int main(int argc, char **argv) {
 			cerr << "Invalid number of parameters!" << endl;
 			return -1;
 		}
-		Client c(iface, mac, ETHSTR_SERVICE_FILE_TRANSFER);
+		Client c(iface, mac, ETHSTR_SERVICE_FILE_TRANSFER, transferOptions(), "get\n" + args[1] + "\n");
 		while(!c.connected()) // TODO: Add tmout
 			c.work();
-		if(get(c, args[1], args[2])){
+		if(get(c, args[1], args[2], true)){
 			cout << "Successfully get file " << args[1] << endl;
 		}else{
 			cerr << "Failed to get file " << args[1] << endl;
@@ -281,7 +350,7 @@ int main(int argc, char **argv) {
 			cerr << "Invalid number of parameters!" << endl;
 			return -1;
 		}
-		Client c(iface, mac, ETHSTR_SERVICE_FILE_TRANSFER);
+		Client c(iface, mac, ETHSTR_SERVICE_FILE_TRANSFER, transferOptions());
 		while(!c.connected()) // TODO: Add tmout
 			c.work();
 		watch_put(c, args[1], args[2]);
@@ -291,7 +360,7 @@ int main(int argc, char **argv) {
 			cerr << "Invalid number of parameters!" << endl;
 			return -1;
 		}
-		Client c(iface, mac, ETHSTR_SERVICE_FILE_TRANSFER);
+		Client c(iface, mac, ETHSTR_SERVICE_FILE_TRANSFER, transferOptions());
 		while(!c.connected()) // TODO: Add tmout
 			c.work();
 		if(del(c, args[1])){
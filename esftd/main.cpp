@@ -71,15 +71,15 @@ void sendError(ServerConnection* c, string err = ""){
 	struct FTResult res;
 	res.res = 0;
 	res.size = err.length();
-	c->write((char*)&res, sizeof(res));
-	c->write(err.data(), err.length());
+	writeBlocking(c, (char*)&res, sizeof(res), &run);
+	writeBlocking(c, err.data(), err.length(), &run);
 	c->work();
 }
 void sendSuccess(ServerConnection* c, uint32_t sz = 0){
 	struct FTResult res;
 	res.res = 1;
 	res.size = sz;
-	c->write((char*)&res, sizeof(res));
+	writeBlocking(c, (char*)&res, sizeof(res), &run);
 	c->work();
 }
 
@@ -101,7 +101,7 @@ void connectionHandler(ServerConnection* c){
 				}
 				closedir(dir);
 				sendSuccess(c, list.size()*sizeof(struct dirent));
-				c->write((char*)list.data(), list.size()*sizeof(struct dirent));
+				writeBlocking(c, (char*)list.data(), list.size()*sizeof(struct dirent), &run);
 			}
 		}else if(cmd == "mkdir"){
 			int res = mkdir(param.c_str(), 0) == 0;
@@ -113,7 +113,7 @@ void connectionHandler(ServerConnection* c){
 			struct stat statdata;
 			if(stat(param.c_str(), &statdata) == 0){
 				sendSuccess(c, sizeof(struct stat));
-				c->write((char*)&statdata, sizeof(statdata));
+				writeBlocking(c, (char*)&statdata, sizeof(statdata), &run);
 			}else{
 				sendError(c, strerror(errno));
 			}
@@ -135,7 +135,7 @@ void connectionHandler(ServerConnection* c){
 				char buf[1000];
 				while(ifile.tellg() < sz){
 					int r = ifile.readsome(buf, 1000);
-					c->write(buf, r);
+					writeBlocking(c, buf, r, &run);
 				}
 			}
 		}else if(cmd == "put"){
@@ -147,11 +147,15 @@ void connectionHandler(ServerConnection* c){
 				uint32_t sz;
 				if(readData(c, (char*)&sz, 4, 0)){ // TODO: Check for tmout
 					unsigned int got = 0;
-					while(got < sz){ // TODO: Check for tmout
-						char buf[1000];
-						int r = c->read(buf, 1000);
-						ofile.write(buf, r);
-						got += r;
+					while(run && got < sz){ // TODO: Check for tmout
+						c->work();
+						struct iovec iov[2];
+						int cnt = c->peek(iov, sz-got);
+						for(int i=0; i<cnt; i++){
+							ofile.write((char*)iov[i].iov_base, iov[i].iov_len);
+							c->consume(iov[i].iov_len);
+							got += iov[i].iov_len;
+						}
 					}
 					//TODO: error handling
 					sendSuccess(c);
@@ -168,6 +172,64 @@ void connectionHandler(ServerConnection* c){
 	c->close();
 }
 
+/*
+ * Writes a file put by multicast (esftc mput): its path (relative to dir), a newline and the
+ * content. As any host on the link may send one and this runs outside the chroot, the path is
+ * walked one directory at a time without following symlinks, and the file is written to a new
+ * temporary file, which then replaces the target (a symlink there is replaced, not followed).
+ */
+void writeMulticastFile(const string& dir, const vector<char>& data){
+	auto nl = find(data.begin(), data.end(), '\n');
+	string path(data.begin(), nl);
+	vector<string> parts;
+	size_t at = 0;
+	while(at <= path.size()){
+		size_t end = min(path.find('/', at), path.size());
+		if(end > at)
+			parts.push_back(path.substr(at, end - at));
+		at = end + 1;
+	}
+	bool valid = nl != data.end() && !parts.empty() && path.find('\0') == string::npos;
+	for(const string& part : parts)
+		valid &= part != "." && part != "..";
+	if(!valid){
+		cerr << "Invalid multicast file" << endl;
+		return;
+	}
+	int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	for(size_t i = 0; dirfd != -1 && i + 1 < parts.size(); i++){
+		int sub = openat(dirfd, parts[i].c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		close(dirfd);
+		dirfd = sub;
+	}
+	if(dirfd == -1){
+		cerr << "Could not open directory of " << path << ": " << strerror(errno) << endl;
+		return;
+	}
+	string name = parts.back();
+	string tmp = "." + name + "." + to_string(getpid()) + ".part";
+	unlinkat(dirfd, tmp.c_str(), 0); // Left over by an earlier run
+	int fd = openat(dirfd, tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+	bool ok = fd != -1;
+	const char* end = data.data() + data.size();
+	for(const char* p = data.data() + (nl - data.begin()) + 1; ok && p < end;){
+		ssize_t w = write(fd, p, end - p);
+		ok = w > 0;
+		p += max(w, (ssize_t)0);
+	}
+	if(fd != -1)
+		ok &= close(fd) == 0;
+	if(ok)
+		ok = renameat(dirfd, tmp.c_str(), dirfd, name.c_str()) == 0;
+	if(!ok){
+		cerr << "Could not write file " << path << ": " << strerror(errno) << endl;
+		unlinkat(dirfd, tmp.c_str(), 0);
+	}else{
+		std::cout << "Got " << path << " by multicast\n";
+	}
+	close(dirfd);
+}
+
 int main(int argc, char **argv) {
 	std::string dir;
 	GetOpt_pp ops(argc, argv);
@@ -178,6 +240,8 @@ int main(int argc, char **argv) {
 		cout << "\t--version -v  --build  -b     Show build info" << endl;
 		cout << "\t--dir     -d  path	         File root, default '/'" << endl;
 		cout << "\t--iface   -i  interface       Use specified interface" << endl;
+		cout << "\t--multicast -m [group]      Receive files put by multicast (esftc mput)" << endl;
+		cout << "\t--capture -c  file          Write the frames sent and received on iface to file (pcapng)" << endl;
 		return (0);
 	}
 	if(ops >> OptionPresent('b', "build") || ops >> OptionPresent('v', "version")){
@@ -208,13 +272,31 @@ int main(int argc, char **argv) {
 
 
 	try{
-		Listener l(iface, ETHSTR_SERVICE_FILE_TRANSFER);
+		string capturePath;
+		unique_ptr<Capture> capture;
+		if(ops >> Option('c', "capture", capturePath)){
+			capture.reset(new Capture(capturePath, iface)); // Includes the frames of the forked connections
+		}
+		Listener l(iface, ETHSTR_SERVICE_FILE_TRANSFER, transferOptions());
+		unique_ptr<MulticastReceiver> mrecv;
+		if(ops >> OptionPresent('m', "multicast")){
+			string groupstr;
+			mac_t group = multicastGroup;
+			if(ops >> Option('m', "multicast", groupstr) && !parseMac(groupstr, group)){
+				cerr << "Invalid multicast group " << groupstr << "!" << endl;
+				return -1;
+			}
+			mrecv.reset(new MulticastReceiver(iface, group));
+		}
 		while(run){
+			if(mrecv && mrecv->work())
+				writeMulticastFile(dir, mrecv->data());
 			ServerConnection* conn = l.listen();
 			if(conn){
 				std::cout << "New connection from " << conn->getRMac() << "\n";
 				pid_t pid = fork();
 				if(pid == 0){ // Child
+					capture.release(); // Captured by the parent, its threads were not forked
 					if(chroot(dir.c_str()) == 0){
 						connectionHandler(conn);
 					}else{
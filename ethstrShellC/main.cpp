@@ -69,7 +69,7 @@ int main(int argc, char **argv) {
 		cout << "Usage:" << endl;
 		cout << "\t--help    -h                  Show this help" << endl;
 		cout << "\t--version -v  --build  -b     Show build info" << endl;
-		cout << "\t--dest    -d  mac             Connect to given host (e.g. 12:34:56:78:9A:BC)" << endl;
+		cout << "\t--dest    -d  mac|name        Connect to given host (e.g. 12:34:56:78:9A:BC or its name)" << endl;
 		cout << "\t--iface   -i  interface       Use specified interface" << endl;
 		cout << "\t You have to specify the interface and the destination!" << endl;
 		return (0);
@@ -87,22 +87,10 @@ int main(int argc, char **argv) {
 		cerr << "Destination mac was not specified!" << endl;
 		return -1;
 	}
-	if(macstr.length() != 17){
-		cerr << "Invalid MAC specified (invalid length)!" << endl;
-		return -1;
-	}
 	mac_t mac;
-	for(int i = 0; i<6; i++){
-		if(i && macstr[i*2+i-1] != ':'){
-			cerr << "Invalid MAC specified, expected : got " << macstr[i*2+i-1] <<  " !" << endl;
-			return -1;
-		}
-		try{
-			mac.bytes[i] = stoul(macstr.substr(i*2+i, 2), nullptr, 16) & 0xFF;
-		}catch(...){
-			cerr << "Invalid MAC specified, invalid hex: " << macstr.substr(i*2+i, 2) << " !" << endl;
-			return -1;
-		}
+	if(!parseMac(macstr, mac) && !Discovery(iface).resolve(macstr, SERVICE_SHELL, mac)){ // Not a MAC, but the name of the host
+		cerr << "Host " << macstr << " was not found!" << endl;
+		return -1;
 	}
 	if(!isatty(ttyfd)){
 		cerr << "Shell has to be opened on a tty!" << endl;
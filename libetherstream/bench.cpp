@@ -0,0 +1,127 @@
+/*
+ * bench.cpp
+ *
+ * Checks all checksum implementations (fletcher16, crc32c) available on this CPU against
+ * the portable reference and measures their throughput (checksum only and fused copy), e.g.:
+ *   g++ -std=c++14 -O2 bench.cpp -o bench && ./bench
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <string>
+#include <cstring>
+
+#include "libetherstream.checksum.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+static volatile uint32_t sink;
+
+// Reference implementations, everything else is compared against them
+uint32_t reference(const Fletcher16Impl&, void* dst, const void* data, int len, uint32_t sum){
+	return fletcher16ScalarT<true>(dst, data, len, sum);
+}
+uint32_t reference(const Crc32cImpl&, void* dst, const void* data, int len, uint32_t sum){
+	return crc32cTableT<true>(dst, data, len, sum);
+}
+
+template<typename Impl>
+bool verify(const Impl& impl, const vector<uint8_t>& buf){
+	mt19937 rnd(1);
+	vector<uint8_t> dst(buf.size()), ref(buf.size());
+	for(int i = 0; i < 20000; i++){
+		int offs = rnd() % 64;
+		int len = rnd() % (buf.size() - offs);
+		if(i < 2000)
+			len = i % 300; // All the short lengths around the vector widths
+		uint32_t sum = rnd();
+		sum = impl.fn(nullptr, nullptr, 0, sum); // Normalize to the range of the checksum
+		uint32_t expected = reference(impl, &ref[0], &buf[offs], len, sum);
+		if(impl.fn(nullptr, &buf[offs], len, sum) != expected){
+			cerr << impl.name << ": mismatch at offset " << offs << " length " << len << endl;
+			return false;
+		}
+		if(impl.copy(&dst[offs], &buf[offs], len, sum) != expected || memcmp(&dst[offs], &ref[0], len) != 0){
+			cerr << impl.name << ": copy mismatch at offset " << offs << " length " << len << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+template<typename Impl>
+void bench(const Impl& impl, const vector<uint8_t>& buf, int len, bool copy){
+	const size_t total = 256*1024*1024;
+	size_t rounds = total/len;
+	vector<uint8_t> dst(buf.size());
+	auto start = chrono::steady_clock::now();
+	uint32_t sum = 0;
+	for(size_t i = 0; i < rounds; i++){
+		if(copy)
+			sum = impl.copy(&dst[0], &buf[i % 64], len, sum);
+		else
+			sum = impl.fn(nullptr, &buf[i % 64], len, sum);
+	}
+	sink = sum;
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	double bytes = (double)rounds*len;
+	cout << setw(10) << impl.name << setw(6) << (copy ? "copy" : "") << setw(8) << len << setw(10) << fixed << setprecision(3)
+			<< bytes/secs/1e9 << " GB/s" << setw(10) << setprecision(4) << secs*1e9/bytes << " ns/byte" << endl;
+}
+
+int main(int argc, char **argv) {
+	vector<uint8_t> buf(64*1024 + 64);
+	mt19937 rnd(42);
+	for(auto& b : buf)
+		b = rnd();
+
+	vector<Fletcher16Impl> impls = {{"scalar", fletcher16ScalarT<false>, fletcher16ScalarT<true>}};
+#ifdef ETHSTR_CHKSUM_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2"))
+		impls.push_back({"sse2", fletcher16Sse2T<false>, fletcher16Sse2T<true>});
+	if(__builtin_cpu_supports("avx2"))
+		impls.push_back({"avx2", fletcher16Avx2T<false>, fletcher16Avx2T<true>});
+#endif
+#ifdef ETHSTR_CHKSUM_NEON
+	impls.push_back({"neon", fletcher16NeonT<false>, fletcher16NeonT<true>});
+#endif
+	cout << "fletcher16() uses: " << fletcher16Impl().name << endl;
+
+	vector<Crc32cImpl> crcImpls = {{"table", crc32cTableT<false>, crc32cTableT<true>}};
+#ifdef ETHSTR_CHKSUM_X86
+	if(__builtin_cpu_supports("sse4.2"))
+		crcImpls.push_back({"sse4.2", crc32cSse42T<false>, crc32cSse42T<true>});
+#endif
+#ifdef ETHSTR_CHKSUM_ARMCRC
+	if(getauxval(AT_HWCAP) & HWCAP_CRC32)
+		crcImpls.push_back({"armv8-crc", crc32cArmT<false>, crc32cArmT<true>});
+#endif
+	cout << "crc32c() uses: " << crc32cImpl().name << endl;
+	// Known answer from RFC 3720 (iSCSI)
+	if(crc32c(9, "123456789") != 0xE3069283){
+		cerr << "crc32c: wrong check value" << endl;
+		return -1;
+	}
+
+	bool ok = true;
+	for(auto& impl : impls)
+		ok &= verify(impl, buf);
+	for(auto& impl : crcImpls)
+		ok &= verify(impl, buf);
+	if(!ok)
+		return -1;
+
+	for(int len : {64, 512, 1488, 64*1024})
+		for(bool copy : {false, true}){
+			for(auto& impl : impls)
+				bench(impl, buf, len, copy);
+			for(auto& impl : crcImpls)
+				bench(impl, buf, len, copy);
+		}
+	return 0;
+}
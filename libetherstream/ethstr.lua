@@ -4,7 +4,11 @@ local vs_pktypes = {
 	[0] = "CONNECT",
 	[1] = "DATA",
 	[2] = "ACK",
-	[3] = "CLOSE"
+	[3] = "CLOSE",
+	[4] = "DISCOVER",
+	[5] = "ANNOUNCE",
+	[6] = "MDATA",
+	[7] = "NAK"
 }
 
 local fields = {
@@ -14,42 +18,116 @@ local fields = {
 	service = ProtoField.uint16("ethstr.service", "Service", base.HEX),
 	sentCount = ProtoField.uint8("ethstr.sent", "Sent Count", base.DEC),
 	chksum = ProtoField.uint16("ethstr.chksum", "Checksum", base.HEX),
+	chksum32 = ProtoField.uint32("ethstr.chksum32", "Checksum (CRC32C)", base.HEX),
 	datalen = ProtoField.uint16("ethstr.datalen", "DataLen", base.DEC),
 	data = ProtoField.bytes("ethstr.data", "Data", base.HEX),	
 	received = ProtoField.uint8("ethstr.recv", "Received count", base.DEC),
-	conflags = ProtoField.uint16("ethstr.conflags", "Unused", base.HEX),		
-	errflags = ProtoField.uint16("ethstr.errflags", "Error Flags", base.HEX)
+	conflags = ProtoField.uint16("ethstr.conflags", "Flags (offered checksums)", base.HEX),		
+	errflags = ProtoField.uint16("ethstr.errflags", "Error Flags", base.HEX),
+	token = ProtoField.uint64("ethstr.token", "Resume token", base.HEX),
+	name = ProtoField.string("ethstr.name", "Host name"),
+	seq = ProtoField.uint32("ethstr.seq", "Sequence number", base.DEC),
+	size = ProtoField.uint32("ethstr.size", "Transfer size", base.DEC),
+	nakcount = ProtoField.uint16("ethstr.nakcount", "Missing ranges", base.DEC),
+	nakfirst = ProtoField.uint32("ethstr.nakfirst", "Missing from", base.DEC),
+	naklen = ProtoField.uint16("ethstr.naklen", "Missing count", base.DEC)
 }
 
 ethstr.fields = fields
 
-function ethstr.dissector(buf, pinfo, tree)
+-- Checksum type of each connection id, as chosen by the server in its answer to the CONNECT
+local conn_chksum = {}
+local conn_connecting = {}
+-- Size of the checksum field of DATA by checksum type: fletcher16, CRC32C, none
+local chksum_width = { [0] = 2, [1] = 4, [2] = 0 }
+
+-- Checksum field size of a DATA packet of an unknown connection, taken from its length field
+local function guess_width(buf, rest)
+	local padded = nil
+	for _, w in ipairs({2, 4, 0}) do
+		if rest >= 10 + w then
+			local len = buf(8 + w, 2):le_uint()
+			if 10 + w + len == rest then
+				return w
+			elseif padded == nil and rest <= 46 and 10 + w + len < rest then -- Padded to the minimum frame size
+				padded = w
+			end
+		end
+	end
+	return padded or 2
+end
+
+local dissect
+
+-- DATA packet, sumtype: checksum type if known (e.g. from the CONNECT it is sent with)
+local function dissect_data(buf, pinfo, pt, sumtype)
+	local rest = buf:len()
+	pt:add_le(fields.sentCount, buf(7,1))
+	if sumtype == nil then
+		sumtype = conn_chksum[buf(1,4):le_uint()]
+	end
+	local w = sumtype ~= nil and chksum_width[sumtype] or guess_width(buf, rest)
+	if w == 4 then
+		pt:add_le(fields.chksum32, buf(8,4))
+	elseif w == 2 then
+		pt:add_le(fields.chksum, buf(8,2))
+	end
+	if rest >= 10 + w then
+		local len = math.min(buf(8 + w,2):le_uint(), rest - 10 - w)
+		pt:add_le(fields.datalen, buf(8 + w,2))
+		if len > 0 then
+			pt:add(fields.data, buf(10 + w, len))
+		end
+	end
+	local no = bit.band(buf(5,2):le_uint(),0x7FFF)
+	local dir = bit.band(buf(5,2):le_uint(),0x8000)
+	if(dir ~= 0) then
+		pinfo.cols.info = "S->C: DATA[" .. no .. "]"
+	else
+		pinfo.cols.info = "C->S: DATA[" .. no .. "]"
+	end
+end
+
+function dissect(buf, pinfo, tree, sumtype)
 	local type = buf(0,1):le_uint()
 	local pt = tree:add(ethstr, buf(0,8))
 	pinfo.cols.protocol = "EtherStream"
 	pt:add(fields.type, buf(0,1))
 	pt:add_le(fields.conn, buf(1,4))
 	pt:add_le(fields.pktNo, buf(5,2))
+	local rest = buf:len()
 	if type == 0 then -- CONNECT
 		pt:add(fields.sentCount, buf(7,1))		
 		pt:add_le(fields.service, buf(8,2))
-		pt:add(fields.conflags, buf(10,2))
+		pt:add_le(fields.conflags, buf(10,2))
 		pinfo.cols.info = "C->S: CONNECT " .. buf(1,4):le_uint()
-	elseif type == 1 then -- DATA
-		pt:add_le(fields.sentCount, buf(7,1))
-		pt:add_le(fields.chksum, buf(8,2))
-		pt:add_le(fields.datalen, buf(10,2))
-		pt:add(fields.data, buf(12))
-		local no = bit.band(buf(5,2):le_uint(),0x7FFF)
-		local dir = bit.band(buf(5,2):le_uint(),0x8000)
-		if(dir ~= 0) then
-			pinfo.cols.info = "S->C: DATA[" .. no .. "]"
-		else		
-			pinfo.cols.info = "C->S: DATA[" .. no .. "]"
+		if not pinfo.visited and bit.band(buf(10,2):le_uint(), 0x80) == 0 then -- The answer tells the checksum
+			conn_connecting[buf(1,4):le_uint()] = true
+		end
+		if bit.band(buf(10,2):le_uint(), 0x08) ~= 0 and rest > 12 then -- The first DATA packet follows
+			dissect(buf(12):tvb(), pinfo, tree, bit.band(bit.rshift(buf(10,2):le_uint(), 4), 0x3))
+			pinfo.cols.info = "C->S: CONNECT " .. buf(1,4):le_uint() .. " + DATA[1]"
+		elseif bit.band(buf(10,2):le_uint(), 0x80) ~= 0 and rest >= 20 then -- Resumes the connection
+			pt:add_le(fields.token, buf(12,8))
+			pinfo.cols.info = "C->S: RESUME " .. buf(1,4):le_uint()
+			if bit.band(buf(10,2):le_uint(), 0x100) ~= 0 then -- Adds a path
+				pinfo.cols.info = "C->S: ADD PATH " .. buf(1,4):le_uint()
+			end
 		end
+	elseif type == 1 then -- DATA
+		dissect_data(buf, pinfo, pt, sumtype)
 	elseif type == 2 then -- ACK
 		pt:add_le(fields.received, buf(7,1))		
 		pt:add_le(fields.errflags, buf(8,2))
+		local conn = buf(1,4):le_uint()
+		if not pinfo.visited and buf(5,2):le_uint() == 0 and conn_connecting[conn]
+				and bit.band(buf(8,2):le_uint(), 0x400) == 0 then -- Answer to the CONNECT, not a probe
+			conn_chksum[conn] = bit.band(bit.rshift(buf(8,2):le_uint(), 6), 0x3)
+			conn_connecting[conn] = nil
+		end
+		if bit.band(buf(8,2):le_uint(), 0x200) ~= 0 and rest >= 18 then
+			pt:add_le(fields.token, buf(10,8))
+		end
 		local no = bit.band(buf(5,2):le_uint(),0x7FFF)
 		local dir = bit.band(buf(5,2):le_uint(),0x8000)
 		if(dir == 0) then
@@ -65,11 +143,55 @@ function ethstr.dissector(buf, pinfo, tree)
 		else		
 			pinfo.cols.info = "C->S: CLOSE[" .. no .. "]"
 		end
+	elseif type == 4 then -- DISCOVER
+		pt:add_le(fields.service, buf(7,2))
+		pinfo.cols.info = "DISCOVER service " .. buf(7,2):le_uint()
+	elseif type == 5 then -- ANNOUNCE
+		pt:add_le(fields.conflags, buf(7,2))
+		local count = buf(9,1):uint()
+		for i = 0, count - 1 do
+			pt:add_le(fields.service, buf(11 + 2*i, 2))
+		end
+		local nameLen = buf(10,1):uint()
+		if nameLen > 0 then
+			pt:add(fields.name, buf(11 + 2*count, nameLen))
+			pinfo.cols.info = "ANNOUNCE " .. buf(11 + 2*count, nameLen):string()
+		else
+			pinfo.cols.info = "ANNOUNCE"
+		end
+	elseif type == 6 then -- MDATA
+		pt:add_le(fields.seq, buf(7,4))
+		pt:add_le(fields.size, buf(11,4))
+		pt:add_le(fields.chksum32, buf(15,4))
+		pt:add_le(fields.datalen, buf(19,2))
+		pt:add(fields.data, buf(21))
+		pinfo.cols.info = "MDATA[" .. buf(7,4):le_uint() .. "]"
+	elseif type == 7 then -- NAK
+		local count = buf(7,2):le_uint()
+		pt:add_le(fields.nakcount, buf(7,2))
+		for i = 0, count - 1 do
+			pt:add_le(fields.nakfirst, buf(9 + 6*i, 4))
+			pt:add_le(fields.naklen, buf(13 + 6*i, 2))
+		end
+		if count == 0 then
+			pinfo.cols.info = "NAK (complete)"
+		else
+			pinfo.cols.info = "NAK " .. count .. " ranges"
+		end
 	else
 		-- Error
 	end
 	
 end
 
+function ethstr.dissector(buf, pinfo, tree)
+	dissect(buf, pinfo, tree, nil)
+end
+
+function ethstr.init()
+	conn_chksum = {}
+	conn_connecting = {}
+end
+
 local eth_table = DissectorTable.get("ethertype")
 eth_table:add(0xFFF0, ethstr)
@@ -0,0 +1,366 @@
+/*
+ * libetherstream.buffer.hpp
+ *
+ * Ring buffer of the received data and slab queue of the data to send.
+ */
+
+#pragma once
+
+extern "C"{
+#include <sys/uio.h>
+}
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+
+#include "libetherstream.packet.hpp"
+
+namespace ethstream{
+
+/*
+ * Byte ring buffer, appending to the back and consuming from the front are O(1) (amortized),
+ * the capacity is always a power of two. With fixedCap 0 it grows as needed, otherwise it
+ * holds at most fixedCap bytes in place, without any allocation.
+ */
+template<uint32_t fixedCap = 0>
+class BasicRingBuffer{
+	static_assert((fixedCap & (fixedCap - 1)) == 0, "fixedCap has to be a power of two");
+private:
+	char fixed[fixedCap ? fixedCap : 1];
+	char* buf = fixedCap ? fixed : nullptr;
+	uint32_t cap = fixedCap;
+	uint32_t head = 0; // Index of the first byte
+	uint32_t len = 0;
+
+	void grow(uint32_t minCap){
+		if(fixedCap)
+			throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Ring buffer is full"));
+		uint32_t ncap = cap ? cap : 4096;
+		while(ncap < minCap)
+			ncap *= 2;
+		char* nbuf = new char[ncap];
+		peek(nbuf, len);
+		delete[] buf;
+		buf = nbuf;
+		cap = ncap;
+		head = 0;
+	}
+public:
+	BasicRingBuffer(){
+	}
+	~BasicRingBuffer(){
+		if(!fixedCap)
+			delete[] buf;
+	}
+	BasicRingBuffer(const BasicRingBuffer&) = delete;
+	BasicRingBuffer& operator=(const BasicRingBuffer&) = delete;
+
+	uint32_t size() const{
+		return len;
+	}
+	bool empty() const{
+		return len == 0;
+	}
+	// Bytes which can still be added
+	uint32_t space() const{
+		return fixedCap ? fixedCap - len : UINT32_MAX - len;
+	}
+	void push(const char* data, uint32_t n){
+		if(len + n > cap)
+			grow(len + n);
+		uint32_t tail = (head + len) & (cap - 1);
+		uint32_t first = std::min(n, cap - tail);
+		std::memcpy(&buf[tail], data, first);
+		std::memcpy(buf, &data[first], n - first);
+		len += n;
+	}
+	// Copies up to n bytes starting at offset into dst, without consuming them
+	uint32_t peek(char* dst, uint32_t n, uint32_t offset = 0) const{
+		if(offset >= len)
+			return 0;
+		n = std::min(n, len - offset);
+		uint32_t start = (head + offset) & (cap - 1);
+		uint32_t first = std::min(n, cap - start);
+		std::memcpy(dst, &buf[start], first);
+		std::memcpy(&dst[first], buf, n - first);
+		return n;
+	}
+	void consume(uint32_t n){
+		n = std::min(n, len);
+		len -= n;
+		head = len ? (head + n) & (cap - 1) : 0;
+	}
+	/*
+	 * Makes room for n more bytes and points up to two iovecs at it, returns the number used.
+	 * The bytes only become part of the buffer with commit().
+	 */
+	int prepare(struct iovec iov[2], uint32_t n){
+		if(len + n > cap)
+			grow(len + n);
+		uint32_t tail = (head + len) & (cap - 1);
+		uint32_t first = std::min(n, cap - tail);
+		iov[0].iov_base = &buf[tail];
+		iov[0].iov_len = first;
+		if(first == n)
+			return 1;
+		iov[1].iov_base = buf;
+		iov[1].iov_len = n - first;
+		return 2;
+	}
+	void commit(uint32_t n){
+		len += n;
+	}
+	// Fills up to two iovecs, pointing at the first n bytes (after offset), returns the number used
+	int segments(struct iovec iov[2], uint32_t n, uint32_t offset = 0) const{
+		if(offset >= len || n == 0)
+			return 0;
+		n = std::min(n, len - offset);
+		uint32_t start = (head + offset) & (cap - 1);
+		uint32_t first = std::min(n, cap - start);
+		iov[0].iov_base = &buf[start];
+		iov[0].iov_len = first;
+		if(first == n)
+			return 1;
+		iov[1].iov_base = buf;
+		iov[1].iov_len = n - first;
+		return 2;
+	}
+};
+
+typedef BasicRingBuffer<> RingBuffer;
+
+// n objects held in place, nothing for n = 0
+template<typename T, unsigned n>
+struct InPlace{
+	T items[n];
+};
+template<typename T>
+struct InPlace<T, 0>{
+	T* items = nullptr;
+};
+
+/*
+ * Send queue made of preframed DATA packets (slabs): write() copies straight into the payload
+ * of the last slab behind the reserved header, so sending and resending only fills in the
+ * header and hands the slab to the socket. Slabs are recycled instead of freed.
+ * Checksum is the checksum policy (e.g. ChecksumNegotiated). With fixedSlabs 0 slabs are
+ * allocated as needed, otherwise fixedSlabs are held in place and the queue never allocates.
+ */
+template<typename Checksum, unsigned fixedSlabs = 0>
+class BasicSlabQueue{
+public:
+	struct Slab{
+		Slab* next;
+		uint32_t len; // Payload length
+		const char* ref; // Zero copy payload, used instead of frame payload
+		std::function<void()> done; // Called once acknowledged
+		bool sealed; // Sent at least once, may not be changed anymore
+		uint8_t hdrLen; // DATA header length, set when sealed
+		uint8_t sumType; // Checksum type of sum
+		uint32_t sum; // Checksum of the copied payload, computed while copying
+		int64_t sentAt; // Clock ticks of the last (re)send, set by the connection
+		uint8_t path; // Path it was last sent on, set by the connection
+		// The header is placed right in front of the payload, its length depends on the checksum type
+		char frame[maxDataHdrLen + maxPayloadLen];
+
+		char* payload(){
+			return &frame[maxDataHdrLen];
+		}
+		DATA* hdr(){
+			return (DATA*)&frame[maxDataHdrLen - hdrLen];
+		}
+		// Returns the payload checksum, only recomputed if the type changed (or for zero copy slabs)
+		uint32_t checksum(uint8_t type){
+			if(ref)
+				return Checksum::sum(type, len, ref);
+			if(sumType != type){
+				sum = Checksum::sum(type, len, payload());
+				sumType = type;
+			}
+			return sum;
+		}
+		// Fills in the header, apart from pktNo and connection
+		DATA* seal(uint8_t type){
+			hdrLen = dataHdrLen(type);
+			DATA* h = hdr();
+			h->type = tDATA;
+			h->sentCount = 1;
+			setDataHdr(h, type, checksum(type), len);
+			sealed = true;
+			return h;
+		}
+		// Returns the number of iovecs (1 or 2) pointing at the frame
+		int iov(struct iovec iov[2]){
+			iov[0].iov_base = hdr();
+			if(!ref){
+				iov[0].iov_len = hdrLen + len;
+				return 1;
+			}
+			iov[0].iov_len = hdrLen;
+			iov[1].iov_base = (void*)ref;
+			iov[1].iov_len = len;
+			return 2;
+		}
+	};
+private:
+	// Number of unused slabs kept for reuse
+	static const unsigned maxPool = fixedSlabs ? fixedSlabs : 64;
+	InPlace<Slab, fixedSlabs> fixed;
+	Slab* head = nullptr;
+	Slab* tail = nullptr;
+	Slab* pool = nullptr;
+	unsigned poolSize = 0;
+	unsigned slabs = 0;
+	uint32_t slabSize = maxPayloadLen;
+	uint32_t total = 0; // Queued payload bytes
+	uint32_t copied = 0; // Queued payload bytes stored in slabs
+
+	// Appends a new slab, returns nullptr if all fixed slabs are used
+	Slab* alloc(){
+		Slab* s;
+		if(pool){
+			s = pool;
+			pool = s->next;
+			poolSize--;
+		}else if(fixedSlabs){
+			return nullptr;
+		}else{
+			s = new Slab;
+		}
+		s->next = nullptr;
+		s->len = 0;
+		s->ref = nullptr;
+		s->done = nullptr;
+		s->sealed = false;
+		s->hdrLen = 0;
+		s->sumType = 0;
+		s->sum = 0;
+		s->path = 0;
+		slabs++;
+		if(tail)
+			tail->next = s;
+		else
+			head = s;
+		tail = s;
+		return s;
+	}
+	// Whether the tail slab can take more copied data
+	bool tailOpen() const{
+		return tail && !tail->sealed && !tail->ref && tail->len < slabSize;
+	}
+public:
+	BasicSlabQueue(){
+		for(unsigned i = 0; i < fixedSlabs; i++){
+			fixed.items[i].next = pool;
+			pool = &fixed.items[i];
+			poolSize++;
+		}
+	}
+	~BasicSlabQueue(){
+		if(fixedSlabs)
+			return;
+		for(Slab* list : {head, pool}){
+			while(list){
+				Slab* n = list->next;
+				delete list;
+				list = n;
+			}
+		}
+	}
+	BasicSlabQueue(const BasicSlabQueue&) = delete;
+	BasicSlabQueue& operator=(const BasicSlabQueue&) = delete;
+
+	uint32_t size() const{
+		return total;
+	}
+	// Bytes held in slabs, without zero copy references
+	uint32_t buffered() const{
+		return copied;
+	}
+	// Bytes append() would currently accept
+	uint32_t space() const{
+		if(!fixedSlabs)
+			return UINT32_MAX;
+		return poolSize*slabSize + (tailOpen() ? slabSize - tail->len : 0);
+	}
+	bool empty() const{
+		return !head;
+	}
+	Slab* front(){
+		return head;
+	}
+	// Number of slabs (i.e. DATA packets) queued
+	unsigned count() const{
+		return slabs;
+	}
+	// Limits the payload of slabs allocated from now on
+	void setSlabSize(uint32_t size){
+		slabSize = std::max((uint32_t)1, std::min(size, maxPayloadLen));
+	}
+	// Copies up to len bytes at data into the slabs, checksumming them with type on the way, returns the bytes taken
+	uint32_t append(const char* data, uint32_t len, uint8_t type){
+		uint32_t taken = 0;
+		while(taken < len){
+			Slab* s = tailOpen() ? tail : alloc();
+			if(!s)
+				break;
+			uint32_t n = std::min(len - taken, slabSize - s->len);
+			if(!s->len)
+				s->sumType = type;
+			s->sum = Checksum::copy(type, &s->payload()[s->len], &data[taken], n, s->checksum(type));
+			s->len += n;
+			taken += n;
+		}
+		total += taken;
+		copied += taken;
+		return taken;
+	}
+	/*
+	 * Queues len bytes at data without copying, done is called once the last slab was popped.
+	 * Returns false (without queueing anything) if there are not enough fixed slabs left.
+	 */
+	bool appendRef(const char* data, uint32_t len, std::function<void()> done){
+		if(fixedSlabs && (len + slabSize - 1)/slabSize > poolSize)
+			return false;
+		total += len;
+		while(len){
+			Slab* s = alloc();
+			s->ref = data;
+			s->len = std::min(len, slabSize);
+			data += s->len;
+			len -= s->len;
+			if(!len)
+				s->done = done;
+		}
+		return true;
+	}
+	// Removes the front slab (once acknowledged)
+	void pop(){
+		Slab* s = head;
+		head = s->next;
+		if(!head)
+			tail = nullptr;
+		slabs--;
+		total -= s->len;
+		if(!s->ref)
+			copied -= s->len;
+		auto done = s->done;
+		s->done = nullptr;
+		if(poolSize < maxPool){
+			s->next = pool;
+			pool = s;
+			poolSize++;
+		}else{
+			delete s;
+		}
+		if(done)
+			done();
+	}
+};
+
+typedef BasicSlabQueue<ChecksumNegotiated> SlabQueue;
+
+};
@@ -0,0 +1,308 @@
+/*
+ * libetherstream.capture.hpp
+ *
+ * Capturing the frames of the protocol to a pcapng file.
+ */
+
+#pragma once
+
+extern "C"{
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+}
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "libetherstream.packet.hpp"
+
+namespace ethstream{
+
+/*
+ * Writes the frames of the protocol sent and received on an interface (or all) to a pcapng file,
+ * which opens with Wireshark and the ethstr.lua dissector, so no tcpdump is needed on the device.
+ * Frames are taken from a socket of its own, which sees each frame once, as it passed the
+ * interface, along with the time the kernel received or sent it. That covers all processes of
+ * the host, e.g. the forked connections of a server. Frames are buffered and written in batches
+ * by a background thread, frames not fitting into the buffer while the disk is behind are
+ * dropped (see dropped()).
+ */
+class Capture{
+private:
+	// Block types and options of pcapng
+	static const uint32_t blockSHB = 0x0A0D0D0A;
+	static const uint32_t blockIDB = 1;
+	static const uint32_t blockEPB = 6;
+	static const uint16_t optEnd = 0;
+	static const uint16_t optIfName = 2;
+	static const uint16_t optIfTsresol = 9;
+	static const uint16_t optEpbFlags = 2;
+	static const uint16_t linkEthernet = 1;
+	static const uint32_t flushSize = 64*1024; // Buffered bytes, which wake the writer before its interval
+
+	int fd = -1;
+	int sock = -1;
+	size_t bufferSize;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::vector<char> filling; // Blocks to be written, appended by the reader
+	std::unordered_map<int, uint32_t> interfaces; // Interface index -> id of its IDB
+	bool stopping = false;
+	std::atomic<bool> closing{false};
+	std::atomic<uint64_t> drops{0};
+	std::thread writer;
+	std::thread reader;
+
+	static size_t pad4(size_t len){
+		return (len + 3) & ~(size_t)3;
+	}
+	static char* put32(char* p, uint32_t v){
+		std::memcpy(p, &v, 4);
+		return p + 4;
+	}
+	static char* put16(char* p, uint16_t v){
+		std::memcpy(p, &v, 2);
+		return p + 2;
+	}
+	// Appends a block of type with body (already padded), total length before and after it
+	char* appendBlock(uint32_t type, size_t bodyLen){
+		size_t total = 12 + bodyLen;
+		size_t at = filling.size();
+		filling.resize(at + total);
+		char* p = &filling[at];
+		put32(p + total - 4, total);
+		p = put32(p, type);
+		return put32(p, total);
+	}
+	void appendSHB(){
+		char* p = appendBlock(blockSHB, 16);
+		p = put32(p, 0x1A2B3C4D); // Byte order magic, the file is in host byte order
+		p = put16(p, 1);
+		p = put16(p, 0);
+		int64_t sectionLen = -1; // Unknown
+		std::memcpy(p, &sectionLen, 8);
+	}
+	// Id of the interface ifIndex, its description is added on first use
+	uint32_t interfaceId(int ifIndex){
+		auto it = interfaces.find(ifIndex);
+		if(it != interfaces.end())
+			return it->second;
+		char name[IF_NAMESIZE] = {0};
+		if(!if_indextoname(ifIndex, name))
+			std::snprintf(name, sizeof(name), "if%d", ifIndex);
+		size_t nameLen = std::strlen(name);
+		char* p = appendBlock(blockIDB, 8 + 4 + pad4(nameLen) + 4 + 4 + 4);
+		p = put16(p, linkEthernet);
+		p = put16(p, 0);
+		p = put32(p, 65535); // Snap length
+		p = put16(p, optIfName);
+		p = put16(p, nameLen);
+		std::memset(p, 0, pad4(nameLen));
+		std::memcpy(p, name, nameLen);
+		p += pad4(nameLen);
+		p = put16(p, optIfTsresol);
+		p = put16(p, 1);
+		*p++ = 9; // Nanoseconds
+		*p++ = 0;
+		*p++ = 0;
+		*p++ = 0;
+		p = put16(p, optEnd);
+		put16(p, 0);
+		uint32_t id = interfaces.size();
+		interfaces[ifIndex] = id;
+		return id;
+	}
+	void writeOut(const std::vector<char>& data){
+		size_t done = 0;
+		while(done < data.size()){
+			ssize_t w = ::write(fd, data.data() + done, data.size() - done);
+			if(w <= 0)
+				return; // Disk full or gone, the capture is lost from here
+			done += w;
+		}
+	}
+	// Writes the buffered blocks every 100ms or once flushSize bytes were buffered
+	void run(){
+		std::vector<char> writing;
+		std::unique_lock<std::mutex> guard(lock);
+		while(true){
+			wake.wait_for(guard, std::chrono::milliseconds(100), [this]{
+				return stopping || filling.size() >= flushSize;
+			});
+			writing.swap(filling);
+			bool stop = stopping;
+			guard.unlock();
+			writeOut(writing);
+			writing.clear();
+			guard.lock();
+			if(stop && filling.empty())
+				break;
+		}
+	}
+	// Opens the socket seeing all frames of the protocol on iface (all interfaces if empty), timestamped by the kernel
+	void openSocket(const std::string& iface){
+		// Receives the frames of all protocols (only those are passed sent ones), the filter keeps ours
+		sock = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+		if(sock == -1)
+			throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Could not open capture socket: " + std::string(strerror(errno))));
+		struct sock_filter filter[] = {
+			BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12), // A <- ethertype
+			BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K,ETH_P_ETHSTREAM,0,1),
+			BPF_STMT(BPF_RET+BPF_K, 65535),
+			BPF_STMT(BPF_RET+BPF_K, 0),
+		};
+		struct sock_fprog bpf = {
+			.len = sizeof(filter)/sizeof(filter[0]),
+			.filter = filter,
+		};
+		int on = 1;
+		int rcvbuf = bufferSize;
+		if(setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &bpf, sizeof(bpf)) < 0
+				|| setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+			throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Could not set up capture socket: " + std::string(strerror(errno))));
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)); // Best effort, limited by rmem_max
+		if(!iface.empty()){
+			struct sockaddr_ll addr = {0};
+			addr.sll_family = AF_PACKET;
+			addr.sll_protocol = htons(ETH_P_ALL);
+			addr.sll_ifindex = if_nametoindex(iface.c_str());
+			if(!addr.sll_ifindex || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+				throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Could not capture on " + iface + ": " + std::string(strerror(errno))));
+		}
+	}
+	// Frames dropped by the kernel, as this socket was not read in time, since the last call
+	uint64_t kernelDrops(){
+		struct tpacket_stats stats = {0};
+		socklen_t len = sizeof(stats);
+		if(getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, &stats, &len) < 0)
+			return 0;
+		return stats.tp_drops;
+	}
+	// Reads the frames of the socket until closing, then the ones still queued
+	void receive(){
+		std::vector<char> frame(65536);
+		char control[CMSG_SPACE(sizeof(struct timespec))];
+		struct pollfd pfd = {sock, POLLIN, 0};
+		while(true){
+			bool stop = closing.load(std::memory_order_relaxed);
+			if(poll(&pfd, 1, stop ? 0 : 100) == 0)
+				drops.fetch_add(kernelDrops(), std::memory_order_relaxed);
+			while(true){
+				struct sockaddr_ll from;
+				struct iovec iov = {frame.data(), frame.size()};
+				struct msghdr msg = {0};
+				msg.msg_name = &from;
+				msg.msg_namelen = sizeof(from);
+				msg.msg_iov = &iov;
+				msg.msg_iovlen = 1;
+				msg.msg_control = control;
+				msg.msg_controllen = sizeof(control);
+				ssize_t len = recvmsg(sock, &msg, MSG_DONTWAIT);
+				if(len <= 0)
+					break;
+				uint64_t ns = 0;
+				for(struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)){
+					if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS){
+						struct timespec ts;
+						std::memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+						ns = (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+					}
+				}
+				if(!ns) // Not timestamped, should not happen
+					ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+				add(from.sll_ifindex, from.sll_pkttype == PACKET_OUTGOING, ns, frame.data(), len);
+			}
+			if(stop)
+				break;
+		}
+	}
+	// Adds the frame data (starting with the ethernet header), sent (outbound) or received on interface ifIndex at ns
+	void add(int ifIndex, bool outbound, uint64_t ns, const char* data, size_t len){
+		bool notify;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if(filling.size() + len + 64 > bufferSize){
+				drops.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			uint32_t id = interfaceId(ifIndex);
+			char* p = appendBlock(blockEPB, 20 + pad4(len) + 8 + 4);
+			p = put32(p, id);
+			p = put32(p, ns >> 32);
+			p = put32(p, ns);
+			p = put32(p, len);
+			p = put32(p, len);
+			std::memcpy(p, data, len);
+			p += len;
+			std::memset(p, 0, pad4(len) - len);
+			p += pad4(len) - len;
+			p = put16(p, optEpbFlags);
+			p = put16(p, 4);
+			p = put32(p, outbound ? 2 : 1); // Direction
+			p = put16(p, optEnd);
+			put16(p, 0);
+			notify = filling.size() >= flushSize;
+		}
+		if(notify)
+			wake.notify_one();
+	}
+public:
+	/*
+	 * Captures the frames on iface (all interfaces if empty) from now on into the file at path
+	 * (truncated), up to bufferSize bytes are buffered. A forked child must not destroy it.
+	 */
+	Capture(std::string path, std::string iface = "", size_t bufferSize = 4*1024*1024): bufferSize(bufferSize){
+		fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(fd == -1)
+			throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Could not open capture file " + path + ": " + std::string(strerror(errno))));
+		try{
+			openSocket(iface);
+		}catch(std::unique_ptr<std::runtime_error>&){
+			if(sock != -1)
+				::close(sock);
+			::close(fd);
+			throw;
+		}
+		filling.reserve(flushSize*2);
+		appendSHB();
+		writer = std::thread(&Capture::run, this);
+		reader = std::thread(&Capture::receive, this);
+	}
+	// Stops capturing and writes the frames still buffered
+	~Capture(){
+		closing.store(true, std::memory_order_relaxed);
+		reader.join();
+		drops.fetch_add(kernelDrops(), std::memory_order_relaxed);
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_one();
+		writer.join();
+		::close(sock);
+		::close(fd);
+	}
+	// Frames not written, as the buffer was full or they were not read in time
+	uint64_t dropped(){
+		return drops.load(std::memory_order_relaxed);
+	}
+};
+
+};
@@ -0,0 +1,410 @@
+/*
+ * libetherstream.checksum.hpp
+ *
+ * Checksums of DATA packets (fletcher16, crc32c) with SIMD and hardware implementations.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ETHSTR_CHKSUM_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ETHSTR_CHKSUM_NEON
+#endif
+#if defined(__aarch64__)
+extern "C"{
+#include <sys/auxv.h>
+}
+#include <arm_acle.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define ETHSTR_CHKSUM_ARMCRC
+#endif
+
+namespace ethstream{
+
+/*
+ * Fletcher-16 as used on the wire, both sums are taken modulo 256 (not 255). For a block
+ * of n bytes starting from the sums (s1, s2):
+ *   s1' = s1 + sum(d[j])
+ *   s2' = s2 + n*s1 + sum((n-j) * d[j])
+ * All vectorized variants compute exactly this with wrapping 32 bit lanes, which is
+ * identical modulo 256, and finish the tail with the scalar loop.
+ * With copy set the data is also stored to dst while it is loaded for the sums, so
+ * copying and checksumming touch every byte only once.
+ */
+template<bool copy>
+uint16_t fletcher16ScalarT(void* dst, const void* data, int len, uint16_t sum){
+	uint8_t sum1 = sum >> 8;
+	uint8_t sum2 = sum & 0xFF;
+	const uint8_t* d = (const uint8_t*)data;
+	for(int i=0; i<len; i++){
+		if(copy)
+			((uint8_t*)dst)[i] = d[i];
+		sum1 += d[i];
+		sum2 += sum1;
+	}
+	return (sum1 << 8) + sum2;
+}
+
+#ifdef ETHSTR_CHKSUM_X86
+template<bool copy>
+__attribute__((target("sse2")))
+uint16_t fletcher16Sse2T(void* dst, const void* data, int len, uint16_t sum){
+	const uint8_t* d = (const uint8_t*)data;
+	uint32_t s1 = sum >> 8;
+	uint32_t s2 = sum & 0xFF;
+	int blocks = len / 16;
+	if(blocks){
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i wlo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+		const __m128i whi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+		__m128i vs1 = zero; // Byte sums
+		__m128i vps = zero; // Byte sums before each block, weighted by 16 in the end
+		__m128i vs2 = zero; // Weighted sums within the blocks
+		for(int i = 0; i < blocks; i++){
+			__m128i v = _mm_loadu_si128((const __m128i*)&d[i*16]);
+			if(copy)
+				_mm_storeu_si128((__m128i*)&((uint8_t*)dst)[i*16], v);
+			vps = _mm_add_epi32(vps, vs1);
+			vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+			vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), wlo));
+			vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), whi));
+		}
+		uint32_t a[4], p[4], b[4];
+		_mm_storeu_si128((__m128i*)a, vs1);
+		_mm_storeu_si128((__m128i*)p, vps);
+		_mm_storeu_si128((__m128i*)b, vs2);
+		uint32_t n = blocks*16;
+		s2 += n*s1 + 16*(p[0] + p[2]) + b[0] + b[1] + b[2] + b[3];
+		s1 += a[0] + a[2];
+	}
+	uint16_t res = ((s1 & 0xFF) << 8) | (s2 & 0xFF);
+	return fletcher16ScalarT<copy>(copy ? &((uint8_t*)dst)[blocks*16] : nullptr, &d[blocks*16], len - blocks*16, res);
+}
+
+template<bool copy>
+__attribute__((target("avx2")))
+uint16_t fletcher16Avx2T(void* dst, const void* data, int len, uint16_t sum){
+	const uint8_t* d = (const uint8_t*)data;
+	uint32_t s1 = sum >> 8;
+	uint32_t s2 = sum & 0xFF;
+	int blocks = len / 32;
+	if(blocks){
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i ones = _mm256_set1_epi16(1);
+		const __m256i w = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+				16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+		__m256i vs1 = zero;
+		__m256i vps = zero;
+		__m256i vs2 = zero;
+		for(int i = 0; i < blocks; i++){
+			__m256i v = _mm256_loadu_si256((const __m256i*)&d[i*32]);
+			if(copy)
+				_mm256_storeu_si256((__m256i*)&((uint8_t*)dst)[i*32], v);
+			vps = _mm256_add_epi32(vps, vs1);
+			vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(v, zero));
+			vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(v, w), ones));
+		}
+		uint32_t a[8], p[8], b[8];
+		_mm256_storeu_si256((__m256i*)a, vs1);
+		_mm256_storeu_si256((__m256i*)p, vps);
+		_mm256_storeu_si256((__m256i*)b, vs2);
+		uint32_t n = blocks*32;
+		s2 += n*s1 + 32*(p[0] + p[2] + p[4] + p[6]);
+		for(int i = 0; i < 8; i++)
+			s2 += b[i];
+		s1 += a[0] + a[2] + a[4] + a[6];
+	}
+	uint16_t res = ((s1 & 0xFF) << 8) | (s2 & 0xFF);
+	return fletcher16ScalarT<copy>(copy ? &((uint8_t*)dst)[blocks*32] : nullptr, &d[blocks*32], len - blocks*32, res);
+}
+#endif
+
+#ifdef ETHSTR_CHKSUM_NEON
+template<bool copy>
+uint16_t fletcher16NeonT(void* dst, const void* data, int len, uint16_t sum){
+	const uint8_t* d = (const uint8_t*)data;
+	uint32_t s1 = sum >> 8;
+	uint32_t s2 = sum & 0xFF;
+	int blocks = len / 16;
+	if(blocks){
+		static const uint8_t weights[16] = {16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+		const uint8x8_t wlo = vld1_u8(&weights[0]);
+		const uint8x8_t whi = vld1_u8(&weights[8]);
+		uint32x4_t vs1 = vdupq_n_u32(0);
+		uint32x4_t vps = vdupq_n_u32(0);
+		uint32x4_t vs2 = vdupq_n_u32(0);
+		for(int i = 0; i < blocks; i++){
+			uint8x16_t v = vld1q_u8(&d[i*16]);
+			if(copy)
+				vst1q_u8(&((uint8_t*)dst)[i*16], v);
+			vps = vaddq_u32(vps, vs1);
+			vs1 = vpadalq_u16(vs1, vpaddlq_u8(v));
+			uint16x8_t m = vmull_u8(vget_low_u8(v), wlo);
+			m = vmlal_u8(m, vget_high_u8(v), whi);
+			vs2 = vpadalq_u16(vs2, m);
+		}
+		uint32_t a[4], p[4], b[4];
+		vst1q_u32(a, vs1);
+		vst1q_u32(p, vps);
+		vst1q_u32(b, vs2);
+		uint32_t n = blocks*16;
+		s2 += n*s1 + 16*(p[0] + p[1] + p[2] + p[3]) + b[0] + b[1] + b[2] + b[3];
+		s1 += a[0] + a[1] + a[2] + a[3];
+	}
+	uint16_t res = ((s1 & 0xFF) << 8) | (s2 & 0xFF);
+	return fletcher16ScalarT<copy>(copy ? &((uint8_t*)dst)[blocks*16] : nullptr, &d[blocks*16], len - blocks*16, res);
+}
+#endif
+
+typedef uint16_t (*fletcher16_t)(void* dst, const void* data, int len, uint16_t sum);
+
+struct Fletcher16Impl{
+	const char* name;
+	fletcher16_t fn; // Checksum only, dst is ignored
+	fletcher16_t copy; // Copy to dst and checksum
+};
+
+// Fastest implementation supported by the running CPU, selected on first use
+Fletcher16Impl fletcher16Select(){
+#ifdef ETHSTR_CHKSUM_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		return {"avx2", fletcher16Avx2T<false>, fletcher16Avx2T<true>};
+	if(__builtin_cpu_supports("sse2"))
+		return {"sse2", fletcher16Sse2T<false>, fletcher16Sse2T<true>};
+#endif
+#ifdef ETHSTR_CHKSUM_NEON
+	return {"neon", fletcher16NeonT<false>, fletcher16NeonT<true>};
+#endif
+	return {"scalar", fletcher16ScalarT<false>, fletcher16ScalarT<true>};
+}
+
+const Fletcher16Impl& fletcher16Impl(){
+	static const Fletcher16Impl impl = fletcher16Select();
+	return impl;
+}
+
+// Pass the result of the previous part as sum, to checksum data spread over multiple buffers
+uint16_t fletcher16(int len, const void* data, uint16_t sum = 0){
+	return fletcher16Impl().fn(nullptr, data, len, sum);
+}
+
+// Copies len bytes from src to dst and returns their checksum (continuing sum) in one pass
+uint16_t fletcher16Copy(void* dst, const void* src, int len, uint16_t sum = 0){
+	return fletcher16Impl().copy(dst, src, len, sum);
+}
+
+/*
+ * CRC32C (Castagnoli), with the usual pre and post inversion, so the result of one part
+ * can be passed as crc to continue with the next part. The hardware variants (SSE4.2,
+ * ARMv8 CRC) and the table fallback give identical results.
+ */
+template<bool copy>
+uint32_t crc32cTableT(void* dst, const void* data, int len, uint32_t crc){
+	static const struct Table{
+		uint32_t t[256];
+		Table(){
+			for(uint32_t i = 0; i < 256; i++){
+				uint32_t c = i;
+				for(int j = 0; j < 8; j++)
+					c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+				t[i] = c;
+			}
+		}
+	} table;
+	const uint8_t* d = (const uint8_t*)data;
+	crc = ~crc;
+	for(int i = 0; i < len; i++){
+		if(copy)
+			((uint8_t*)dst)[i] = d[i];
+		crc = table.t[(crc ^ d[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+#ifdef ETHSTR_CHKSUM_X86
+template<bool copy>
+__attribute__((target("sse4.2")))
+uint32_t crc32cSse42T(void* dst, const void* data, int len, uint32_t crc){
+	const uint8_t* d = (const uint8_t*)data;
+	uint8_t* o = (uint8_t*)dst;
+	crc = ~crc;
+	int i = 0;
+#ifdef __x86_64__
+	uint64_t c = crc;
+	for(; i + 8 <= len; i += 8){
+		uint64_t v;
+		std::memcpy(&v, &d[i], 8);
+		if(copy)
+			std::memcpy(&o[i], &v, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = (uint32_t)c;
+#endif
+	for(; i + 4 <= len; i += 4){
+		uint32_t v;
+		std::memcpy(&v, &d[i], 4);
+		if(copy)
+			std::memcpy(&o[i], &v, 4);
+		crc = _mm_crc32_u32(crc, v);
+	}
+	for(; i < len; i++){
+		if(copy)
+			o[i] = d[i];
+		crc = _mm_crc32_u8(crc, d[i]);
+	}
+	return ~crc;
+}
+#endif
+
+#ifdef ETHSTR_CHKSUM_ARMCRC
+template<bool copy>
+__attribute__((target("+crc")))
+uint32_t crc32cArmT(void* dst, const void* data, int len, uint32_t crc){
+	const uint8_t* d = (const uint8_t*)data;
+	uint8_t* o = (uint8_t*)dst;
+	crc = ~crc;
+	int i = 0;
+	for(; i + 8 <= len; i += 8){
+		uint64_t v;
+		std::memcpy(&v, &d[i], 8);
+		if(copy)
+			std::memcpy(&o[i], &v, 8);
+		crc = __crc32cd(crc, v);
+	}
+	for(; i < len; i++){
+		if(copy)
+			o[i] = d[i];
+		crc = __crc32cb(crc, d[i]);
+	}
+	return ~crc;
+}
+#endif
+
+typedef uint32_t (*crc32c_t)(void* dst, const void* data, int len, uint32_t crc);
+
+struct Crc32cImpl{
+	const char* name;
+	crc32c_t fn; // Checksum only, dst is ignored
+	crc32c_t copy; // Copy to dst and checksum
+};
+
+Crc32cImpl crc32cSelect(){
+#ifdef ETHSTR_CHKSUM_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2"))
+		return {"sse4.2", crc32cSse42T<false>, crc32cSse42T<true>};
+#endif
+#ifdef ETHSTR_CHKSUM_ARMCRC
+	if(getauxval(AT_HWCAP) & HWCAP_CRC32)
+		return {"armv8-crc", crc32cArmT<false>, crc32cArmT<true>};
+#endif
+	return {"table", crc32cTableT<false>, crc32cTableT<true>};
+}
+
+const Crc32cImpl& crc32cImpl(){
+	static const Crc32cImpl impl = crc32cSelect();
+	return impl;
+}
+
+uint32_t crc32c(int len, const void* data, uint32_t crc = 0){
+	return crc32cImpl().fn(nullptr, data, len, crc);
+}
+
+uint32_t crc32cCopy(void* dst, const void* src, int len, uint32_t crc = 0){
+	return crc32cImpl().copy(dst, src, len, crc);
+}
+
+// Payload checksums, which can be negotiated in the CONNECT handshake
+enum chksumType{
+	cFLETCHER16 = 0, // Default, the only one known by v1 peers
+	cCRC32C = 1,
+	cNONE = 2 // Only for trusted links, the ethernet FCS still applies
+};
+const uint8_t maxChksumType = cNONE;
+// CONNECT flags: bit n offers the payload checksum n, fletcher16 is always supported
+#define CONNFLAG_CHKSUM(x) (1 << (x))
+#define CONNFLAGS_CHKSUM 0x0007
+
+// Bytes of the checksum field in DATA packets
+uint8_t chksumLen(uint8_t type){
+	return type == cCRC32C ? 4 : type == cNONE ? 0 : 2;
+}
+
+// Continues sum with len bytes at data
+uint32_t checksum(uint8_t type, int len, const void* data, uint32_t sum = 0){
+	if(type == cCRC32C)
+		return crc32c(len, data, sum);
+	if(type == cNONE)
+		return 0;
+	return fletcher16(len, data, sum);
+}
+
+// Copies len bytes from src to dst and continues sum with them in one pass
+uint32_t checksumCopy(uint8_t type, void* dst, const void* src, int len, uint32_t sum = 0){
+	if(type == cCRC32C)
+		return crc32cCopy(dst, src, len, sum);
+	if(type == cNONE){
+		std::memcpy(dst, src, len);
+		return 0;
+	}
+	return fletcher16Copy(dst, src, len, sum);
+}
+
+/*
+ * Checksum policies of a connection (see libetherstream.policy.hpp). ChecksumNegotiated uses the type
+ * negotiated at runtime, ChecksumFixed only supports fixedType, so the checksum is resolved at compile
+ * time. With portable the plain C++ implementation is used, without CPU detection.
+ */
+struct ChecksumNegotiated{
+	// CONNFLAG_CHKSUM() flags supported, out of the configured ones
+	static uint16_t supported(uint16_t configured){
+		return (configured & CONNFLAGS_CHKSUM) | CONNFLAG_CHKSUM(cFLETCHER16);
+	}
+	static uint8_t type(uint8_t negotiated){
+		return negotiated;
+	}
+	static uint32_t sum(uint8_t type, int len, const void* data, uint32_t sum = 0){
+		return checksum(type, len, data, sum);
+	}
+	static uint32_t copy(uint8_t type, void* dst, const void* src, int len, uint32_t sum = 0){
+		return checksumCopy(type, dst, src, len, sum);
+	}
+};
+
+template<uint8_t fixedType, bool portable = false>
+struct ChecksumFixed{
+	static uint16_t supported(uint16_t configured){
+		return CONNFLAG_CHKSUM(fixedType);
+	}
+	static uint8_t type(uint8_t negotiated){
+		return fixedType;
+	}
+	static uint32_t sum(uint8_t, int len, const void* data, uint32_t sum = 0){
+		if(fixedType == cNONE)
+			return 0;
+		if(fixedType == cCRC32C)
+			return portable ? crc32cTableT<false>(nullptr, data, len, sum) : crc32c(len, data, sum);
+		return portable ? fletcher16ScalarT<false>(nullptr, data, len, sum) : fletcher16(len, data, sum);
+	}
+	static uint32_t copy(uint8_t, void* dst, const void* src, int len, uint32_t sum = 0){
+		if(fixedType == cNONE){
+			std::memcpy(dst, src, len);
+			return 0;
+		}
+		if(fixedType == cCRC32C)
+			return portable ? crc32cTableT<true>(dst, src, len, sum) : crc32cCopy(dst, src, len, sum);
+		return portable ? fletcher16ScalarT<true>(dst, src, len, sum) : fletcher16Copy(dst, src, len, sum);
+	}
+};
+
+};
@@ -7,180 +7,710 @@
 
 #pragma once
 
-#include <vector>
+extern "C"{
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+}
+#include <atomic>
 #include <chrono>
 #include <cstring>
 #include <string>
+#include <functional>
+#include <mutex>
+#include <random>
 
+#include "libetherstream.buffer.hpp"
 #include "libetherstream.packet.hpp"
+#include "libetherstream.policy.hpp"
 #include "libetherstream.socket.hpp"
+#include "libetherstream.table.hpp"
 
 namespace ethstream{
 
+template<typename Policy> class BasicListener;
 
-template<bool isClient>
+template<bool isClient, typename Policy = DefaultPolicy>
 class WriteConnection: public virtual ConnectedSocket{
 private:
-	bool waitingACK = false;
-	std::vector<char> out;
-	std::chrono::time_point<std::chrono::system_clock> lastSent;
+	typedef typename Policy::Clock Clock;
+	typedef typename Policy::SendQueue::Slab Slab;
+	typename Policy::SendQueue out;
+	uint16_t inFlight = 0; // Sent, but unacknowledged slabs at the front of out
+	bool recovering = false; // Everything in flight was resent after an error ACK
+	typename Clock::time_point timerStart; // Retransmission timer of the oldest slab in flight
+	uint32_t rto; // ms
+	RttEstimator rtt; // Of the connection, each path has one of its own
+	uint32_t highWatermark = 0; // 0: unlimited
+	uint32_t lowWatermark = 0;
+	bool blocked = false;
+	std::function<void()> writableCb;
+
+	uint16_t window(){
+		return Policy::Ack::window(options);
+	}
+	uint8_t sumType(){
+		return Policy::Checksum::type(chksumType);
+	}
+	void sendSlab(Slab* slab, typename Clock::time_point now, uint8_t path){
+		struct iovec iov[2];
+		int cnt = slab->iov(iov);
+		sendPacket(path, iov, cnt);
+		slab->sentAt = now.time_since_epoch().count();
+		slab->path = path;
+		pathAt(path).sent++;
+	}
+	// Go back N: resends all slabs in flight and restarts the timer, slabs of failed paths move to others
+	void resendInFlight(){
+		timerStart = Clock::now();
+		Slab* slab = out.front();
+		for(uint16_t i = 0; i < inFlight; i++, slab = slab->next){
+			if(slab->hdr()->sentCount < UINT8_MAX) // Saturates, so it never looks like a first send again
+				slab->hdr()->sentCount++;
+			stats.count(stats.retransmits);
+			uint8_t path = slab->path;
+			if(!pathAt(path).usable() && pathCount() > 1){
+				pathAt(path).inFlight--;
+				path = choosePath();
+				pathAt(path).inFlight++;
+			}
+			sendSlab(slab, timerStart, path);
+		}
+	}
+	// Counts the slabs in flight as lost (after a timeout), paths not heard from for a while fail
+	void lostInFlight(){
+		Slab* slab = out.front();
+		for(uint16_t i = 0; i < inFlight; i++, slab = slab->next)
+			pathAt(slab->path).lost++;
+		for(uint8_t i = 0; i < pathCount(); i++)
+			if(pathAt(i).inFlight && pathAt(i).timeouts < UINT8_MAX)
+				pathAt(i).timeouts++;
+	}
+	// Adapts the retransmission timeout to a measured round trip time
+	void sampleRtt(typename Clock::duration sample){
+		rtt.sampleRtt(std::chrono::duration_cast<std::chrono::microseconds>(sample).count());
+		updateRto();
+	}
+	/*
+	 * Sets the retransmission timeout from the measured round trip time, which also ends a back off.
+	 * The variance margin is at least rtoMin (as TCP on Linux), as a receiver stalling now and
+	 * then (e.g. on the disk) barely raises rttvar, but would make go-back-N resend the window.
+	 */
+	void updateRto(){
+		if(rtt.srtt < 0)
+			return;
+		uint32_t ms = (rtt.srtt + std::max<int64_t>(4*rtt.rttvar, options.rtoMin*1000ll) + 999)/1000;
+		rto = std::min(ms, options.rtoMax);
+	}
+	// Payload of DATA packets fitting into the MTU
+	uint32_t mtuSlabSize(){
+		return options.mtu > maxDataHdrLen ? options.mtu - maxDataHdrLen : 1;
+	}
 protected:
-	DATA* lastPkt = nullptr;
+	uint16_t lastPktNo = 0; // 0: nothing sent yet
 	WriteConnection(std::string iface, mac_t remoteMac, uint32_t connection):
 		ConnectedSocket(iface, remoteMac, connection){
+		rto = std::max(options.rtoMin, std::min(options.rtoInitial, options.rtoMax));
+		out.setSlabSize(mtuSlabSize());
+		setSendBuffer(options.sendBufHigh, options.sendBufLow);
+	}
+	/*
+	 * Queues up to room bytes of data as the first DATA packet, sealed with the checksum type,
+	 * to be sent along with the CONNECT (see earlyIov()). Returns the bytes taken.
+	 */
+	uint32_t queueEarly(const char* data, uint32_t len, uint8_t type, uint32_t room){
+		if(lastPktNo || !room)
+			return 0;
+		out.setSlabSize(room);
+		len = out.append(data, std::min(len, room), type);
+		out.setSlabSize(mtuSlabSize());
+		if(!len)
+			return 0;
+		Slab* slab = out.front();
+		lastPktNo = nextPktNo(lastPktNo, isClient);
+		DATA* hdr = slab->seal(type);
+		hdr->pktNo = lastPktNo;
+		hdr->connection = connection;
+		inFlight = 1;
+		pathAt(0).inFlight++;
+		stats.count(stats.payloadSent, len);
+		timerStart = Clock::now();
+		slab->sentAt = timerStart.time_since_epoch().count();
+		return len;
+	}
+	// Queues all of data regardless of the high watermark, false if the send buffer cannot hold it
+	bool writeAll(const char* data, uint32_t len){
+		if(out.append(data, len, sumType()) < len)
+			return false;
+		if(highWatermark && out.buffered() >= highWatermark)
+			blocked = true;
+		return true;
+	}
+	// Points iov at the first DATA packet (sent sentCount times) while it is unacknowledged, returns the number used
+	int earlyIov(struct iovec iov[2], uint8_t sentCount){
+		if(!inFlight || out.front()->hdr()->pktNo != nextPktNo(0, isClient))
+			return 0;
+		out.front()->hdr()->sentCount = sentCount;
+		return out.front()->iov(iov);
+	}
+	// Seals the packets in flight again with the checksum type negotiated meanwhile and resends them
+	void resealInFlight(){
+		Slab* slab = out.front();
+		for(uint16_t i = 0; i < inFlight; i++, slab = slab->next){
+			uint16_t pktNo = slab->hdr()->pktNo;
+			DATA* hdr = slab->seal(sumType());
+			hdr->pktNo = pktNo;
+			hdr->connection = connection;
+		}
+		resendInFlight();
+	}
+	// Resends everything in flight once the connection was resumed, without the back off of the lost link
+	void restart(){
+		rto = std::max(options.rtoMin, std::min(options.rtoInitial, options.rtoMax));
+		updateRto();
+		resendInFlight();
 	}
 public:
-	void write(const char* data, uint32_t len){
+	/*
+	 * Queues data to be sent and returns how many bytes were accepted. Without a send buffer
+	 * limit everything is accepted, otherwise only up to the high watermark. Once less than
+	 * len bytes were accepted, writable() returns false until the buffer drained to the low
+	 * watermark.
+	 */
+	uint32_t write(const char* data, uint32_t len){
 		if(!data){
-			//TODO: throw error
-			return;
+			if(len)
+				throw std::unique_ptr<std::runtime_error>(new std::runtime_error("write() without data"));
+			return 0;
 		}
+		len = std::min(len, writeSpace());
 		if(len >= 1){
-			out.insert(out.end(), &data[0], &data[len]);
+			len = out.append(data, len, sumType());
 		}
+		if(highWatermark && out.buffered() >= highWatermark)
+			blocked = true;
+		return len;
 	};
-	void write(std::string data){
-		write(data.c_str(), (uint32_t)data.length());
+	uint32_t write(std::string data){
+		return write(data.c_str(), (uint32_t)data.length());
 	}
-	void write(const char* data){
-		write(data, (uint32_t)strlen(data));
+	uint32_t write(const char* data){
+		return write(data, (uint32_t)strlen(data));
 	}
+	// Gathering write(), with the same send buffer limits
+	uint32_t writev(const struct iovec* iov, int cnt){
+		uint32_t total = 0;
+		for(int i = 0; i < cnt; i++){
+			uint32_t len = write((const char*)iov[i].iov_base, iov[i].iov_len);
+			total += len;
+			if(len < iov[i].iov_len)
+				break;
+		}
+		return total;
+	}
+	/*
+	 * Zero copy write: the data is not copied, but sent directly from the caller's memory,
+	 * which has to stay valid and unchanged until done is called (once all of it was
+	 * acknowledged). Not limited by the send buffer, but counted by pending(). Returns false
+	 * (without taking the data) if the policy has too few fixed send slabs left.
+	 */
+	bool writeRef(const char* data, uint32_t len, std::function<void()> done = nullptr){
+		if(!data || !len){
+			if(done)
+				done();
+			return true;
+		}
+		return out.appendRef(data, len, done);
+	}
+	// Bytes written, but not yet acknowledged by the remote
+	uint32_t pending(){
+		return out.size();
+	}
+	// Limits the send buffer to high bytes, writable() becomes true again at low bytes, 0 means unlimited
+	void setSendBuffer(uint32_t high, uint32_t low){
+		highWatermark = high;
+		lowWatermark = std::min(low, high);
+		blocked = highWatermark && out.buffered() >= highWatermark;
+	}
+	// Bytes write() would currently accept
+	uint32_t writeSpace(){
+		if(!highWatermark)
+			return out.space();
+		if(blocked)
+			return 0;
+		return std::min(highWatermark > out.buffered() ? highWatermark - out.buffered() : 0, out.space());
+	}
+	bool writable(){
+		return writeSpace() > 0;
+	}
+	// Called from work() once the send buffer drained to the low watermark after write() was limited
+	void onWritable(std::function<void()> cb){
+		writableCb = cb;
+	}
+	/*
+	 * ACKs are cumulative: one acknowledges all packets in flight up to its number. An ACK with
+	 * error flags acknowledges nothing, but makes everything in flight be resent (once, until
+	 * the next packet was acknowledged).
+	 */
 	void handlePacket(const ACK* apkt, uint16_t pktSize){
-		if(lastPkt){
-			if(waitingACK){
-				if((uint16_t)apkt->errflags.val == 0){
-					if(lastPkt->pktNo == apkt->pktNo){
-						waitingACK = false;
-						out.erase(out.begin(), out.begin()+lastPkt->length);
+		if(REALPKTNO(apkt->pktNo) == 0 || !inFlight) // Handshake or nothing to acknowledge
+			return;
+		if(isClient == SERVERBIT_ISSET(apkt->pktNo)) // Acknowledges packets of the other direction
+			return;
+		if(apkt->errflags == 0){
+			uint16_t acked = pktNoDist(out.front()->hdr()->pktNo, apkt->pktNo);
+			if(acked >= inFlight) // Duplicate or unknown
+				return;
+			auto now = Clock::now();
+			int64_t newest[maxPaths]; // sentAt of the last slab acknowledged per path, -1: none
+			std::fill(newest, newest + maxPaths, -1);
+			uint32_t rttUs = 0;
+			for(uint16_t i = 0; i <= acked; i++){
+				Slab* slab = out.front();
+				if(slab->hdr()->sentCount == 1){ // Resent ones are ambiguous
+					if(i == acked){
+						auto sample = now - typename Clock::time_point(typename Clock::duration(slab->sentAt));
+						rttUs = std::chrono::duration_cast<std::chrono::microseconds>(sample).count();
+						sampleRtt(sample);
 					}
-				}else{ // Resend packet
-					//TODO: maybe rebuilt packet, instead of just resending
-					lastPkt->sentCount++;
-					sendPacket(lastPkt, sizeof(DATA)+lastPkt->length);
-					lastSent = std::chrono::system_clock::now();
+					newest[slab->path] = slab->sentAt;
 				}
-			}else{}
+				pathAt(slab->path).inFlight--;
+				out.pop();
+				inFlight--;
+			}
+			for(uint8_t i = 0; i < pathCount(); i++)
+				if(newest[i] >= 0)
+					pathAt(i).sampleRtt(std::chrono::duration_cast<std::chrono::microseconds>(now - typename Clock::time_point(typename Clock::duration(newest[i]))).count());
+			traceEvent(TRACE_ACKED, tACK, apkt->pktNo, acked + 1, rxPath, rttUs);
+			recovering = false;
+			timerStart = now;
+			updateRto();
+			if(blocked && out.buffered() <= lowWatermark){
+				blocked = false;
+				if(writableCb)
+					writableCb();
+			}
+		}else if(!recovering){ // Resend packets
+			recovering = true;
+			resendInFlight();
 		}
 	}
+	// Milliseconds until work() has to be called again, -1 if only incoming packets require work
+	int nextTimeout(){
+		if(inFlight < window() && out.count() > inFlight)
+			return 0;
+		if(inFlight){
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(timerStart + std::chrono::milliseconds(rto) - Clock::now());
+			return std::max((int)left.count(), 0);
+		}
+		return -1;
+	}
 	void work(){
-		if(waitingACK){
-			using namespace std::chrono_literals;
-			if(std::chrono::system_clock::now() - lastSent > 1s){
-				lastPkt->sentCount++;
-				sendPacket(lastPkt, sizeof(DATA)+lastPkt->length);
-				lastSent = std::chrono::system_clock::now();
-			}
-		}else{
-			if(out.size()){
-				uint16_t pktNo = lastPkt ? lastPkt->pktNo + 1 : 1;
-				if(REALPKTNO(pktNo) == 0)
-					pktNo = 1;
-				if(isClient)
-					pktNo = CLIENTBIT_CLEAR(pktNo);
-				else
-					pktNo = SERVERBIT_SET(pktNo);
-				delete[] lastPkt;
-				int sendSize = std::min((uint32_t)out.size(), maxDataLen);
-				lastPkt = (DATA*)new char[sizeof(DATA)+sendSize];
-				lastPkt->pktNo = pktNo;
-				lastPkt->type = tDATA;
-				lastPkt->length = sendSize;
-				lastPkt->checksum = fletcher16(sendSize, out.data());
-				lastPkt->sentCount = 1;
-				lastPkt->connection = connection;
-				std::memcpy(lastPkt->data, out.data(), sendSize);
-				sendPacket(lastPkt, sizeof(DATA)+sendSize);
-				lastSent = std::chrono::system_clock::now();
-				waitingACK = true;
-			}
+		auto now = Clock::now();
+		if(inFlight && now - timerStart > std::chrono::milliseconds(rto)){
+			rto = std::min(rto*2, options.rtoMax); // Back off, until acknowledged
+			stats.count(stats.timeouts);
+			traceEvent(TRACE_TIMEOUT, tDATA, out.front()->hdr()->pktNo, inFlight, out.front()->path, rto);
+			lostInFlight();
+			resendInFlight();
+			recovering = false; // The next error ACK (e.g. the receiver made room) resends them before the backed off timeout
+		}
+		Slab* slab = out.front();
+		for(uint16_t i = 0; i < inFlight; i++)
+			slab = slab->next;
+		while(slab && inFlight < window()){
+			// The slab already holds the payload, only the header is missing
+			lastPktNo = nextPktNo(lastPktNo, isClient);
+			DATA* hdr = slab->seal(sumType());
+			hdr->pktNo = lastPktNo;
+			hdr->connection = connection;
+			if(!inFlight)
+				timerStart = now;
+			uint8_t path = choosePath();
+			pathAt(path).inFlight++;
+			sendSlab(slab, now, path);
+			stats.count(stats.payloadSent, slab->len);
+			inFlight++;
+			slab = slab->next;
 		}
+		stats.sender(rtt.srtt, rto, window(), inFlight, out.size());
 	}
 
 };
 
-template<bool isClient>
+template<bool isClient, typename Policy = DefaultPolicy>
 class ReadConnection: public virtual ConnectedSocket{
 private:
+	typedef typename Policy::Clock Clock;
 	bool noDataYet = true;
-	std::vector<char> in;
-	ACK lastAPkt;
-	std::chrono::time_point<std::chrono::system_clock> lastAckSent;
+	bool orderErrSent = false; // Out of order packets were reported since the last accepted one
+	typename Policy::RecvBuffer in;
+	ACK lastAPkt; // Acknowledges the last packet accepted (in order)
+	uint16_t unacked = 0; // Accepted packets, which lastAPkt was not sent for yet (delayed ACK)
+	typename Clock::time_point ackDue;
+	// Packets, which overtook others sent on a slower path, held until those arrived (with several paths only)
+	static const uint16_t maxHeld = 8;
+	struct Held{
+		uint16_t pktNo = 0; // 0: empty
+		std::string payload;
+	};
+	Held held[maxHeld];
+	uint16_t heldCount = 0;
+	uint16_t dropped = 0; // Length of the DATA dropped for lack of room, 0: none since room was made
+
+	// Called once data was taken from in, asks the remote to resend right away once the dropped DATA fits
+	void madeRoom(){
+		if(dropped && dropped <= in.space() && (!options.recvBufSize || in.size() + dropped <= options.recvBufSize)){
+			dropped = 0;
+			requestResend();
+		}
+	}
+
+	uint8_t sumType(){
+		return Policy::Checksum::type(chksumType);
+	}
+	// Keeps a packet at most maxHeld ahead, once half of the slots are used the gap is reported as loss
+	void hold(const DataView& dpkt){
+		if(Policy::Checksum::sum(dpkt.chksumType(), dpkt.length(), dpkt.payload()) != dpkt.checksum()){
+			stats.count(stats.checksumErrors);
+			traceEvent(TRACE_DROP, tDATA, dpkt->pktNo, dpkt.length(), rxPath, ACKERR_CHKSUM);
+			sendError(dpkt, false);
+			return;
+		}
+		Held& h = held[REALPKTNO(dpkt->pktNo) % maxHeld];
+		if(!h.pktNo)
+			heldCount++;
+		h.pktNo = dpkt->pktNo;
+		h.payload.assign(dpkt.payload(), dpkt.length());
+		if(heldCount >= maxHeld/2 && !orderErrSent){
+			orderErrSent = true;
+			sendError(dpkt, true);
+		}
+	}
+	// Accepts the held packets following the last accepted one, returns how many
+	uint16_t releaseHeld(){
+		uint16_t released = 0;
+		while(heldCount){
+			uint16_t next = nextPktNo(lastAPkt.pktNo, !isClient);
+			Held& h = held[REALPKTNO(next) % maxHeld];
+			uint32_t len = h.payload.size();
+			if(h.pktNo != next || len > in.space() || (options.recvBufSize && in.size() + len > options.recvBufSize))
+				break;
+			in.push(h.payload.data(), len);
+			stats.count(stats.payloadReceived, len);
+			h.pktNo = 0;
+			heldCount--;
+			lastAPkt.pktNo = next;
+			released++;
+		}
+		return released;
+	}
+
+	// Reports a packet, which was ignored, the sender resends everything in flight
+	void sendError(const DataView& dpkt, bool orderError){
+		ACK apkt;
+		apkt.connection = connection;
+		apkt.pktNo = dpkt->pktNo;
+		apkt.receivedCount = 1;
+		apkt.errflags = ACKERR_PKGIGNORED | (orderError ? ACKERR_PKGORDER : ACKERR_CHKSUM);
+		sendPacket(&apkt, sizeof(ACK));
+	}
 protected:
 	ReadConnection(std::string iface, mac_t remoteMac, uint32_t connection):
 		ConnectedSocket(iface, remoteMac, connection){
 		lastAPkt.pktNo = 0;
+		lastAPkt.connection = connection;
+		lastAPkt.receivedCount = 1;
+	}
+	// Asks the remote to resend everything in flight, as if the next packet was ignored
+	void requestResend(){
+		ACK apkt;
+		apkt.connection = connection;
+		apkt.pktNo = nextPktNo(lastAPkt.pktNo, !isClient);
+		apkt.receivedCount = 1;
+		apkt.errflags = ACKERR_PKGIGNORED | ACKERR_PKGORDER;
+		sendPacket(&apkt, sizeof(ACK));
 	}
-	void handlePacket(const DATA* dpkt, uint16_t pktSize){
+	// Sends lastAPkt on path (-1: the best one)
+	void sendAck(int path = -1){
+		unacked = 0;
+		struct iovec iov = {&lastAPkt, sizeof(ACK)};
+		sendPacket(path, &iov, 1);
+	}
+	// Copies the payload into in while checksumming it, it is only kept if the checksum matches
+	bool receive(const DataView& dpkt){
+		uint8_t type = dpkt.chksumType();
+		uint16_t len = dpkt.length();
+		struct iovec iov[2];
+		int cnt = in.prepare(iov, len);
+		const char* src = dpkt.payload();
+		uint32_t sum = 0;
+		for(int i = 0; i < cnt; i++){
+			sum = Policy::Checksum::copy(type, iov[i].iov_base, src, iov[i].iov_len, sum);
+			src += iov[i].iov_len;
+		}
+		if(sum != dpkt.checksum())
+			return false;
+		in.commit(len);
+		stats.count(stats.payloadReceived, len);
+		return true;
+	}
+	// Takes the first DATA packet of the remote, which came with its CONNECT and is acknowledged by the answer to it
+	bool acceptEarly(const DataView& dpkt){
+		if(!noDataYet || dpkt->pktNo != nextPktNo(0, !isClient) || dpkt.length() > in.space()
+				|| (options.recvBufSize && dpkt.length() > options.recvBufSize) || !receive(dpkt))
+			return false;
+		noDataYet = false;
+		lastAPkt.pktNo = dpkt->pktNo;
+		lastAPkt.receivedCount = 1;
+		return true;
+	}
+	/*
+	 * Only the next packet in order is accepted (the sender goes back to the first unacknowledged
+	 * one on errors). Duplicates are acknowledged again, the first out of order packet after a
+	 * loss is reported. dpkt has to be valid.
+	 */
+	void handlePacket(const DataView& dpkt){
 		if(!isClient == SERVERBIT_ISSET(dpkt->pktNo))
 			return;
-		if(dpkt->pktNo == lastAPkt.pktNo && !noDataYet){ // Resend ack
-			lastAPkt.receivedCount++;
-			sendPacket(&lastAPkt, sizeof(ACK));
-		}else{
-			lastAPkt.errflags = {0};
-			uint16_t expectedNo = REALPKTNO(lastAPkt.pktNo)+1;
-			expectedNo = expectedNo ? expectedNo : 1; // Prevent zero
-			if(expectedNo != REALPKTNO(dpkt->pktNo)){ //Packet no out of order
-				lastAPkt.errflags.bits.pkgOrderError = 1;
-				lastAPkt.errflags.bits.pkgIgnored = 1;
-				std::cerr << "Packet out of order!" << std::endl;
-			}else if(fletcher16(dpkt->length, (void*)dpkt->data) == dpkt->checksum){ // Packet OK!
+		uint16_t dist = pktNoDist(lastAPkt.pktNo, dpkt->pktNo);
+		if(dist == 1){
+			uint16_t len = dpkt.length();
+			if(len > in.space() || (options.recvBufSize && in.size() + len > options.recvBufSize)){
+				// No room, the sender is asked to resend once there is (instead of after its backed off timeout)
+				traceEvent(TRACE_DROP, tDATA, dpkt->pktNo, len, rxPath, ACKERR_PKGIGNORED);
+				dropped = len;
+				return;
+			}
+			if(receive(dpkt)){ // Packet OK!
 				noDataYet = false;
-				in.insert(in.end(), &dpkt->data[0], &dpkt->data[dpkt->length]);
+				orderErrSent = false;
+				lastAPkt.pktNo = dpkt->pktNo;
+				lastAPkt.receivedCount = 1;
+				uint16_t released = 0;
+				if(heldCount){
+					Held& h = held[REALPKTNO(dpkt->pktNo) % maxHeld];
+					if(h.pktNo == dpkt->pktNo){ // Also arrived out of order before
+						h.pktNo = 0;
+						heldCount--;
+					}
+					released = releaseHeld();
+				}
+				uint32_t ackDelay = Policy::Ack::ackDelay(options);
+				if(!ackDelay || released || ++unacked >= 2){ // Delayed ACKs cover at most two packets
+					sendAck();
+				}else if(unacked == 1){
+					ackDue = Clock::now() + std::chrono::milliseconds(ackDelay);
+				}
 			}else{ // Checksum error
-				lastAPkt.errflags.bits.chksumErr = 1;
-				lastAPkt.errflags.bits.pkgIgnored = 1;
-				std::cerr << "Checksum error!" << std::endl;
+				stats.count(stats.checksumErrors);
+				traceEvent(TRACE_DROP, tDATA, dpkt->pktNo, dpkt.length(), rxPath, ACKERR_CHKSUM);
+				sendError(dpkt, false);
+			}
+		}else if(!noDataYet && (dist == 0 || dist > 0x7FFF - maxWindow)){ // Resend ack
+			stats.count(stats.duplicates);
+			traceEvent(TRACE_DROP, tDATA, dpkt->pktNo, dpkt.length(), rxPath, 0);
+			lastAPkt.receivedCount++;
+			sendAck();
+		}else if(pathCount() > 1 && dist <= maxHeld){ // Probably overtook one sent on a slower path
+			hold(dpkt);
+		}else{ //Packet no out of order
+			stats.count(stats.orderErrors);
+			traceEvent(TRACE_DROP, tDATA, dpkt->pktNo, dpkt.length(), rxPath, ACKERR_PKGORDER);
+			if(!orderErrSent){
+				orderErrSent = true;
+				sendError(dpkt, true);
 			}
-			// TODO: Check if pkt is large enough
-			lastAPkt.connection = connection;
-			lastAPkt.receivedCount = 1;
-			lastAPkt.pktNo = dpkt->pktNo;
-			sendPacket(&lastAPkt, sizeof(ACK));
 		}
 	}
+	// Sends a delayed ACK once due
+	void work(){
+		if(unacked && Clock::now() >= ackDue)
+			sendAck();
+		stats.receiver(in.size());
+	}
+	int nextTimeout(){
+		if(!unacked)
+			return -1;
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(ackDue - Clock::now());
+		return std::max((int)left.count(), 0);
+	}
 public:
 	uint32_t read(char* buf, uint32_t len){
-		uint32_t realSz = std::min(len, (uint32_t)in.size());
-		std::memcpy(buf, in.data(), realSz);
-		in.erase(in.begin(), in.begin()+realSz);
+		uint32_t realSz = in.peek(buf, len);
+		in.consume(realSz);
+		madeRoom();
 		return realSz;
 	};
+	// Bytes received, which can be read without blocking
+	uint32_t available(){
+		return in.size();
+	}
+	/*
+	 * Zero copy alternative to read(): points up to two iovecs at the first len received
+	 * bytes and returns how many were used. The data stays valid until consume() or
+	 * the next work() call.
+	 */
+	int peek(struct iovec iov[2], uint32_t len = UINT32_MAX){
+		return in.segments(iov, len);
+	}
+	// Drops len bytes previously returned by peek()
+	void consume(uint32_t len){
+		in.consume(len);
+		madeRoom();
+	}
+protected:
+	// Writes as much received data to fd as possible without blocking
+	void readTo(int fd){
+		struct iovec iov[2];
+		int cnt = in.segments(iov, in.size());
+		if(!cnt)
+			return;
+		ssize_t w = ::writev(fd, iov, cnt);
+		if(w > 0){
+			in.consume(w);
+			madeRoom();
+		}
+	}
 };
 
-template<bool isClient>
-class ConnectionBase: public ReadConnection<isClient>, public WriteConnection<isClient>{
-	friend class Listener;
+template<bool isClient, typename Policy = DefaultPolicy>
+class ConnectionBase: public ReadConnection<isClient, Policy>, public WriteConnection<isClient, Policy>{
+	template<typename> friend class BasicListener;
+	typedef ReadConnection<isClient, Policy> Read;
+	typedef WriteConnection<isClient, Policy> Write;
+	typedef typename Policy::Clock Clock;
+private:
+	// Upper limit of unacknowledged data, before the stream socket is not read anymore (if no send buffer limit is set)
+	static const uint32_t streamBufSize = 64*1024;
+	int evFd = -1;
+	bool evSet = false;
+	int pairFd[2] = {-1, -1}; // [0] library end, [1] application end
+	int pipeFd[2] = {-1, -1};
+	bool pairShutdown = false;
+	uint32_t kaTxCount = 0; // txCount when kaStart was taken
+	typename Clock::time_point kaStart; // Nothing was sent since
+	void openPipe(){
+		if(pipeFd[0] == -1 && pipe2(pipeFd, O_CLOEXEC) == -1)
+			throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Could not create pipe: "+std::string(strerror(errno))));
+	}
 protected:
 	bool isConnected = false;
 	bool connectionClosed = false;
 	ConnectionBase(std::string iface, mac_t remoteMac, uint32_t connection):
 		ConnectedSocket(iface, remoteMac, connection),
-		ReadConnection<isClient>(iface, remoteMac, connection),
-		WriteConnection<isClient>(iface, remoteMac, connection){
+		Read(iface, remoteMac, connection),
+		Write(iface, remoteMac, connection){
+	}
+	virtual ~ConnectionBase(){
+		for(int fd : {evFd, pairFd[0], pairFd[1], pipeFd[0], pipeFd[1]})
+			if(fd != -1)
+				::close(fd);
+	}
+	// The frames queued on the Demux of the parent are lost for a forked child, the remote resends them
+	void reattached() override{
+		if(isConnected)
+			Read::requestResend();
+	}
+	// Bytes taken from the stream socket to be sent, before it is not read anymore
+	uint32_t streamSpace(){
+		return std::min(Write::writeSpace(), streamBufSize - std::min(streamBufSize, Write::pending()));
+	}
+	// Has to be called after each work(), moves data through the stream socket and updates the ready fd
+	void updateEvents(){
+		if(pairFd[0] != -1){
+			Read::readTo(pairFd[0]);
+			if(isConnected){
+				char buf[4096];
+				ssize_t r = -1;
+				uint32_t space;
+				while((space = streamSpace()) && (r = ::read(pairFd[0], buf, std::min((uint32_t)sizeof(buf), space))) > 0)
+					Write::write(buf, r);
+				if(r == 0) // Application closed its end
+					close();
+			}
+			if(connectionClosed && !pairShutdown && !Read::available()){
+				shutdown(pairFd[0], SHUT_WR);
+				pairShutdown = true;
+			}
+		}
+		if(evFd != -1){
+			bool ready = Read::available() || connectionClosed;
+			uint64_t val = 1;
+			if(ready && !evSet){
+				evSet = ::write(evFd, &val, sizeof(val)) == sizeof(val);
+			}else if(!ready && evSet){
+				evSet = !(::read(evFd, &val, sizeof(val)) == sizeof(val));
+			}
+		}
+	}
+	// Restarts the keepalive timer, if something was sent since it was started
+	void updateKeepalive(typename Clock::time_point now){
+		if(ConnectedSocket::txCount != kaTxCount){
+			kaTxCount = ConnectedSocket::txCount;
+			kaStart = now;
+		}
 	}
+	// Timers of a connected connection: delayed ACKs, retransmissions, new packets, keepalive
+	void workConnected(){
+		ConnectedSocket::relinkDown(); // Packets are lost (or sent on other paths) until the interface is back
+		if(ConnectedSocket::pathCount() > 1)
+			probePaths();
+		Read::work();
+		Write::work();
+		if(ConnectedSocket::options.keepalive){
+			auto now = Clock::now();
+			updateKeepalive(now);
+			if(now - kaStart >= std::chrono::milliseconds(ConnectedSocket::options.keepalive))
+				Read::sendAck();
+		}
+	}
+	// Probes failed paths, they are used again once the remote answers on them
+	void probePaths(){
+		auto now = std::chrono::steady_clock::now();
+		for(uint8_t i = 0; i < ConnectedSocket::pathCount(); i++){
+			Path& path = ConnectedSocket::pathAt(i);
+			if(!path.confirmed || path.link.down || path.timeouts < maxPathTimeouts
+					|| now - path.probed < std::chrono::milliseconds(pathProbeInterval))
+				continue;
+			path.probed = now;
+			ACK probe;
+			probe.connection = ConnectedSocket::connection;
+			probe.pktNo = 0;
+			probe.receivedCount = 1;
+			probe.errflags = ACKFLAGS_PROBE;
+			struct iovec iov = {&probe, sizeof(ACK)};
+			ConnectedSocket::sendPacket(i, &iov, 1);
+		}
+	}
+	int nextTimeoutConnected(){
+		int tmout = -1;
+		for(int t : {Read::nextTimeout(), Write::nextTimeout()})
+			if(t >= 0 && (tmout < 0 || t < tmout))
+				tmout = t;
+		if(ConnectedSocket::options.keepalive){
+			auto now = Clock::now();
+			updateKeepalive(now);
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(kaStart + std::chrono::milliseconds(ConnectedSocket::options.keepalive) - now);
+			int t = std::max((int)left.count(), 0);
+			if(tmout < 0 || t < tmout)
+				tmout = t;
+		}
+		return tmout;
+	}
+	// Handles a packet of the established connection, CONNECTs are handled by work() of the server
 	void handlePacket(const PktBase* pkt, uint16_t pktSize){
-		if(pkt->type == tACK){
-			WriteConnection<isClient>::handlePacket((ACK*)pkt, pktSize);
+		if(pkt->type == tACK && (((ACK*)pkt)->errflags & ACKFLAGS_PROBE)){
+			Read::sendAck(ConnectedSocket::rxPath);
+		}else if(pkt->type == tACK){
+			Write::handlePacket((ACK*)pkt, pktSize);
 		}else if(pkt->type == tDATA){
-			ReadConnection<isClient>::handlePacket((DATA*)pkt, pktSize);
-		}else if(pkt->type == tCONNECT){
-			//TODO: error
-		}else if(pkt->type == tCLOSE){
-			/*ACK apkt;
-			apkt.type = tACK;
-			apkt.connection = connection;
-			uint16_t pktNo = lastPkt ? lastPkt->pktNo + 1 : 1;
-			if(REALPKTNO(pktNo) == 0)
-				pktNo = 1;
-			if(isClient)
-				pktNo = CLIENTBIT_CLEAR(pktNo);
-			else
-				pktNo = SERVERBIT_SET(pktNo);
-			apkt.pktNo = pktNo;
-			apkt.receivedCount = 1;
-			apkt.errflags = 0;
-			sendPacket(&apkt, sizeof(ACK));*/
+			DataView dpkt(pkt, pktSize, Policy::Checksum::type(ConnectedSocket::chksumType));
+			if(dpkt.valid()) // The payload length has to fit into the frame
+				Read::handlePacket(dpkt);
+		}else if(pkt->type == tCLOSE){ // Not acknowledged, the remote does not wait for an answer
 			isConnected = false;
 			connectionClosed = true;
 		}
@@ -189,106 +719,459 @@ public:
 	bool connected(){
 		return isConnected;
 	}
+	bool closed(){
+		return connectionClosed;
+	}
+	uint32_t read(char* buf, uint32_t len){
+		uint32_t r = Read::read(buf, len);
+		updateEvents();
+		return r;
+	}
+	void consume(uint32_t len){
+		Read::consume(len);
+		updateEvents();
+	}
+	/*
+	 * Returns an eventfd, which is readable as long as data can be read or the connection
+	 * was closed. Together with getFd() (readable -> call work()), the fd of the Demux (readable ->
+	 * Demux::dispatch()) and nextTimeout() this allows waiting on many connections with poll/epoll/libuv.
+	 */
+	int readyFd(){
+		if(evFd == -1){
+			evFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if(evFd == -1)
+				throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Could not create eventfd: "+std::string(strerror(errno))));
+			updateEvents();
+		}
+		return evFd;
+	}
+	/*
+	 * Switches the connection into socketpair mode and returns the application end of a unix stream
+	 * socket. Everything received is written to it and everything written to it is sent, work() still
+	 * has to be called, also after writing to it (see streamWorkFd()). read()/write() must not be used
+	 * anymore. Closing it closes the connection, a closed connection results in EOF.
+	 */
+	int streamFd(){
+		if(pairFd[0] == -1){
+			if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pairFd) == -1)
+				throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Could not create socketpair: "+std::string(strerror(errno))));
+			fcntl(pairFd[0], F_SETFL, fcntl(pairFd[0], F_GETFL, 0) | O_NONBLOCK);
+			updateEvents();
+		}
+		return pairFd[1];
+	}
+	/*
+	 * Library end of the stream socket, readable once the application wrote to streamFd(): call work()
+	 * to send it. Waiting on getFd() and readyFd() does not cover this. -1 (ignored by poll) while not in
+	 * socketpair mode or while the send buffer is full, then the ACKs freeing it arrive on getFd(). So it
+	 * has to be asked for again after each work().
+	 */
+	int streamWorkFd(){
+		return isConnected && streamSpace() ? pairFd[0] : -1;
+	}
+	// Moves up to len received bytes from the stream socket into fd (e.g. a file) without copying through userspace
+	ssize_t spliceTo(int fd, size_t len){
+		openPipe();
+		ssize_t r = splice(streamFd(), nullptr, pipeFd[1], nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(r <= 0)
+			return r;
+		ssize_t done = 0;
+		while(done < r){
+			ssize_t w = splice(pipeFd[0], nullptr, fd, nullptr, r-done, SPLICE_F_MOVE);
+			if(w <= 0)
+				return -1;
+			done += w;
+		}
+		return done;
+	}
+	// Moves up to len bytes from fd into the stream socket, to be sent
+	ssize_t spliceFrom(int fd, size_t len){
+		openPipe();
+		ssize_t r = splice(fd, nullptr, pipeFd[1], nullptr, len, SPLICE_F_MOVE);
+		if(r <= 0)
+			return r;
+		ssize_t done = 0;
+		while(done < r){
+			ssize_t w = splice(pipeFd[0], nullptr, streamFd(), nullptr, r-done, SPLICE_F_MOVE);
+			if(w <= 0)
+				return -1;
+			done += w;
+		}
+		return done;
+	}
 	void close(){
 		if(isConnected){
 			CLOSE closepkt;
 			closepkt.type = tCLOSE;
 			closepkt.connection = ConnectedSocket::connection;
-			uint16_t pktNo = WriteConnection<isClient>::lastPkt ? WriteConnection<isClient>::lastPkt->pktNo + 1 : 1;
-			if(REALPKTNO(pktNo) == 0)
-				pktNo = 1;
-			if(isClient)
-				pktNo = CLIENTBIT_CLEAR(pktNo);
-			else
-				pktNo = SERVERBIT_SET(pktNo);
-			closepkt.pktNo = pktNo;
-			ReadConnection<isClient>::sendPacket((void*)&closepkt, sizeof(CLOSE));
+			closepkt.pktNo = nextPktNo(Write::lastPktNo, isClient);
+			Read::sendPacket((void*)&closepkt, sizeof(CLOSE));
 			isConnected = false;
 			connectionClosed = true;
+			updateEvents();
 		}
 	}
 };
 
+template<bool isClient, typename Policy>
+const uint32_t ConnectionBase<isClient, Policy>::streamBufSize;
+
+// Random token (never 0) handed to a client, which may resume its connection with it
+uint64_t newResumeToken(){
+	std::random_device rd; // Not predictable, unlike the ids
+	uint64_t token = 0;
+	while(!token)
+		token = (uint64_t)rd() << 32 | rd();
+	return token;
+}
 
-class ServerConnection : public ConnectionBase<false>{
-friend class Listener;
+template<typename Policy>
+class BasicServerConnection : public ConnectionBase<false, Policy>{
+	friend class BasicListener<Policy>;
+	typedef ConnectionBase<false, Policy> Base;
+	using Base::isConnected;
+	using Base::connectionClosed;
+	using Base::connection;
+	using Base::chksumType;
+	using Base::sendPacket;
+	using Base::recvPkt;
+	using Base::handlePacket;
+	using Base::workConnected;
+	using Base::nextTimeoutConnected;
+	using Base::updateEvents;
 private:
 	uint8_t receivedCONNECTs = 1;
-	ServerConnection(std::string iface, mac_t remoteMac, uint32_t connection):
-		ConnectedSocket(iface, remoteMac, connection),
-		ConnectionBase(iface, remoteMac, connection){
+	uint16_t service;
+	bool earlyAccepted = false; // The first DATA packet came with the CONNECT
+	uint64_t token = 0; // Lets the client resume the connection, 0: not resumable
+	BasicServerConnection(std::string iface, mac_t remoteMac, const CONNECT* cpkt, uint16_t size, uint8_t chksum, ConnectionOptions options,
+			TraceRing* trace = nullptr):
+		ConnectedSocket(iface, remoteMac, cpkt->connection, options),
+		Base(iface, remoteMac, cpkt->connection), service(cpkt->service){
+		chksumType = chksum;
+		this->setTrace(trace);
+		if((cpkt->flags & CONNFLAG_RESUMABLE) && options.resumable)
+			token = newResumeToken();
+		receiveEarly(cpkt, size);
+		sendConnectAck();
+		isConnected = true;
+	}
+	// Takes the DATA packet following a CONNECT, if the client sent one and its checksum type is supported
+	void receiveEarly(const CONNECT* cpkt, uint16_t size){
+		if(earlyAccepted || !(cpkt->flags & CONNFLAG_DATA) || size <= sizeof(CONNECT))
+			return;
+		uint8_t type = CONNFLAG_DATA_CHKSUM_GET(cpkt->flags);
+		if(!(Policy::Checksum::supported(this->options.checksums) & CONNFLAG_CHKSUM(type)))
+			return; // The client resends it with the negotiated checksum
+		DataView dpkt((const char*)cpkt + sizeof(CONNECT), size - sizeof(CONNECT), type);
+		earlyAccepted = dpkt.valid() && dpkt->type == tDATA && this->acceptEarly(dpkt);
+	}
+	// Answers a CONNECT (on path, -1: the best one) with the chosen checksum type, also acknowledging the DATA packet it carried
+	void sendConnectAck(int path = -1){
 		ACK apkt;
 		apkt.type = tACK;
 		apkt.connection = connection;
 		apkt.pktNo = 0;
 		apkt.receivedCount = receivedCONNECTs;
-		sendPacket(&apkt, sizeof(ACK));
-		isConnected = true;
+		apkt.errflags = ACKFLAGS_CHKSUM(chksumType) | (earlyAccepted ? ACKFLAGS_DATA : 0) | (token ? ACKFLAGS_TOKEN : 0);
+		le64 tok = token;
+		struct iovec iov[2] = {{&apkt, sizeof(ACK)}, {&tok, sizeof(le64)}};
+		sendPacket(path, iov, token ? 2 : 1);
+	}
+	/*
+	 * Continues the connection, after the client lost the link (possibly coming back with another MAC):
+	 * both sides resend what is in flight, so the transfer goes on from the last acknowledged packet.
+	 * With CONNFLAG_PATH the client adds another path instead (see Client::addPath()).
+	 */
+	void resume(const mac_t& src, int ifIndex, const CONNECT* cpkt, uint16_t size){
+		if(!token || size < sizeof(CONNECT) + sizeof(le64) || getLE<uint64_t>((const char*)cpkt + sizeof(CONNECT)) != token)
+			return;
+		receivedCONNECTs = cpkt->sentCount;
+		if(cpkt->flags & CONNFLAG_PATH){
+			int path = this->findPath(src, ifIndex);
+			if(path < 0){
+				try{
+					path = this->addPath(linkOf(ifIndex), src);
+				}catch(std::unique_ptr<std::runtime_error>&){
+				}
+			}
+			if(path >= 0)
+				sendConnectAck(path);
+			return;
+		}
+		this->setRMac(src, ifIndex);
+		sendConnectAck(0);
+		this->restart();
+		this->sendAck();
 	}
 public:
+	// Service requested by the client
+	uint16_t getService(){
+		return service;
+	}
 	void work(bool wait = false){
 		if(!connectionClosed){
-			auto pkt = recvPkt(wait);
+			uint16_t size;
+			mac_t src;
+			int ifIndex;
+			auto pkt = recvPkt(size, wait, &src, &ifIndex);
 			if(pkt){
-				if(pkt->type == tCONNECT){
-					ACK apkt;
-					apkt.type = tACK;
-					apkt.connection = connection;
-					apkt.pktNo = 0;
-					apkt.receivedCount = ++receivedCONNECTs; //TODO: increase received
-					sendPacket(&apkt, sizeof(ACK));
+				const CONNECT* cpkt = (CONNECT*)pkt.get();
+				if(pkt->type == tCONNECT && (cpkt->flags & CONNFLAG_RESUME)){
+					resume(src, ifIndex, cpkt, size);
+				}else if(pkt->type == tCONNECT){
+					if(std::memcmp(src.bytes, this->getRMac().bytes, sizeof(mac_t)) == 0){ // Not another client using the same id
+						receivedCONNECTs++;
+						receiveEarly(cpkt, size);
+						sendConnectAck();
+					}
 				}else
-					handlePacket(pkt.get(), 0); //TODO: add real size
+					handlePacket(pkt.get(), size);
 			}
 			if(isConnected)
-				WriteConnection::work();
+				workConnected();
+			updateEvents();
 		}
 	}
+	int nextTimeout(){
+		return connectionClosed ? -1 : nextTimeoutConnected();
+	}
 };
 
-class Client: public ConnectionBase<true>{
+// Connection ids of the clients of this process and the random generator for them
+struct ClientIds{
+	std::mutex lock;
+	std::mt19937 rng{std::random_device()()};
+	ConnectionTable<bool> live;
+};
+ClientIds& clientIds(){
+	static ClientIds ids;
+	return ids;
+}
+// Returns a random id (never 0), which no other client of this process uses towards remoteMac
+uint32_t claimConnectionId(const mac_t& remoteMac){
+	ClientIds& ids = clientIds();
+	std::lock_guard<std::mutex> guard(ids.lock);
+	ConnKey key = {remoteMac, 0};
+	while(!key.connection || ids.live.find(key))
+		key.connection = ids.rng();
+	ids.live.insert(key, true);
+	return key.connection;
+}
+void releaseConnectionId(const mac_t& remoteMac, uint32_t connection){
+	ClientIds& ids = clientIds();
+	std::lock_guard<std::mutex> guard(ids.lock);
+	ids.live.erase({remoteMac, connection});
+}
+// Randomly 75% to 125% of ms, so clients started together do not retry in lockstep
+uint32_t withJitter(uint32_t ms){
+	ClientIds& ids = clientIds();
+	std::lock_guard<std::mutex> guard(ids.lock);
+	return ms*3/4 + ids.rng() % (ms/2 + 1);
+}
+
+template<typename Policy>
+class BasicClient: public ConnectionBase<true, Policy>{
+	typedef ConnectionBase<true, Policy> Base;
+	typedef typename Policy::Clock Clock;
+	using Base::isConnected;
+	using Base::connectionClosed;
+	using Base::connection;
+	using Base::chksumType;
+	using Base::options;
+	using Base::sendPacket;
+	using Base::recvPkt;
+	using Base::handlePacket;
+	using Base::workConnected;
+	using Base::nextTimeoutConnected;
+	using Base::updateEvents;
 private:
 	CONNECT cpkt;
-	std::chrono::time_point<std::chrono::system_clock> sent;
-	uint32_t rndConnection(){
-		//TODO: implement
-		return 123;
+	typename Clock::time_point sent;
+	uint32_t retryInterval; // Backs off exponentially
+	uint32_t retryIn; // retryInterval with jitter
+	le64 token = (uint64_t)0; // Handed out by the server, 0: the connection cannot be resumed
+	bool resuming = false; // A CONNECT with the token was sent, but not answered yet
+	/*
+	 * Sends the CONNECT with the first DATA packet (if there is one) or with the token when resuming
+	 * and schedules the next retry.
+	 */
+	void sendConnect(){
+		struct iovec iov[3] = {{&cpkt, sizeof(CONNECT)}, {&token, sizeof(le64)}};
+		int cnt = resuming ? 2 : 1 + this->earlyIov(&iov[1], cpkt.sentCount);
+		sendPacket(0, iov, cnt);
+		sent = Clock::now();
+		retryIn = withJitter(retryInterval);
+		retryInterval = std::min(retryInterval*2, std::max(options.connectRetryMax, options.connectRetry));
+	}
+	// Asks the server to add path to the connection, repeated until it answered on it
+	void sendJoin(uint8_t path){
+		CONNECT jpkt = cpkt;
+		jpkt.flags = Policy::Checksum::supported(options.checksums) | CONNFLAG_RESUME | CONNFLAG_PATH;
+		jpkt.sentCount = 1;
+		struct iovec iov[2] = {{&jpkt, sizeof(CONNECT)}, {&token, sizeof(le64)}};
+		sendPacket(path, iov, 2);
+		this->pathAt(path).probed = std::chrono::steady_clock::now();
 	}
 public:
-	Client(std::string iface, mac_t remoteMac, uint16_t service):
-		ConnectedSocket(iface, remoteMac, rndConnection()),
-		ConnectionBase(iface, remoteMac, connection){
+	/*
+	 * The server chooses one of the checksums offered in options (check getChecksumType() once connected),
+	 * a fixed checksum policy only offers its own. The start of earlyData (as much as fits into
+	 * a frame) is sent along with the CONNECT, so the server can answer it in the first round trip,
+	 * the rest is queued (even beyond the high watermark) and sent once connected. Throws if the
+	 * send buffer of the policy cannot hold earlyData.
+	 */
+	BasicClient(std::string iface, mac_t remoteMac, uint16_t service, ConnectionOptions options = ConnectionOptions(),
+			const std::string& earlyData = std::string()):
+		ConnectedSocket(iface, remoteMac, claimConnectionId(remoteMac), options),
+		Base(iface, remoteMac, connection){
 		cpkt.connection = connection;
 		cpkt.service = service;
+		cpkt.flags = Policy::Checksum::supported(options.checksums) | (options.resumable ? CONNFLAG_RESUMABLE : 0);
 		cpkt.type = tCONNECT;
 		cpkt.sentCount = 1;
-		sendPacket(&cpkt, sizeof(CONNECT));
-		sent = std::chrono::system_clock::now();
+		uint32_t taken = 0;
+		if(!earlyData.empty()){
+			// Every server supports fletcher16, fixed checksum policies have to use theirs
+			uint8_t type = Policy::Checksum::type(cFLETCHER16);
+			uint32_t hdrLen = sizeof(CONNECT) + dataHdrLen(type);
+			taken = this->queueEarly(earlyData.data(), earlyData.size(), type, options.mtu > hdrLen ? options.mtu - hdrLen : 0);
+			if(taken)
+				cpkt.flags = cpkt.flags | CONNFLAG_DATA | CONNFLAG_DATA_CHKSUM(type);
+		}
+		if(taken < earlyData.size() && !this->writeAll(earlyData.data() + taken, earlyData.size() - taken)){
+			releaseConnectionId(remoteMac, connection);
+			throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Early data does not fit into the send buffer"));
+		}
+		retryInterval = std::max(options.connectRetry, (uint32_t)1);
+		sendConnect();
 	};
+	virtual ~BasicClient(){
+		releaseConnectionId(this->getRMac(), connection);
+	}
+	/*
+	 * Re-attaches to the server connection after the link was lost, e.g. the interface went down
+	 * (work() does this by itself then) or to continue over another interface iface. Once the server
+	 * answered, the unacknowledged data is resent and the transfer goes on where it stopped.
+	 * Returns false if the connection cannot be resumed (see ConnectionOptions::resumable) or iface does not exist.
+	 */
+	bool resume(std::string iface = ""){
+		if(!isConnected || !token)
+			return false;
+		if(!this->relink(iface) && !iface.empty())
+			return false;
+		cpkt.flags = (cpkt.flags & ~(CONNFLAG_DATA | CONNFLAG_DATA_CHKSUM(0x3))) | CONNFLAG_RESUME;
+		cpkt.sentCount = 1;
+		resuming = true;
+		retryInterval = std::max(options.connectRetry, (uint32_t)1);
+		sendConnect();
+		return true;
+	}
+	/*
+	 * Adds a path over the local interface iface to the server at remoteMac (its MAC on that network).
+	 * Once the server confirmed it, DATA is spread over all paths by their round trip time, paths
+	 * which time out are avoided until they answer again. Returns false if iface does not exist or
+	 * the connection cannot be resumed (the server uses the token to recognise the connection).
+	 */
+	bool addPath(std::string iface, mac_t remoteMac){
+		if(!isConnected || !token)
+			return false;
+		int path;
+		try{
+			path = Base::addPath(Link(iface), remoteMac, false);
+		}catch(std::unique_ptr<std::runtime_error>&){
+			return false;
+		}
+		if(path < 0)
+			return false;
+		sendJoin(path);
+		return true;
+	}
 	void work(){
 		if(!connectionClosed){
-			auto pkt = recvPkt();
+			uint16_t size;
+			auto pkt = recvPkt(size);
 			if(pkt){
-				if(!isConnected){
+				if(isConnected && pkt->type == tACK && pkt->pktNo == 0 && (((ACK*)pkt.get())->errflags & ACKFLAGS_TOKEN)
+						&& size >= sizeof(ACK) + sizeof(le64) && getLE<uint64_t>((char*)pkt.get() + sizeof(ACK)) == token){
+					this->pathAt(this->rxPath).confirmed = true; // Answers a CONNECT resuming or adding this path
+					if(resuming){
+						resuming = false;
+						this->restart();
+						this->sendAck();
+					}
+				}else if(!isConnected){
 					if(pkt->type == tACK && pkt->connection == connection && pkt->pktNo == 0){
+						// Servers without negotiation always answer with 0 (fletcher16)
+						uint8_t chksum = ACKFLAGS_CHKSUM_GET(((ACK*)pkt.get())->errflags);
+						if(chksum > maxChksumType || !(cpkt.flags & CONNFLAG_CHKSUM(chksum)))
+							throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Server chose a checksum, which was not offered"));
+						chksumType = chksum;
 						isConnected = true;
+						if((((ACK*)pkt.get())->errflags & ACKFLAGS_TOKEN) && size >= sizeof(ACK) + sizeof(le64))
+							token = getLE<uint64_t>((char*)pkt.get() + sizeof(ACK));
+						if(((ACK*)pkt.get())->errflags & ACKFLAGS_DATA){
+							ACK dataAck; // Acknowledges the DATA packet sent with the CONNECT
+							dataAck.connection = connection;
+							dataAck.pktNo = nextPktNo(0, true);
+							dataAck.receivedCount = 1;
+							handlePacket((PktBase*)&dataAck, sizeof(ACK));
+						}else if(cpkt.flags & CONNFLAG_DATA){ // Not taken (e.g. by older servers)
+							this->resealInFlight();
+						}
 					}
 				}else{
-					handlePacket(pkt.get(), 0); //TODO: add real size
+					handlePacket(pkt.get(), size);
 				}
 			}
-			if(!isConnected){
-				using namespace std::chrono_literals;
-				if(std::chrono::system_clock::now() - sent > 2s){
-					cpkt.sentCount++;
-					sendPacket(&cpkt, sizeof(CONNECT));
-					sent = std::chrono::system_clock::now();
+			if(isConnected && !resuming && token && this->linkDown())
+				resume();
+			if(!isConnected || resuming){
+				if(Clock::now() - sent > std::chrono::milliseconds(retryIn)){
+					if(resuming)
+						this->relink();
+					if(cpkt.sentCount < UINT8_MAX) // Saturates, 1 would make the listener start another connection
+						cpkt.sentCount++;
+					sendConnect();
 				}
 			}else{
-				WriteConnection::work();
+				auto now = std::chrono::steady_clock::now();
+				for(uint8_t i = 1; i < this->pathCount(); i++)
+					if(!this->pathAt(i).confirmed && now - this->pathAt(i).probed > std::chrono::milliseconds(options.connectRetryMax))
+						sendJoin(i);
+				workConnected();
 			}
+			updateEvents();
 		}
 	}
+	int nextTimeout(){
+		if(connectionClosed)
+			return -1;
+		if(!isConnected || resuming){
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(sent + std::chrono::milliseconds(retryIn) - Clock::now());
+			return std::max((int)left.count(), 0);
+		}
+		return nextTimeoutConnected();
+	}
 };
 
+typedef BasicServerConnection<DefaultPolicy> ServerConnection;
+typedef BasicClient<DefaultPolicy> Client;
+
+/*
+ * Writes all of data to the connection conn (Client or ServerConnection), calling its work()
+ * while the send buffer is full. Returns false if the connection was closed or run became false before.
+ */
+template<typename Connection>
+bool writeBlocking(Connection* conn, const char* data, uint32_t len, const std::atomic_bool* run = nullptr){
+	uint32_t written = 0;
+	while(written < len){
+		if(conn->closed() || (run && !*run))
+			return false;
+		written += conn->write(data + written, len - written);
+		conn->work();
+	}
+	return true;
+}
+
 };
@@ -0,0 +1,461 @@
+/*
+ * libetherstream.coro.hpp
+ *
+ * C++20 coroutine interface of connections and listeners.
+ */
+
+#pragma once
+
+#if !defined(__cpp_impl_coroutine)
+#error "libetherstream.coro.hpp requires a C++20 compiler with coroutine support"
+#endif
+
+extern "C"{
+#include <sys/epoll.h>
+#include <unistd.h>
+}
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <functional>
+#include <list>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <memory>
+
+#include "libetherstream.connection.hpp"
+#include "libetherstream.listener.hpp"
+
+namespace ethstream{
+
+/*
+ * Fire and forget coroutine, e.g. one per accepted connection:
+ *   Task session(EventLoop& loop, ServerConnection* c){ ... co_await ... }
+ * The coroutine starts running immediately and frees itself when done.
+ */
+struct Task{
+	struct promise_type{
+		Task get_return_object(){
+			return Task();
+		}
+		std::suspend_never initial_suspend() noexcept{
+			return {};
+		}
+		std::suspend_never final_suspend() noexcept{
+			return {};
+		}
+		void return_void(){
+		}
+		void unhandled_exception(){
+			throw;
+		}
+	};
+};
+
+/*
+ * Drives the work() of the attached connections and listeners and resumes suspended coroutines,
+ * once the condition they are waiting for is met. A source is worked when its fd became readable
+ * or its timeout() expired, only the coroutines waiting for it are checked afterwards.
+ */
+class EventLoop{
+private:
+	typedef std::chrono::steady_clock Clock;
+	struct Waiter{
+		std::function<bool()> ready;
+		std::coroutine_handle<> handle;
+	};
+	struct Source{
+		int fd;
+		std::function<void()> work;
+		std::function<int()> timeout;
+		Clock::time_point deadline = Clock::time_point::max(); // max: no timer
+		uint64_t worked = 0; // Iteration it was worked in last
+		std::list<Waiter> waiters;
+	};
+	int epfd = -1;
+	bool stopped = false;
+	int tick; // ms, upper bound of time between two loop iterations, all sources are worked once per tick
+	uint64_t iteration = 0;
+	size_t waiting = 0;
+	std::unordered_map<const void*, Source> sources;
+	std::unordered_map<int, std::vector<const void*>> fds; // fd -> sources reading it
+	std::set<std::pair<Clock::time_point, const void*>> timers; // Deadlines of the sources, earliest first
+	std::list<Waiter> unattached; // Waiting for sources not attached (anymore), checked every iteration
+	std::shared_ptr<Demux> demux; // Receives the frames of the attached connections
+
+	// Sets the timer of key to its timeout() from now
+	void schedule(const void* key){
+		auto it = sources.find(key);
+		if(it == sources.end())
+			return;
+		Source& s = it->second;
+		if(s.deadline != Clock::time_point::max())
+			timers.erase({s.deadline, key});
+		int t = s.timeout ? s.timeout() : -1;
+		s.deadline = t >= 0 ? Clock::now() + std::chrono::milliseconds(t) : Clock::time_point::max();
+		if(t >= 0)
+			timers.insert({s.deadline, key});
+	}
+	void workSource(const void* key){
+		auto it = sources.find(key);
+		if(it == sources.end())
+			return;
+		it->second.work();
+		schedule(key);
+	}
+	// Resumes the waiters of list which became ready and removes them from it
+	void resume(std::list<Waiter>& list){
+		for(auto it = list.begin(); it != list.end();){
+			if(it->ready()){
+				auto h = it->handle;
+				it = list.erase(it);
+				waiting--;
+				h.resume();
+			}else{
+				++it;
+			}
+		}
+	}
+	// Resumes the waiters of key, which became ready
+	void resumeSource(const void* key){
+		auto it = sources.find(key);
+		if(it == sources.end() || it->second.waiters.empty())
+			return;
+		// Resumed coroutines may add waiters, detach the source or write to it meanwhile
+		std::list<Waiter> list;
+		list.swap(it->second.waiters);
+		resume(list);
+		it = sources.find(key);
+		std::list<Waiter>& rest = it != sources.end() ? it->second.waiters : unattached;
+		rest.splice(rest.begin(), list);
+		schedule(key);
+	}
+public:
+	EventLoop(int tick = 1000): tick(tick){
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if(epfd == -1)
+			throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Could not create epoll instance: "+std::string(strerror(errno))));
+	}
+	~EventLoop(){
+		close(epfd);
+	}
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+
+	// Registers key, so its work function is called, whenever fd is readable or timeout() expired
+	void attach(const void* key, int fd, std::function<void()> work, std::function<int()> timeout = nullptr){
+		if(sources.count(key))
+			return;
+		std::vector<const void*>& keys = fds[fd];
+		if(keys.empty()){
+			struct epoll_event ev = {0};
+			ev.events = EPOLLIN;
+			ev.data.fd = fd;
+			if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1){
+				fds.erase(fd);
+				throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Could not add fd to epoll: "+std::string(strerror(errno))));
+			}
+		}
+		keys.push_back(key);
+		Source& s = sources[key];
+		s.fd = fd;
+		s.work = work;
+		s.timeout = timeout;
+		schedule(key);
+	}
+	void detach(const void* key){
+		auto it = sources.find(key);
+		if(it == sources.end())
+			return;
+		int fd = it->second.fd;
+		if(it->second.deadline != Clock::time_point::max())
+			timers.erase({it->second.deadline, key});
+		unattached.splice(unattached.end(), it->second.waiters);
+		sources.erase(it);
+		std::vector<const void*>& keys = fds[fd];
+		keys.erase(std::find(keys.begin(), keys.end(), key));
+		if(keys.empty()){
+			fds.erase(fd);
+			epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+		}
+	}
+	// Passes the frames received by demux to their connections, whose fds become readable then
+	void attach(std::shared_ptr<Demux> demux){
+		if(this->demux == demux)
+			return;
+		if(this->demux)
+			detach(this->demux.get());
+		this->demux = demux;
+		attach(demux.get(), demux->getFd(), [demux](){
+			demux->dispatch();
+		});
+	}
+	// Suspends handle until ready() returns true, ready() is checked whenever the source key was worked
+	void wait(const void* key, std::function<bool()> ready, std::coroutine_handle<> handle){
+		auto it = sources.find(key);
+		(it != sources.end() ? it->second.waiters : unattached).push_back(Waiter{ready, handle});
+		waiting++;
+	}
+
+	// Runs the loop until stop() is called or no coroutine is waiting anymore
+	void run(){
+		stopped = false;
+		std::vector<struct epoll_event> events(64);
+		std::vector<const void*> due;
+		Clock::time_point sweep = Clock::now() + std::chrono::milliseconds(tick);
+		while(!stopped && waiting){
+			Clock::time_point now = Clock::now();
+			Clock::time_point until = sweep;
+			if(!timers.empty() && timers.begin()->first < until)
+				until = timers.begin()->first;
+			int tmout = until > now ? std::chrono::ceil<std::chrono::milliseconds>(until - now).count() : 0;
+			int n = epoll_wait(epfd, events.data(), events.size(), tmout);
+			if(n == -1 && errno != EINTR)
+				throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Error in epoll_wait: "+std::string(strerror(errno))));
+			iteration++;
+			due.clear();
+			for(int i = 0; i < n; i++){
+				auto f = fds.find(events[i].data.fd);
+				if(f != fds.end())
+					due.insert(due.end(), f->second.begin(), f->second.end());
+			}
+			now = Clock::now();
+			if(now >= sweep){
+				// Once per tick every source is worked, e.g. for a listener's timers
+				for(auto& s : sources)
+					due.push_back(s.first);
+				sweep = now + std::chrono::milliseconds(tick);
+			}else{
+				for(auto t = timers.begin(); t != timers.end() && t->first <= now; ++t)
+					due.push_back(t->second);
+			}
+			for(const void* key : due){
+				auto it = sources.find(key);
+				if(it == sources.end() || it->second.worked == iteration)
+					continue;
+				it->second.worked = iteration;
+				workSource(key);
+				resumeSource(key);
+			}
+			if(!unattached.empty()){
+				std::list<Waiter> list;
+				list.swap(unattached);
+				resume(list);
+				unattached.splice(unattached.begin(), list);
+			}
+		}
+	}
+	void stop(){
+		stopped = true;
+	}
+
+	/*
+	 * Base of all awaitables, the condition to wait for is ready(), which is checked
+	 * right away and afterwards whenever the source was worked.
+	 */
+	class Awaitable{
+	private:
+		EventLoop& loop;
+		const void* source;
+	protected:
+		virtual bool ready() = 0;
+	public:
+		Awaitable(EventLoop& loop, const void* source): loop(loop), source(source){
+		}
+		virtual ~Awaitable(){
+		}
+		bool await_ready(){
+			loop.workSource(source);
+			bool r = ready();
+			loop.schedule(source); // ready() may have queued data
+			return r;
+		}
+		void await_suspend(std::coroutine_handle<> h){
+			loop.wait(source, [this](){
+				return ready();
+			}, h);
+		}
+		void await_resume(){
+		}
+	};
+};
+
+/*
+ * Coroutine interface for ServerConnection and Client, the connection is
+ * attached to the loop while this object lives, but not owned by it.
+ */
+template<class Conn>
+class AsyncConnection{
+protected:
+	EventLoop& loop;
+	Conn* conn;
+public:
+	AsyncConnection(EventLoop& loop, Conn* conn): loop(loop), conn(conn){
+		loop.attach(conn->getDemux());
+		loop.attach(conn, conn->getFd(), [conn](){
+			conn->work();
+		}, [conn](){
+			return conn->nextTimeout();
+		});
+	}
+	~AsyncConnection(){
+		loop.detach(conn);
+	}
+	AsyncConnection(const AsyncConnection&) = delete;
+	AsyncConnection& operator=(const AsyncConnection&) = delete;
+	Conn* operator->(){
+		return conn;
+	}
+	Conn* get(){
+		return conn;
+	}
+
+	class Read: public EventLoop::Awaitable{
+	private:
+		Conn* conn;
+		char* buf;
+		uint32_t len;
+	protected:
+		bool ready() override{
+			return conn->available() || conn->closed();
+		}
+	public:
+		Read(EventLoop& loop, Conn* conn, char* buf, uint32_t len):
+			EventLoop::Awaitable(loop, conn), conn(conn), buf(buf), len(len){
+		}
+		uint32_t await_resume(){
+			return conn->read(buf, len);
+		}
+	};
+	class Write: public EventLoop::Awaitable{
+	private:
+		Conn* conn;
+		std::string owned;
+		const char* data;
+		uint32_t len;
+	protected:
+		bool ready() override{
+			if(conn->closed())
+				return true;
+			uint32_t w = conn->write(data, len);
+			data += w;
+			len -= w;
+			// With a send buffer limit only wait for the low watermark, otherwise for the ACKs
+			return len == 0 && (conn->writeSpace() != UINT32_MAX ? conn->writable() : conn->pending() == 0);
+		}
+	public:
+		Write(EventLoop& loop, Conn* conn, const char* data, uint32_t len):
+			EventLoop::Awaitable(loop, conn), conn(conn), data(data), len(len){
+		}
+		Write(EventLoop& loop, Conn* conn, std::string str):
+			EventLoop::Awaitable(loop, conn), conn(conn), owned(std::move(str)), data(nullptr), len(owned.length()){
+		}
+		bool await_ready(){
+			if(!data)
+				data = owned.data();
+			return EventLoop::Awaitable::await_ready();
+		}
+		bool await_resume(){
+			return !conn->closed();
+		}
+	};
+
+	// Resumes with the number of bytes read, 0 means the connection was closed
+	Read read(char* buf, uint32_t len){
+		return Read(loop, conn, buf, len);
+	}
+	template<size_t N>
+	Read read(char (&buf)[N]){
+		return read(buf, N);
+	}
+	/*
+	 * Resumes once all data was queued and the send buffer drained to its low watermark, without
+	 * a send buffer limit once everything was acknowledged. false if the connection was closed.
+	 */
+	Write write(const char* data, uint32_t len){
+		return Write(loop, conn, data, len);
+	}
+	Write write(std::string data){
+		return Write(loop, conn, std::move(data));
+	}
+	void close(){
+		conn->close();
+	}
+};
+
+class AsyncClient: public AsyncConnection<Client>{
+public:
+	AsyncClient(EventLoop& loop, Client* client): AsyncConnection<Client>(loop, client){
+	}
+
+	class Connect: public EventLoop::Awaitable{
+	private:
+		Client* conn;
+	protected:
+		bool ready() override{
+			return conn->connected() || conn->closed();
+		}
+	public:
+		Connect(EventLoop& loop, Client* conn): EventLoop::Awaitable(loop, conn), conn(conn){
+		}
+		bool await_resume(){
+			return conn->connected();
+		}
+	};
+
+	// Resumes with true once the connection is established
+	Connect connect(){
+		return Connect(loop, conn);
+	}
+};
+
+class AsyncListener{
+private:
+	EventLoop& loop;
+	Listener* listener;
+	std::list<ServerConnection*> backlog;
+public:
+	AsyncListener(EventLoop& loop, Listener* listener): loop(loop), listener(listener){
+		loop.attach(listener, listener->getFd(), [this](){
+			// listen() returns one connection per call, others wait in its backlog
+			ServerConnection* conn;
+			while((conn = this->listener->listen()))
+				backlog.push_back(conn);
+		});
+	}
+	~AsyncListener(){
+		loop.detach(listener);
+	}
+	AsyncListener(const AsyncListener&) = delete;
+	AsyncListener& operator=(const AsyncListener&) = delete;
+
+	class Accept: public EventLoop::Awaitable{
+	private:
+		std::list<ServerConnection*>& backlog;
+	protected:
+		bool ready() override{
+			return !backlog.empty();
+		}
+	public:
+		Accept(EventLoop& loop, Listener* listener, std::list<ServerConnection*>& backlog):
+			EventLoop::Awaitable(loop, listener), backlog(backlog){
+		}
+		ServerConnection* await_resume(){
+			ServerConnection* conn = backlog.front();
+			backlog.pop_front();
+			return conn;
+		}
+	};
+
+	// Resumes with the next incoming connection, which has to be deleted by the caller
+	Accept accept(){
+		return Accept(loop, listener, backlog);
+	}
+};
+
+};
@@ -0,0 +1,171 @@
+/*
+ * libetherstream.discovery.hpp
+ *
+ * Finding the peers offering a service on the network.
+ */
+
+#pragma once
+
+extern "C"{
+#include <poll.h>
+}
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "libetherstream.packet.hpp"
+#include "libetherstream.socket.hpp"
+
+namespace ethstream{
+
+// Host which answered a DISCOVER
+struct Peer{
+	mac_t mac;
+	std::string name;
+	std::vector<uint16_t> services;
+	uint16_t flags; // CONNFLAG_CHKSUM() of the checksums accepted, CONNFLAG_RESUMABLE
+	std::chrono::steady_clock::time_point seen;
+
+	bool offers(uint16_t service) const{
+		return std::find(services.begin(), services.end(), service) != services.end();
+	}
+};
+
+/*
+ * Finds listeners on the network of an interface with a single DISCOVER to the broadcast (or
+ * discoveryGroup) MAC, instead of knowing their MACs. Answers are cached, so later lookups
+ * (e.g. by name) need no round trip.
+ */
+class Discovery : private Socket{
+private:
+	std::unordered_map<uint64_t, Peer> peers; // By MAC
+	std::mt19937 rng{std::random_device()()};
+
+	static uint64_t key(const mac_t& mac){
+		uint64_t k = 0;
+		for(int i = 0; i < ETH_ALEN; i++)
+			k = k << 8 | mac.bytes[i];
+		return k;
+	}
+	/*
+	 * Adds the host announced by apkt to the cache, returns it (nullptr if the packet is malformed).
+	 * Several listeners of a host answer with an ANNOUNCE each, with merge their services are added
+	 * to the ones cached, otherwise they replace them.
+	 */
+	const Peer* handleAnnounce(const mac_t& src, const ANNOUNCE* apkt, uint16_t size, bool merge){
+		uint32_t len = sizeof(ANNOUNCE) + apkt->serviceCount*sizeof(uint16_t) + apkt->nameLen;
+		if(size < len)
+			return nullptr;
+		Peer& peer = peers[key(src)];
+		const char* p = (const char*)apkt + sizeof(ANNOUNCE);
+		peer.mac = src;
+		if(!merge){
+			peer.flags = 0;
+			peer.services.clear();
+		}
+		peer.flags |= apkt->flags;
+		for(int i = 0; i < apkt->serviceCount; i++, p += sizeof(uint16_t)){
+			uint16_t service = getLE<uint16_t>(p);
+			if(!peer.offers(service))
+				peer.services.push_back(service);
+		}
+		if(!merge || peer.name.empty())
+			peer.name.assign(p, apkt->nameLen);
+		peer.seen = std::chrono::steady_clock::now();
+		return &peer;
+	}
+public:
+	Discovery(std::string iface): Socket(iface){
+		setFilter(1 << tANNOUNCE);
+		// Room for the answers of hundreds of hosts arriving at once
+		int rcvBuf = 1024*1024;
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+	}
+	/*
+	 * Asks all listeners for service (0: any) on the network and collects their answers for
+	 * timeout ms. Returns the hosts which answered, with the services of all their listeners, they
+	 * are cached as well. Asking for any service replaces the services cached for the hosts which
+	 * answered, asking for one adds to them (listeners without it do not answer).
+	 */
+	std::vector<Peer> discover(uint16_t service = 0, uint32_t timeout = 500, mac_t dest = broadcastMac){
+		DISCOVER dpkt;
+		dpkt.connection = rng();
+		dpkt.service = service;
+		sendPacket(dest, &dpkt, sizeof(DISCOVER));
+		std::vector<Peer> found;
+		auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+		while(true){
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now()).count();
+			if(left <= 0)
+				break;
+			struct pollfd pfd = {sock, POLLIN, 0};
+			if(poll(&pfd, 1, left) <= 0)
+				continue;
+			mac_t src;
+			uint16_t size;
+			int ifIndex;
+			std::shared_ptr<PktBase> pkt;
+			while((pkt = recvPkt(src, size, false, &ifIndex))){
+				// Late answers to an earlier DISCOVER and ones seen on other interfaces are dropped
+				if(pkt->type != tANNOUNCE || pkt->connection != dpkt.connection || ifIndex != link.ifIndex)
+					continue;
+				auto known = std::find_if(found.begin(), found.end(), [&](const Peer& p){
+					return std::memcmp(p.mac.bytes, src.bytes, ETH_ALEN) == 0;
+				});
+				const Peer* peer = handleAnnounce(src, (ANNOUNCE*)pkt.get(), size, service || known != found.end());
+				if(!peer)
+					continue;
+				if(known != found.end())
+					*known = *peer;
+				else
+					found.push_back(*peer);
+			}
+		}
+		return found;
+	}
+	// Cached host called name offering service (0: any), which answered within maxAge ms, nullptr if there is none
+	const Peer* find(const std::string& name, uint16_t service = 0, uint32_t maxAge = 60000){
+		auto now = std::chrono::steady_clock::now();
+		for(auto& entry : peers){
+			const Peer& peer = entry.second;
+			if(peer.name == name && (!service || peer.offers(service)) && now - peer.seen <= std::chrono::milliseconds(maxAge))
+				return &peer;
+		}
+		return nullptr;
+	}
+	/*
+	 * MAC of the host called name offering service, from the cache or else by discovering it.
+	 * Returns false if it did not answer.
+	 */
+	bool resolve(const std::string& name, uint16_t service, mac_t& mac, uint32_t timeout = 500){
+		const Peer* peer = find(name, service);
+		if(!peer){
+			discover(service, timeout);
+			peer = find(name, service);
+		}
+		if(peer)
+			mac = peer->mac;
+		return peer;
+	}
+	// Cached hosts, which answered within maxAge ms
+	std::vector<Peer> cached(uint32_t maxAge = 60000){
+		auto now = std::chrono::steady_clock::now();
+		std::vector<Peer> list;
+		for(auto& entry : peers)
+			if(now - entry.second.seen <= std::chrono::milliseconds(maxAge))
+				list.push_back(entry.second);
+		return list;
+	}
+	// Drops all cached hosts
+	void clear(){
+		peers.clear();
+	}
+	mac_t getLMac(){
+		return Socket::getLMac();
+	};
+};
+
+};
@@ -10,6 +10,9 @@
 
 #include "libetherstream.connection.hpp"
 #include "libetherstream.listener.hpp"
+#include "libetherstream.discovery.hpp"
+#include "libetherstream.multicast.hpp"
+#include "libetherstream.capture.hpp"
 
 #undef SERVERBIT_ISSET
 #undef SERVERBIT_SET
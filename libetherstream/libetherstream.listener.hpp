@@ -7,34 +7,210 @@
 
 #pragma once
 
+extern "C"{
+#include <unistd.h>
+}
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <string>
+#include <unordered_map>
 
 #include "libetherstream.packet.hpp"
 #include "libetherstream.socket.hpp"
 #include "libetherstream.connection.hpp"
+#include "libetherstream.table.hpp"
 
 namespace ethstream{
 
-class Listener : private Socket{
+/*
+ * Accepts connections for one or more services on a single socket. Connections of services
+ * registered with a handler are passed to it, all others are returned by listen().
+ */
+template<typename Policy = DefaultPolicy>
+class BasicListener : private Socket{
+public:
+	typedef std::function<void(BasicServerConnection<Policy>*)> AcceptHandler;
 private:
-	uint16_t service;
+	typedef typename Policy::Clock Clock;
+	// CONNECT answered by this listener
+	struct PeerState{
+		typename Clock::time_point since;
+		uint8_t chksum;
+		bool early; // The DATA packet carried by the CONNECT was accepted
+		bool accepted; // Returned by listen(), the connection answers repeated CONNECTs itself
+		uint64_t token; // Resume token, 0: none
+	};
+	std::unordered_map<uint16_t, AcceptHandler> services;
 	std::string iface;
+	std::string name; // Announced to DISCOVERs
+	ConnectionOptions options;
+	TraceRing* trace = nullptr;
+	size_t backlogMax = 16;
+	uint32_t peerTtl = 30000;
+	std::deque<BasicServerConnection<Policy>*> backlog; // Half open connections, not returned by listen() yet
+	ConnectionTable<PeerState> peers;
+	std::deque<std::pair<ConnKey, typename Clock::time_point>> expiry; // Peers in the order they were added
+	/*
+	 * Chooses the checksum type out of the ones allowed by both sides: none, else crc32c, else fletcher16.
+	 * Returns -1 if there is none (only possible with a fixed checksum policy).
+	 */
+	int chooseChecksum(uint16_t offered){
+		offered |= CONNFLAG_CHKSUM(cFLETCHER16); // Clients without negotiation offer nothing
+		offered &= Policy::Checksum::supported(options.checksums);
+		for(uint8_t type : {cNONE, cCRC32C, cFLETCHER16})
+			if(offered & CONNFLAG_CHKSUM(type))
+				return type;
+		return -1;
+	}
+	// Forgets peers older than peerTtl, a CONNECT from them is a new connection again
+	void expire(typename Clock::time_point now){
+		while(!expiry.empty() && now - expiry.front().second >= std::chrono::milliseconds(peerTtl)){
+			PeerState* state = peers.find(expiry.front().first);
+			if(state && state->since == expiry.front().second)
+				peers.erase(expiry.front().first);
+			expiry.pop_front();
+		}
+	}
+	// Answers a repeated CONNECT of a connection, which is still in the backlog
+	void sendConnectAck(const ConnKey& peer, const CONNECT* cpkt, const PeerState& state){
+		ACK apkt;
+		apkt.connection = peer.connection;
+		apkt.pktNo = 0;
+		apkt.receivedCount = cpkt->sentCount;
+		apkt.errflags = ACKFLAGS_CHKSUM(state.chksum) | (state.early ? ACKFLAGS_DATA : 0) | (state.token ? ACKFLAGS_TOKEN : 0);
+		le64 token = state.token;
+		struct iovec iov[2] = {{&apkt, sizeof(ACK)}, {&token, sizeof(le64)}};
+		sendPacket(peer.mac, iov, state.token ? 2 : 1);
+	}
+	// Answers a DISCOVER with the services, the accepted checksums and the name of this host
+	void handleDiscover(const mac_t& src, const DISCOVER* dpkt){
+		if(services.empty() || (dpkt->service && !services.count(dpkt->service)))
+			return;
+		ANNOUNCE apkt;
+		apkt.connection = dpkt->connection;
+		apkt.flags = Policy::Checksum::supported(options.checksums) | (options.resumable ? CONNFLAG_RESUMABLE : 0);
+		char frame[ETH_DATA_LEN];
+		char* p = frame + sizeof(ANNOUNCE);
+		for(auto& service : services){
+			if(apkt.serviceCount == UINT8_MAX)
+				break;
+			setLE<uint16_t>(p, service.first);
+			p += sizeof(uint16_t);
+			apkt.serviceCount++;
+		}
+		apkt.nameLen = std::min(name.size(), std::min((size_t)UINT8_MAX, (size_t)(frame + sizeof(frame) - p)));
+		std::memcpy(p, name.data(), apkt.nameLen);
+		std::memcpy(frame, &apkt, sizeof(ANNOUNCE));
+		sendPacket(src, frame, p + apkt.nameLen - frame);
+	}
+	void handleConnect(const mac_t& src, const CONNECT* cpkt, uint16_t size, typename Clock::time_point now){
+		// Resumed connections are handled by the connection itself
+		if(!services.count(cpkt->service) || (cpkt->flags & CONNFLAG_RESUME))
+			return;
+		ConnKey peer = {src, cpkt->connection};
+		PeerState* state = peers.find(peer);
+		// A first CONNECT (sentCount 1) always starts a new connection, even if the id was used before
+		if(state && cpkt->sentCount > 1){
+			if(!state->accepted)
+				sendConnectAck(peer, cpkt, *state);
+			return;
+		}
+		int chksum = chooseChecksum(cpkt->flags);
+		if(chksum < 0 || backlog.size() >= backlogMax) // The client retries, once there is room
+			return;
+		auto conn = new BasicServerConnection<Policy>(iface, src, cpkt, size, chksum, options, trace);
+		backlog.push_back(conn);
+		peers.insert(peer, {now, (uint8_t)chksum, conn->earlyAccepted, false, conn->token});
+		expiry.push_back({peer, now});
+	}
 public:
-	Listener(std::string iface, uint16_t service): Socket(iface), service(service), iface(iface){
+	// Accepted connections use options
+	BasicListener(std::string iface, uint16_t service, ConnectionOptions options = ConnectionOptions()):
+		BasicListener(iface, options){
+		addService(service);
 	}
-	ServerConnection* listen(){
+	// Without services, add them with addService()
+	BasicListener(std::string iface, ConnectionOptions options = ConnectionOptions()):
+		Socket(iface), iface(iface), options(options){
+		setFilter(1 << tCONNECT | 1 << tDISCOVER); // Packets of accepted connections reach them through the Demux
+		try{
+			joinGroup(discoveryGroup);
+		}catch(std::unique_ptr<std::runtime_error>&){ // DISCOVERs sent to the broadcast MAC are still answered
+		}
+		char host[256] = {0};
+		gethostname(host, sizeof(host) - 1);
+		name = host;
+	}
+	virtual ~BasicListener(){
+		for(auto conn : backlog)
+			delete conn;
+	}
+	/*
+	 * Up to backlog CONNECTs are answered before listen() returns them, CONNECTs repeated by
+	 * clients (which missed the answer) within ttl ms are recognised and do not create another connection.
+	 */
+	void setAcceptQueue(size_t backlog, uint32_t ttl){
+		backlogMax = std::max((size_t)1, backlog);
+		peerTtl = ttl;
+	}
+	/*
+	 * Accepts CONNECTs for service, new connections are passed to onAccept (from within listen()),
+	 * which takes ownership of them. Without onAccept they are returned by listen().
+	 */
+	void addService(uint16_t service, AcceptHandler onAccept = nullptr){
+		services[service] = onAccept;
+	}
+	// Stops accepting connections for service, connections already in the backlog are still returned
+	void removeService(uint16_t service){
+		services.erase(service);
+	}
+	// Records the events of the connections accepted from now on in ring (see ConnectedSocket::setTrace())
+	void setTrace(TraceRing* ring){
+		trace = ring;
+	}
+	// Name announced to clients discovering this host (see Discovery), the hostname by default
+	void setName(std::string name){
+		this->name = name;
+	}
+	/*
+	 * Handles all pending CONNECTs, passes new connections to the handlers of their services and
+	 * returns the oldest one without a handler (if any).
+	 */
+	BasicServerConnection<Policy>* listen(){
+		auto now = Clock::now();
+		expire(now);
 		mac_t src;
-		auto pkt = recvPkt(src);
-		if(pkt && pkt->type == tCONNECT){
-			CONNECT* cpkt = (CONNECT*)(pkt.get());
-			if(service == cpkt->service)
-				return new ServerConnection(iface, src, pkt->connection);
+		uint16_t size;
+		int ifIndex;
+		std::shared_ptr<PktBase> pkt;
+		while((pkt = recvPkt(src, size, false, &ifIndex))){
+			if(pkt->type == tCONNECT)
+				handleConnect(src, (CONNECT*)pkt.get(), size, now);
+			else if(pkt->type == tDISCOVER && ifIndex == link.ifIndex) // Hosts on other networks could not reach the answer
+				handleDiscover(src, (DISCOVER*)pkt.get());
+		}
+		while(!backlog.empty()){
+			auto conn = backlog.front();
+			backlog.pop_front();
+			PeerState* state = peers.find({conn->getRMac(), conn->connection});
+			if(state)
+				state->accepted = true;
+			auto service = services.find(conn->getService());
+			if(service == services.end() || !service->second)
+				return conn;
+			service->second(conn);
 		}
 		return nullptr;
 	}
 	mac_t getLMac(){
 		return Socket::getLMac();
 	};
+	int getFd(){
+		return Socket::getFd();
+	};
 };
 
+typedef BasicListener<> Listener;
+
 };
@@ -0,0 +1,350 @@
+/*
+ * libetherstream.multicast.hpp
+ *
+ * One to many transfers with NAK based repair.
+ */
+
+#pragma once
+
+extern "C"{
+#include <poll.h>
+}
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "libetherstream.checksum.hpp"
+#include "libetherstream.packet.hpp"
+#include "libetherstream.socket.hpp"
+
+namespace ethstream{
+
+// Ranges reported by one NAK, further holes are reported by the next one
+const uint16_t maxNakRanges = 64;
+// Interval of heartbeats of the sender and of repeated NAKs of receivers (ms)
+const uint32_t mcastInterval = 50;
+
+/*
+ * Sends data to all receivers of a multicast group at once, so it crosses the network (about)
+ * once instead of once per receiver. Receivers report the packets they missed (NAK), which
+ * are sent again to the whole group, a packet missed by several receivers only once.
+ */
+class MulticastSender : private Socket{
+private:
+	typedef std::chrono::steady_clock Clock;
+	mac_t group;
+	uint32_t rate = 0;
+	std::mt19937 rng{std::random_device()()};
+	// State of the transfer in progress
+	const char* data;
+	MDATA hdr;
+	uint32_t total;
+	std::deque<uint32_t> repairs;
+	std::vector<bool> queued; // In repairs
+	std::vector<Clock::time_point> sentAt;
+	std::vector<mac_t> done; // Receivers which got everything
+	Clock::time_point lastNak;
+
+	void sendSeq(uint32_t seq){
+		uint32_t offset = seq*mcastChunk;
+		uint16_t length = std::min((uint32_t)mcastChunk, (uint32_t)hdr.size - offset);
+		hdr.seq = seq;
+		hdr.length = length;
+		hdr.checksum = crc32c(length, data + offset);
+		struct iovec iov[2] = {{&hdr, sizeof(MDATA)}, {(void*)(data + offset), length}};
+		sendPacket(group, iov, 2);
+		sentAt[seq] = Clock::now();
+	}
+	// Queues the packets reported missing, the ones sent since the NAK was sent are skipped
+	void handleNak(const mac_t& src, const NAK* npkt, uint16_t size){
+		if(!npkt->count){
+			if(std::none_of(done.begin(), done.end(), [&](const mac_t& m){
+					return std::memcmp(m.bytes, src.bytes, ETH_ALEN) == 0;
+				}))
+				done.push_back(src);
+			return;
+		}
+		auto now = Clock::now();
+		lastNak = now;
+		const NakRange* range = (const NakRange*)(npkt + 1);
+		for(uint16_t i = 0; i < npkt->count && sizeof(NAK) + (i + 1)*sizeof(NakRange) <= size; i++, range++){
+			for(uint32_t seq = range->first; seq < (uint32_t)range->first + range->count && seq < total; seq++){
+				if(queued[seq] || now - sentAt[seq] < std::chrono::milliseconds(mcastInterval/10))
+					continue;
+				queued[seq] = true;
+				repairs.push_back(seq);
+			}
+		}
+	}
+	// Handles the NAKs received within wait ms
+	void receiveNaks(int wait){
+		struct pollfd pfd = {sock, POLLIN, 0};
+		if(poll(&pfd, 1, std::max(0, wait)) <= 0)
+			return;
+		mac_t src;
+		uint16_t size;
+		int ifIndex;
+		std::shared_ptr<PktBase> pkt;
+		while((pkt = recvPkt(src, size, false, &ifIndex)))
+			if(pkt->type == tNAK && pkt->connection == hdr.connection && ifIndex == link.ifIndex)
+				handleNak(src, (NAK*)pkt.get(), size);
+	}
+public:
+	MulticastSender(std::string iface, mac_t group = multicastGroup): Socket(iface), group(group){
+		setFilter(1 << tNAK);
+	}
+	// Limits sending to bytesPerSec (0: as fast as the interface takes them), to spare slow receivers lost packets
+	void setRate(uint32_t bytesPerSec){
+		rate = bytesPerSec;
+	}
+	/*
+	 * Sends len bytes of data to the group, until the given number of receivers got everything,
+	 * else until none asked for missing packets for linger ms. Gives up after timeout ms.
+	 * Returns the number of receivers, which got everything.
+	 */
+	size_t distribute(const void* data, uint32_t len, size_t receivers = 0, uint32_t linger = 1000, uint32_t timeout = 60000){
+		this->data = (const char*)data;
+		hdr.connection = rng();
+		hdr.size = len;
+		total = std::max(1u, (len + mcastChunk - 1)/mcastChunk);
+		repairs.clear();
+		queued.assign(total, false);
+		sentAt.assign(total, Clock::time_point());
+		done.clear();
+		auto start = Clock::now();
+		auto nextSend = start;
+		auto heartbeat = start;
+		uint32_t next = 0;
+		lastNak = start;
+		while(Clock::now() - start < std::chrono::milliseconds(timeout)){
+			if(receivers && done.size() >= receivers)
+				break;
+			auto now = Clock::now();
+			if(next == total && repairs.empty()){
+				if(!receivers && now - lastNak >= std::chrono::milliseconds(linger))
+					break;
+				// The last packet again: receivers, which missed the end, learn about it and report their holes
+				if(now >= heartbeat){
+					sendSeq(total - 1);
+					heartbeat = now + std::chrono::milliseconds(mcastInterval);
+				}
+				receiveNaks(std::chrono::duration_cast<std::chrono::milliseconds>(heartbeat - now).count() + 1);
+				continue;
+			}
+			if(rate && now < nextSend){
+				receiveNaks(std::chrono::duration_cast<std::chrono::milliseconds>(nextSend - now).count());
+				continue;
+			}
+			uint32_t seq;
+			if(!repairs.empty()){
+				seq = repairs.front();
+				repairs.pop_front();
+				queued[seq] = false;
+			}else{
+				seq = next++;
+				if(next == total)
+					lastNak = now; // Lingers from the end of the first pass
+			}
+			sendSeq(seq);
+			if(rate)
+				nextSend = std::max(nextSend, now - std::chrono::milliseconds(1)) + std::chrono::microseconds((uint64_t)ETH_FRAME_LEN*1000000/rate);
+			receiveNaks(0);
+		}
+		return done.size();
+	}
+	mac_t getLMac(){
+		return Socket::getLMac();
+	};
+	int getFd(){
+		return Socket::getFd();
+	};
+};
+
+/*
+ * Receives multicast transfers sent to a group (by MulticastSender), one at a time, and asks the
+ * sender for the packets it missed.
+ */
+class MulticastReceiver : private Socket{
+private:
+	typedef std::chrono::steady_clock Clock;
+	// Transfer in progress
+	struct Transfer{
+		uint32_t session = 0;
+		mac_t sender;
+		uint32_t total = 0;
+		uint32_t missing = 0;
+		uint32_t highest = 0; // Highest packet received
+		std::vector<char> data;
+		std::vector<bool> have;
+		Clock::time_point lastRx;
+		Clock::time_point nakDue; // Time the next NAK is sent, if packets are missing
+		bool nakScheduled = false;
+	};
+	uint32_t maxSize;
+	uint32_t sessionTimeout = 5000;
+	std::mt19937 rng{std::random_device()()};
+	Transfer cur;
+	std::vector<char> completed;
+	mac_t completedSender;
+	std::deque<std::pair<uint32_t, Clock::time_point>> finished; // Sessions completed, with the time DONE was last sent
+
+	void sendNak(const mac_t& dest, uint32_t session, const std::vector<NakRange>& ranges){
+		NAK npkt;
+		npkt.connection = session;
+		npkt.count = ranges.size();
+		struct iovec iov[2] = {{&npkt, sizeof(NAK)}, {(void*)ranges.data(), ranges.size()*sizeof(NakRange)}};
+		sendPacket(dest, iov, ranges.empty() ? 1 : 2);
+	}
+	// Reports the holes up to the highest packet received (or all, if the sender is idle)
+	void sendHoles(bool all){
+		std::vector<NakRange> ranges;
+		uint32_t end = all ? cur.total : cur.highest;
+		for(uint32_t seq = 0; seq < end && ranges.size() < maxNakRanges; seq++){
+			if(cur.have[seq])
+				continue;
+			NakRange range;
+			range.first = seq;
+			uint16_t count = 0;
+			while(seq < end && !cur.have[seq] && count < UINT16_MAX){
+				seq++;
+				count++;
+			}
+			range.count = count;
+			ranges.push_back(range);
+		}
+		if(!ranges.empty())
+			sendNak(cur.sender, cur.session, ranges);
+	}
+	// Starts sending NAKs, the first with a random delay, so the NAKs of receivers, which missed the same packets, are spread
+	void scheduleNak(Clock::time_point now){
+		if(cur.nakScheduled)
+			return;
+		cur.nakScheduled = true;
+		cur.nakDue = std::max(cur.nakDue, now + std::chrono::milliseconds(rng() % (mcastInterval/5 + 1)));
+	}
+	// Answers packets of a session completed before, returns whether it was one
+	bool answerFinished(const mac_t& src, uint32_t session, Clock::time_point now){
+		for(auto& f : finished){
+			if(f.first != session)
+				continue;
+			if(now - f.second >= std::chrono::milliseconds(mcastInterval)){
+				sendNak(src, session, {});
+				f.second = now;
+			}
+			return true;
+		}
+		return false;
+	}
+	// Adds a packet to the transfer, returns true if it completed it
+	bool handleData(const mac_t& src, const MDATA* mpkt, uint16_t size, Clock::time_point now){
+		uint32_t session = mpkt->connection;
+		if(answerFinished(src, session, now))
+			return false;
+		if(session != cur.session || !cur.total){
+			// Another transfer starts, once the one in progress is silent
+			if(cur.total && now - cur.lastRx < std::chrono::milliseconds(sessionTimeout))
+				return false;
+			if(mpkt->size > maxSize)
+				return false;
+			cur = Transfer();
+			cur.session = session;
+			cur.sender = src;
+			cur.total = std::max(1u, ((uint32_t)mpkt->size + mcastChunk - 1)/mcastChunk);
+			cur.missing = cur.total;
+			cur.data.resize(mpkt->size);
+			cur.have.assign(cur.total, false);
+		}
+		uint32_t seq = mpkt->seq;
+		uint32_t offset = seq*mcastChunk;
+		uint16_t length = mpkt->length;
+		if(seq >= cur.total || mpkt->size != cur.data.size() || sizeof(MDATA) + length > size
+				|| length != std::min((uint32_t)mcastChunk, (uint32_t)cur.data.size() - offset))
+			return false;
+		cur.lastRx = now;
+		if(cur.have[seq]){
+			if(seq == cur.total - 1) // Heartbeat, the sender is through
+				scheduleNak(now);
+			return false;
+		}
+		if(crc32cCopy(cur.data.data() + offset, mpkt + 1, length) != mpkt->checksum)
+			return false; // Reported missing later
+		if(seq > cur.highest + 1 || (!cur.highest && seq && !cur.have[0]))
+			scheduleNak(now);
+		cur.have[seq] = true;
+		cur.highest = std::max(cur.highest, seq);
+		if(--cur.missing)
+			return false;
+		sendNak(cur.sender, cur.session, {});
+		finished.push_back({cur.session, now});
+		if(finished.size() > 16)
+			finished.pop_front();
+		completed.swap(cur.data);
+		completedSender = cur.sender;
+		cur = Transfer();
+		return true;
+	}
+public:
+	// Joins group, transfers larger than maxSize bytes are ignored
+	MulticastReceiver(std::string iface, mac_t group = multicastGroup, uint32_t maxSize = 256*1024*1024):
+		Socket(iface), maxSize(maxSize){
+		setFilter(1 << tMDATA);
+		joinGroup(group);
+		// Bursts of the sender are only paced by the interface
+		int rcvBuf = 4*1024*1024;
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+	}
+	/*
+	 * Handles received packets and sends due NAKs, waits up to wait ms for packets. Returns true
+	 * if a transfer was completed, its data is returned by data() until the next one completes.
+	 */
+	bool work(int wait = 0){
+		auto now = Clock::now();
+		if(cur.total){
+			// The sender went silent (or only the end was lost): everything missing is reported
+			if(now - cur.lastRx >= std::chrono::milliseconds(2*mcastInterval))
+				scheduleNak(now);
+			if(cur.nakScheduled)
+				wait = std::min(wait, (int)std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(cur.nakDue - now).count()));
+		}
+		struct pollfd pfd = {sock, POLLIN, 0};
+		if(poll(&pfd, 1, wait) > 0){
+			mac_t src;
+			uint16_t size;
+			int ifIndex;
+			std::shared_ptr<PktBase> pkt;
+			now = Clock::now();
+			while((pkt = recvPkt(src, size, false, &ifIndex))){
+				if(pkt->type == tMDATA && ifIndex == link.ifIndex && handleData(src, (MDATA*)pkt.get(), size, now))
+					return true;
+			}
+		}
+		now = Clock::now();
+		if(cur.total && cur.nakScheduled && now >= cur.nakDue){
+			sendHoles(now - cur.lastRx >= std::chrono::milliseconds(mcastInterval) || cur.have[cur.total - 1]);
+			cur.nakDue = now + std::chrono::milliseconds(mcastInterval); // Repeated until complete, giving the repairs time to arrive
+		}
+		return false;
+	}
+	// Data of the transfer completed last
+	const std::vector<char>& data(){
+		return completed;
+	}
+	// Sender of the transfer completed last
+	mac_t getSender(){
+		return completedSender;
+	}
+	// Transfers not heard from within timeout ms are given up, once another one starts
+	void setSessionTimeout(uint32_t timeout){
+		sessionTimeout = timeout;
+	}
+	mac_t getLMac(){
+		return Socket::getLMac();
+	};
+	int getFd(){
+		return Socket::getFd();
+	};
+};
+
+};
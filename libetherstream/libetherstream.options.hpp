@@ -0,0 +1,49 @@
+/*
+ * libetherstream.options.hpp
+ *
+ * Tunables of connections, listeners and clients.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "libetherstream.packet.hpp"
+
+namespace ethstream{
+
+/*
+ * Tunables of a connection, passed to Client and Listener (which hands them to its
+ * ServerConnections). The defaults behave like the v1 protocol: stop and wait, unlimited buffers.
+ * All times are in milliseconds.
+ */
+struct ConnectionOptions{
+	uint16_t window = 1; // DATA packets sent without waiting for their ACK, 1: stop and wait
+	uint32_t rtoInitial = 1000; // Retransmission timeout until a round trip time was measured
+	uint32_t rtoMin = 200; // Least margin of the retransmission timeout above the smoothed round trip time
+	uint32_t rtoMax = 10000; // Upper limit of the retransmission timeout
+	uint32_t sendBufHigh = 0; // Send buffer limits, see setSendBuffer(), 0: unlimited
+	uint32_t sendBufLow = 0;
+	uint32_t recvBufSize = 0; // DATA is dropped while this much is unread, the remote resends it once read, 0: unlimited
+	uint32_t ackDelay = 0; // Delays ACKs to acknowledge several packets at once (useful with a window > 1), 0: ACK immediately
+	uint16_t checksums = CONNFLAG_CHKSUM(cCRC32C); // CONNFLAG_CHKSUM() flags offered (Client) or accepted (Listener) besides fletcher16
+	uint16_t mtu = ETH_DATA_LEN; // Upper limit of the ethernet payload of DATA packets
+	uint32_t connectRetry = 250; // First interval of CONNECT retries, doubled (with jitter) after each one
+	uint32_t connectRetryMax = 2000; // Upper limit of the CONNECT retry interval
+	uint32_t keepalive = 0; // Sends an ACK, if nothing was sent for this long, 0: disabled
+	bool resumable = true; // Connections can be resumed after the link was lost (see Client::resume())
+};
+
+// Options for bulk transfers (e.g. files): several packets in flight and write() limited to a 256K send buffer
+ConnectionOptions transferOptions(){
+	ConnectionOptions options;
+	options.window = 16;
+	options.sendBufHigh = 256*1024;
+	options.sendBufLow = 64*1024;
+	return options;
+}
+
+// Largest window, so old and new packet numbers can still be told apart
+const uint16_t maxWindow = 0x3FFF;
+
+};
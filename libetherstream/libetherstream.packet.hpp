@@ -10,10 +10,14 @@
 extern "C"{
 #include <linux/if_ether.h>
 }
+#include <cctype>
 #include <cstdint>
 #include <iostream>
 #include <iomanip>
 #include <cstring>
+#include <string>
+
+#include "libetherstream.checksum.hpp"
 
 namespace ethstream{
 
@@ -26,65 +30,295 @@ enum pktType{
 	tCONNECT = 0,
 	tDATA = 1,
 	tACK = 2,
-	tCLOSE = 3
+	tCLOSE = 3,
+	tDISCOVER = 4,
+	tANNOUNCE = 5,
+	tMDATA = 6,
+	tNAK = 7
 };
-const uint8_t maxPktType = tCLOSE;
+const uint8_t maxPktType = tNAK;
 #define SRVCLIBIT 0x8000
 #define CLIENTBIT_CLEAR(x) ((x) & ~SRVCLIBIT)
 #define SERVERBIT_SET(x) ((x) | SRVCLIBIT)
 #define SERVERBIT_ISSET(x) (!!((x) & SRVCLIBIT))
 #define REALPKTNO(x) CLIENTBIT_CLEAR(x)
 
+// Packet number following no (skipping 0) with the direction bit of the sender
+uint16_t nextPktNo(uint16_t no, bool isClient){
+	uint16_t next = REALPKTNO(no) + 1;
+	if(REALPKTNO(next) == 0)
+		next = 1;
+	return isClient ? next : SERVERBIT_SET(next);
+}
+// Number of packets from a to b, ignoring the direction bit, 0 (no packet sent yet) precedes 1
+uint16_t pktNoDist(uint16_t a, uint16_t b){
+	return ((int)REALPKTNO(b) - (int)REALPKTNO(a) + 0x7FFF) % 0x7FFF;
+}
+
+// Reads a little endian integer from p (unaligned), independent of the host byte order
+template<typename T>
+T getLE(const void* p){
+	const uint8_t* b = (const uint8_t*)p;
+	T v = 0;
+	for(unsigned i = 0; i < sizeof(T); i++)
+		v |= (T)b[i] << 8*i;
+	return v;
+}
+template<typename T>
+void setLE(void* p, T v){
+	uint8_t* b = (uint8_t*)p;
+	for(unsigned i = 0; i < sizeof(T); i++)
+		b[i] = v >> 8*i;
+}
+
+/*
+ * Integer field stored little endian (the wire byte order) without alignment, converts
+ * implicitly, so packet structs can be cast onto received bytes on any host.
+ */
+template<typename T>
+struct __attribute__((__packed__)) LittleEndian{
+	uint8_t bytes[sizeof(T)];
+	LittleEndian() = default;
+	LittleEndian(T v){
+		setLE(bytes, v);
+	}
+	LittleEndian& operator=(T v){
+		setLE(bytes, v);
+		return *this;
+	}
+	operator T() const{
+		return getLE<T>(bytes);
+	}
+};
+typedef LittleEndian<uint16_t> le16;
+typedef LittleEndian<uint32_t> le32;
+typedef LittleEndian<uint64_t> le64;
+
 struct __attribute__((__packed__)) PktBase{
 	uint8_t type;
-	uint32_t connection;
-	uint16_t pktNo;
+	le32 connection;
+	le16 pktNo;
 };
 
 struct __attribute__((__packed__)) CONNECT{
 	uint8_t type = tCONNECT;
-	uint32_t connection;
-	uint16_t pktNo = 0;
-	uint8_t sentCount = 1;
-	uint16_t service = 0;
-	uint16_t flags = 0;
+	le32 connection;
+	le16 pktNo = 0;
+	uint8_t sentCount = 1; // Stays at 255 once reached
+	le16 service = 0;
+	le16 flags = 0;
 };
+// Besides the offered checksums (CONNFLAG_CHKSUM()): the first DATA packet of the client follows the CONNECT
+#define CONNFLAG_DATA 0x0008
+// Checksum type of that DATA packet in bits 4-5
+#define CONNFLAG_DATA_CHKSUM(type) ((uint16_t)((type) & 0x3) << 4)
+#define CONNFLAG_DATA_CHKSUM_GET(flags) (((flags) >> 4) & 0x3)
+// Asks the server for a resume token (ACKFLAGS_TOKEN)
+#define CONNFLAG_RESUMABLE 0x0040
+// Resumes the open connection: the token (le64) follows the CONNECT instead of DATA
+#define CONNFLAG_RESUME 0x0080
+// With CONNFLAG_RESUME: adds the path the CONNECT came in on to the connection, instead of moving it
+#define CONNFLAG_PATH 0x0100
 
+/*
+ * Layout of DATA with the default fletcher16 checksum (v1). In v2 the checksum field is sized
+ * for the negotiated checksum type (0, 2 or 4 bytes), so length and data follow at a variable
+ * offset and have to be accessed with the data*() functions below.
+ */
 struct __attribute__((__packed__)) DATA{
 	uint8_t type = tDATA;
-	uint32_t connection;
-	uint16_t pktNo;
+	le32 connection;
+	le16 pktNo;
 	uint8_t sentCount = 1;
-	uint16_t checksum;
-	uint16_t length;
+	le16 checksum;
+	le16 length;
 	char data[];
 };
 const uint32_t maxDataLen = ETH_FRAME_LEN - sizeof(struct DATA) - sizeof(ethhdr);
+// Bytes of DATA before the checksum field
+const uint16_t dataPrefixLen = 8;
+const uint16_t maxDataHdrLen = dataPrefixLen + 4 + sizeof(uint16_t);
+// Payload which fits into a frame with every checksum type
+const uint32_t maxPayloadLen = ETH_FRAME_LEN - maxDataHdrLen - sizeof(ethhdr);
+
+uint16_t dataHdrLen(uint8_t chksum){
+	return dataPrefixLen + chksumLen(chksum) + sizeof(uint16_t);
+}
+uint32_t dataChecksum(const DATA* d, uint8_t chksum){
+	const char* p = (const char*)d + dataPrefixLen;
+	if(chksumLen(chksum) == 4)
+		return getLE<uint32_t>(p);
+	if(chksumLen(chksum) == 2)
+		return getLE<uint16_t>(p);
+	return 0;
+}
+uint16_t dataLength(const DATA* d, uint8_t chksum){
+	return getLE<uint16_t>((const char*)d + dataPrefixLen + chksumLen(chksum));
+}
+const char* dataPayload(const DATA* d, uint8_t chksum){
+	return (const char*)d + dataHdrLen(chksum);
+}
+// Fills in checksum and length, the prefix is accessed directly
+void setDataHdr(DATA* d, uint8_t chksum, uint32_t sum, uint16_t length){
+	char* p = (char*)d + dataPrefixLen;
+	if(chksumLen(chksum) == 4)
+		setLE<uint32_t>(p, sum);
+	else if(chksumLen(chksum) == 2)
+		setLE<uint16_t>(p, sum);
+	setLE<uint16_t>(p + chksumLen(chksum), length);
+}
 
 
+// Bits of ACK::errflags (bit 0 is the least significant one on the wire)
+enum ackErr : uint16_t{
+	ACKERR_PKGIGNORED = 1 << 0, // Pkg was ignored due to an error
+	ACKERR_CONNCLOSED = 1 << 1, // Connection was closed due to an error
+	ACKERR_UNKNOWNCONN = 1 << 2, // Connection id is unknown
+	ACKERR_CHKSUM = 1 << 3, // Checksum is wrong
+	ACKERR_CONNOPEN = 1 << 4, // Connection already open (as answer to an CONNECT Request)
+	ACKERR_PKGORDER = 1 << 5 // Packet has an out of order number
+};
+// Checksum type chosen by the server in bits 6-7 (as answer to a CONNECT Request)
+#define ACKFLAGS_CHKSUM(type) ((uint16_t)((type) & 0x3) << 6)
+#define ACKFLAGS_CHKSUM_GET(flags) (((flags) >> 6) & 0x3)
+// The DATA packet following the CONNECT (CONNFLAG_DATA) was accepted, the answer acknowledges it
+#define ACKFLAGS_DATA 0x0100
+// The resume token (le64) follows the answer to a CONNECT
+#define ACKFLAGS_TOKEN 0x0200
+// Probes a path, which failed, the remote answers with an ACK on the same path. Bits 11-15 are reserved
+#define ACKFLAGS_PROBE 0x0400
+
 struct __attribute__((__packed__)) ACK{
 	uint8_t type = tACK;
-	uint32_t connection;
-	uint16_t pktNo;
+	le32 connection;
+	le16 pktNo;
 	uint8_t receivedCount;
-	union{
-		struct{
-			uint16_t pkgIgnored: 1; // Pkg was ignored due to an error
-			uint16_t connClosed: 1; // Connection was closed due to an error
-			uint16_t unknownConn: 1; // Connection id is unknown
-			uint16_t chksumErr: 1; // Checksum is wrong
-			uint16_t connOpen: 1; // Connection already open (as answer to an CONNECT Request)
-			uint16_t pkgOrderError: 1; // Packet has an out of order number
-			uint16_t reserved: 10;
-		}__attribute__((packed)) bits;
-		uint16_t val = 0;
-	}errflags;
+	le16 errflags = 0;
 };
 
 struct __attribute__((__packed__)) CLOSE{
 	uint8_t type = tCLOSE;
-	uint32_t connection;
-	uint16_t pktNo;
+	le32 connection;
+	le16 pktNo;
+};
+
+// Asks listeners (sent to the broadcast or discoveryGroup MAC) for their services, connection is a random nonce
+struct __attribute__((__packed__)) DISCOVER{
+	uint8_t type = tDISCOVER;
+	le32 connection;
+	le16 pktNo = 0;
+	le16 service = 0; // Only listeners accepting it answer, 0: all
+};
+/*
+ * Answer to a DISCOVER, with its nonce as connection. Followed by the services accepted
+ * (le16 each) and the name of the host (nameLen bytes, not terminated).
+ */
+struct __attribute__((__packed__)) ANNOUNCE{
+	uint8_t type = tANNOUNCE;
+	le32 connection;
+	le16 pktNo = 0;
+	le16 flags = 0; // CONNFLAG_CHKSUM() of the checksums accepted, CONNFLAG_RESUMABLE
+	uint8_t serviceCount = 0;
+	uint8_t nameLen = 0;
+};
+
+/*
+ * Packet seq of a multicast transfer (connection is its random session id) of size bytes. All
+ * packets but the last carry mcastChunk bytes, so the offset of the payload is seq*mcastChunk.
+ */
+struct __attribute__((__packed__)) MDATA{
+	uint8_t type = tMDATA;
+	le32 connection;
+	le16 pktNo = 0;
+	le32 seq;
+	le32 size;
+	le32 checksum; // crc32c of the payload
+	le16 length; // Followed by the payload
+};
+const uint16_t mcastChunk = ETH_DATA_LEN - sizeof(MDATA);
+/*
+ * Sent by a receiver of a multicast transfer to its sender: followed by count ranges of packets
+ * missing (NakRange), which are sent again. Without ranges the receiver has got everything.
+ */
+struct __attribute__((__packed__)) NAK{
+	uint8_t type = tNAK;
+	le32 connection;
+	le16 pktNo = 0;
+	le16 count = 0;
+};
+struct __attribute__((__packed__)) NakRange{
+	le32 first;
+	le16 count;
+};
+
+/*
+ * Read only view of a received packet of type P, pointing straight at the frame (or any other
+ * memory, e.g. a ring buffer) without copying. The packet is only accessed through P's fields,
+ * which are stored little endian and unaligned, after checking size() covers them.
+ */
+template<typename P>
+class PktView{
+protected:
+	const P* pkt;
+	uint16_t len;
+public:
+	PktView(const void* data, uint16_t len): pkt((const P*)data), len(len){
+	}
+	// Whether the fixed fields are within the buffer
+	bool valid() const{
+		return pkt && len >= sizeof(P);
+	}
+	uint16_t size() const{
+		return len;
+	}
+	const P* operator->() const{
+		return pkt;
+	}
+	const P* get() const{
+		return pkt;
+	}
+};
+
+/*
+ * Smallest valid packet of each type, 0 for unknown types. DATA is checked against the header
+ * without checksum, its exact size depends on the connection (see DataView).
+ */
+uint16_t minPktSize(uint8_t type){
+	switch(type){
+	case tCONNECT: return sizeof(CONNECT);
+	case tDATA: return dataHdrLen(cNONE);
+	case tACK: return sizeof(ACK);
+	case tCLOSE: return sizeof(CLOSE);
+	case tDISCOVER: return sizeof(DISCOVER);
+	case tANNOUNCE: return sizeof(ANNOUNCE);
+	case tMDATA: return sizeof(MDATA);
+	case tNAK: return sizeof(NAK);
+	default: return 0;
+	}
+}
+
+// DATA view for one checksum type, additionally checks the payload length against the buffer
+class DataView : public PktView<DATA>{
+private:
+	uint8_t chksum;
+public:
+	DataView(const void* data, uint16_t len, uint8_t chksum): PktView(data, len), chksum(chksum){
+	}
+	bool valid() const{
+		return pkt && len >= dataHdrLen(chksum) && dataHdrLen(chksum) + length() <= len;
+	}
+	uint8_t chksumType() const{
+		return chksum;
+	}
+	uint16_t length() const{
+		return dataLength(pkt, chksum);
+	}
+	uint32_t checksum() const{
+		return dataChecksum(pkt, chksum);
+	}
+	const char* payload() const{
+		return dataPayload(pkt, chksum);
+	}
 };
 
 typedef struct {uint8_t bytes[ETH_ALEN] = {0};} mac_t;
@@ -96,16 +330,24 @@ std::ostream& operator<<(std::ostream& os, mac_t mac){
 	os << buf;
 	return os;
 }
-
-uint16_t fletcher16(int len, void* data){
-	uint8_t sum1 = 0;
-	uint8_t sum2 = 0;
-	uint8_t* d = (uint8_t*)data;
-	for(int i=0; i<len; i++){
-		sum1 += d[i];
-		sum2 += sum1;
+// Parses a MAC written as 12:34:56:78:9A:BC, returns false if str is none
+bool parseMac(const std::string& str, mac_t& mac){
+	if(str.length() != 17)
+		return false;
+	for(int i = 0; i < 6; i++){
+		if(i && str[i*3 - 1] != ':')
+			return false;
+		if(!isxdigit(str[i*3]) || !isxdigit(str[i*3 + 1]))
+			return false;
+		mac.bytes[i] = std::stoul(str.substr(i*3, 2), nullptr, 16);
 	}
-	return (sum1 << 8) + sum2;
+	return true;
 }
 
+const mac_t broadcastMac = {{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}};
+// Multicast group listeners join for DISCOVERs (locally administered)
+const mac_t discoveryGroup = {{0x03, 0x65, 0x74, 0x68, 0x73, 0x74}};
+// Default group of multicast transfers
+const mac_t multicastGroup = {{0x03, 0x65, 0x74, 0x68, 0x73, 0x6d}};
+
 };
@@ -0,0 +1,132 @@
+/*
+ * libetherstream.path.hpp
+ *
+ * Links and paths a connection can use.
+ */
+
+#pragma once
+
+extern "C"{
+#include <sys/socket.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+}
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "libetherstream.packet.hpp"
+
+namespace ethstream{
+
+// Local interface frames are sent on
+struct Link{
+	int ifIndex = -1;
+	std::string name;
+	mac_t mac;
+	bool down = false; // Sending failed, as the interface is down or gone
+	std::chrono::steady_clock::time_point relinked;
+
+	Link(){
+	}
+	explicit Link(std::string iface){
+		lookup(iface);
+	}
+	// Sets index and MAC of iface, throws if it does not exist
+	void lookup(std::string iface){
+		struct ifaddrs *addrs,*tmp;
+		getifaddrs(&addrs);
+		tmp = addrs;
+		while (tmp){
+			if (tmp->ifa_addr && tmp->ifa_addr->sa_family == AF_PACKET && iface == tmp->ifa_name){
+				std::memcpy(mac.bytes, &tmp->ifa_addr->sa_data[10], 6);
+				break;
+			}
+			tmp = tmp->ifa_next;
+		}
+		freeifaddrs(addrs);
+		ifIndex = if_nametoindex(iface.c_str());
+		if(ifIndex == 0)
+			throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Invalid interface (" + iface + ") specified: "+std::string(strerror(errno))));
+		name = iface;
+	}
+	/*
+	 * Looks up the interface (by name, or iface if given) again, after it was recreated or to
+	 * switch to another one, at most every 250ms. Returns false, if it does not exist (yet).
+	 */
+	bool relink(std::string iface = ""){
+		auto now = std::chrono::steady_clock::now();
+		if(iface.empty() && now - relinked < std::chrono::milliseconds(250))
+			return false;
+		relinked = now;
+		try{
+			lookup(iface.empty() ? name : iface);
+		}catch(std::unique_ptr<std::runtime_error>&){
+			return false;
+		}
+		down = false;
+		return true;
+	}
+};
+
+// Link of the interface with index ifIndex (e.g. the one a frame was received on)
+Link linkOf(int ifIndex){
+	char name[IF_NAMESIZE];
+	if(!if_indextoname(ifIndex, name))
+		throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Invalid interface index: "+std::string(strerror(errno))));
+	return Link(name);
+}
+
+// Paths a connection can have
+const size_t maxPaths = 8;
+// Retransmission timeouts in a row after which a path is not used anymore, but probed
+const uint8_t maxPathTimeouts = 2;
+// Interval of probes on failed paths (ms)
+const uint32_t pathProbeInterval = 1000;
+
+// Smoothed round trip time and its variation, as TCP (RFC 6298)
+struct RttEstimator{
+	int64_t srtt = -1; // Smoothed round trip time (us), -1: not measured yet
+	int64_t rttvar = 0;
+
+	// Adapts the estimate to a measurement (us)
+	void sampleRtt(int64_t us){
+		if(srtt < 0){
+			srtt = us;
+			rttvar = us/2;
+		}else{
+			rttvar = (3*rttvar + std::abs(srtt - us))/4;
+			srtt = (7*srtt + us)/8;
+		}
+	}
+};
+
+/*
+ * One way between the ends of a connection: a local interface and the MAC of the remote on
+ * that network. Round trip time and loss are tracked per path, DATA is spread over the usable ones.
+ */
+struct Path : RttEstimator{
+	Link link;
+	mac_t remote;
+	bool confirmed = true; // Known to the remote (paths added by the client are confirmed by the server)
+	uint16_t inFlight = 0; // Unacknowledged DATA packets sent on this path
+	uint32_t sent = 0; // DATA packets sent, including resent ones
+	uint32_t lost = 0; // DATA packets resent after a timeout
+	uint8_t timeouts = 0; // Retransmission timeouts without hearing from the remote on this path since
+	std::chrono::steady_clock::time_point probed; // Last CONNECT (while unconfirmed) or probe sent on it
+
+	Path(){
+	}
+	Path(const Link& link, mac_t remote, bool confirmed = true):
+		link(link), remote(remote), confirmed(confirmed){
+	}
+	bool usable() const{
+		return confirmed && !link.down && timeouts < maxPathTimeouts;
+	}
+};
+
+};
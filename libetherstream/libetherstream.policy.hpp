@@ -0,0 +1,68 @@
+/*
+ * libetherstream.policy.hpp
+ *
+ * Compile time policies of a connection: checksum, acknowledgement, buffer sizes and clock.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+#include "libetherstream.buffer.hpp"
+#include "libetherstream.checksum.hpp"
+#include "libetherstream.options.hpp"
+
+namespace ethstream{
+
+/*
+ * ACK strategies: how many DATA packets may be in flight and whether ACKs may be delayed.
+ * AckStopAndWait ignores the options, so the window loops are resolved at compile time.
+ */
+struct AckStopAndWait{
+	static uint16_t window(const ConnectionOptions&){
+		return 1;
+	}
+	static uint32_t ackDelay(const ConnectionOptions&){
+		return 0;
+	}
+};
+
+struct AckWindowed{
+	static uint16_t window(const ConnectionOptions& options){
+		return std::max((uint16_t)1, std::min(options.window, maxWindow));
+	}
+	static uint32_t ackDelay(const ConnectionOptions& options){
+		return options.ackDelay;
+	}
+};
+
+/*
+ * Compile time configuration of the connection stack, e.g. BasicClient<Policy>:
+ *   ChecksumT: ChecksumNegotiated or ChecksumFixed<type, portable>
+ *   AckT: AckWindowed or AckStopAndWait
+ *   recvBufSize: fixed receive buffer (power of two), 0: grows as needed
+ *   sendSlabs: fixed number of send slabs (DATA packets queued), 0: allocated as needed
+ *   ClockT: clock of all timers (a std::chrono clock or one with the same interface)
+ */
+template<typename ChecksumT, typename AckT, uint32_t recvBufSize, unsigned sendSlabs, typename ClockT>
+struct ConnectionPolicy{
+	typedef ChecksumT Checksum;
+	typedef AckT Ack;
+	typedef BasicRingBuffer<recvBufSize> RecvBuffer;
+	typedef BasicSlabQueue<ChecksumT, sendSlabs> SendQueue;
+	typedef ClockT Clock;
+};
+
+// Everything configurable at runtime (ConnectionOptions)
+typedef ConnectionPolicy<ChecksumNegotiated, AckWindowed, 0, 0, std::chrono::system_clock> DefaultPolicy;
+
+// Stop and wait with fletcher16 (v1 compatible) without CPU dispatch and without allocations per packet
+template<uint32_t recvBufSize = 16*1024, unsigned sendSlabs = 4>
+using MinimalPolicy = ConnectionPolicy<ChecksumFixed<cFLETCHER16, true>, AckStopAndWait, recvBufSize, sendSlabs, std::chrono::steady_clock>;
+
+// Sliding window with hardware CRC32C only
+typedef ConnectionPolicy<ChecksumFixed<cCRC32C>, AckWindowed, 0, 0, std::chrono::steady_clock> ThroughputPolicy;
+
+};
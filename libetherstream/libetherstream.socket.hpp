@@ -8,6 +8,7 @@
 #pragma once
 
 extern "C"{
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <linux/filter.h>
 #include <net/if.h>
@@ -15,66 +16,87 @@ extern "C"{
 #include <ifaddrs.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <poll.h>
 }
 #include <cerrno>
 #include <cstring>
 #include <stdexcept>
 #include <chrono>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 
+#include "libetherstream.options.hpp"
 #include "libetherstream.packet.hpp"
+#include "libetherstream.path.hpp"
+#include "libetherstream.stats.hpp"
+#include "libetherstream.table.hpp"
+#include "libetherstream.trace.hpp"
 
 namespace ethstream{
 class Socket{
 private:
-	int ifIndex = -1;
-	mac_t localMac = {{0}};
-	void setIface(std::string iface){
-		struct ifaddrs *addrs,*tmp;
-		getifaddrs(&addrs);
-		tmp = addrs;
-		while (tmp){
-			if (tmp->ifa_addr && tmp->ifa_addr->sa_family == AF_PACKET && iface == tmp->ifa_name){
-				std::memcpy(localMac.bytes, &tmp->ifa_addr->sa_data[10], 6);
-				break;
-			}
-			tmp = tmp->ifa_next;
-		}
-		freeifaddrs(addrs);
-		ifIndex = if_nametoindex(iface.c_str());
-		if(ifIndex == 0)
-			throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Invalid interface (" + iface + ") specified: "+std::string(strerror(errno))));
-	};
+	std::shared_ptr<uint8_t> rxFrame;
 protected:
 	int sock = -1;
+	Link link; // Interface frames are sent on, receiving is not bound to an interface
 	mac_t getLMac(){
-		return localMac;
+		return link.mac;
+	};
+	int getFd(){
+		return sock;
 	};
+	// Without iface only the sendPacket() with a Link can be used
 	Socket(std::string iface){
 		sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ETHSTREAM));
-		if(sock == -1){
-			//TODO: Error handling
-			//std::cout << "socket error: " << strerror(errno) << " (" << errno << ")" << std::endl;
-			//exit(-errno);
-			throw "Error in opening Socket";
-		}
-		setIface(iface);
-		const int minPktSz = sizeof(struct ethhdr) + sizeof(struct CONNECT);
+		if(sock == -1)
+			throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Could not open socket: " + std::string(strerror(errno))));
+		if(!iface.empty())
+			link.lookup(iface);
+		setFilter();
+	}
+	/*
+	 * Lets the kernel drop frames shorter than a packet header and, with types (a bit per packet
+	 * type, e.g. 1 << tCONNECT), the packets of all other types, before they are queued on this
+	 * socket. With hostOnly only frames addressed to this host are kept, not the ones it sent.
+	 */
+	void setFilter(uint32_t types = 0, bool hostOnly = false){
+		const int minPktSz = sizeof(struct ethhdr) + sizeof(struct PktBase);
+		const uint8_t toEnd = 0xFF; // Placeholder, set below: jt jumps to the accept, jf to the drop
 		// Docs: http://www.gsp.com/cgi-bin/man.cgi?topic=bpf
-		struct sock_filter filter[] = { // A: Accumulator, P: packet data, X: Register, k: passed parameter
-			//BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12), // A <- P[12:2] (2byte)
-			//BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K,ETH_P_ETHSTREAM,0,4), // A == ETH_P_ETHSTREAM then jmp 0 else jmp 4 (ret 0)
-			//TODO: check for max type
+		// A: Accumulator, P: packet data, X: Register, k: passed parameter, jumps are relative to the next instruction
+		std::vector<struct sock_filter> filter = {
 			BPF_STMT(BPF_LD+BPF_W+BPF_LEN, 0), // A <- pkt len
-			//BPF_STMT(BPF_RET+BPF_A, 0), // return A -> accept whole packet
-			BPF_JUMP(BPF_JMP+BPF_JGE+BPF_K,minPktSz-5,0,1), // A >= minPktSz then jmp 0 else jmp 1 (ret 0)
-			BPF_STMT(BPF_RET+BPF_A, 0), // return A -> accept whole packet
-			BPF_STMT(BPF_RET+BPF_K, 0), // accept 0 bytes -> drop packet
+			BPF_JUMP(BPF_JMP+BPF_JGE+BPF_K,minPktSz,0,toEnd), // A >= minPktSz then go on else drop
 		};
+		if(hostOnly){
+			filter.insert(filter.end(), {
+				BPF_STMT(BPF_LD+BPF_W+BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_PKTTYPE)), // A <- packet type of the kernel
+				BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K,PACKET_HOST,0,toEnd),
+			});
+		}
+		if(types){
+			filter.push_back(BPF_STMT(BPF_LD+BPF_B+BPF_ABS, sizeof(struct ethhdr))); // A <- packet type
+			for(uint32_t type = 0; types >> type; type++)
+				if(types & 1 << type)
+					filter.push_back(BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K,type,toEnd,(uint8_t)(types >> (type + 1) ? 0 : toEnd)));
+		}
+		filter.push_back(BPF_STMT(BPF_RET+BPF_K, ETH_FRAME_LEN)); // accept the whole packet
+		filter.push_back(BPF_STMT(BPF_RET+BPF_K, 0)); // accept 0 bytes -> drop packet
+		for(size_t i = 0; i < filter.size(); i++){
+			if(BPF_CLASS(filter[i].code) != BPF_JMP)
+				continue;
+			if(filter[i].jt == toEnd)
+				filter[i].jt = filter.size() - 3 - i;
+			if(filter[i].jf == toEnd)
+				filter[i].jf = filter.size() - 2 - i;
+		}
 		struct sock_fprog bpf = {
-			.len = sizeof(filter)/sizeof(filter[0]),
-			.filter = filter,
+			.len = (unsigned short)filter.size(),
+			.filter = filter.data(),
 		};
 		errno = 0;
 		int ret = setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &bpf, sizeof(bpf));
@@ -85,26 +107,45 @@ protected:
 	virtual ~Socket(){
 		close(sock);
 	}
+	// Receives frames sent to the multicast MAC group on the interface
+	void joinGroup(mac_t group){
+		struct packet_mreq mreq = {0};
+		mreq.mr_ifindex = link.ifIndex;
+		mreq.mr_type = PACKET_MR_MULTICAST;
+		mreq.mr_alen = ETH_ALEN;
+		std::memcpy(mreq.mr_address, group.bytes, ETH_ALEN);
+		if(setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+			throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Could not join multicast group: "+std::string(strerror(errno))));
+	}
 	void sendPacket(mac_t dest, void* data, uint16_t length){
 		struct iovec d = {reinterpret_cast<void*>(data), length};
-		sendPacket(dest, &d, 1);
+		sendPacket(link, dest, &d, 1);
 	}
-
 	void sendPacket(mac_t dest, struct iovec data[], uint16_t length){
+		sendPacket(link, dest, data, length);
+	}
+	// Sends on the interface of via, which is marked down if it is gone
+	void sendPacket(Link& via, mac_t dest, struct iovec data[], uint16_t length){
 		// Build eth header
 		struct ethhdr eh;
 		std::memcpy(eh.h_dest, dest.bytes, ETH_ALEN);
-		std::memcpy(eh.h_source, localMac.bytes, ETH_ALEN);
+		std::memcpy(eh.h_source, via.mac.bytes, ETH_ALEN);
 		eh.h_proto = htons(ETH_P_ETHSTREAM);
 		// Build dest addr
 		struct sockaddr_ll addr;
 		addr.sll_family = PF_PACKET;
 		addr.sll_protocol = ETH_P_ETHSTREAM;
-		addr.sll_ifindex = ifIndex;
+		addr.sll_ifindex = via.ifIndex;
 		addr.sll_halen = ETH_ALEN;
 		std::memcpy(addr.sll_addr, dest.bytes, ETH_ALEN);
-		// Build iovec buffer
-		struct iovec* pktdata = new struct iovec[length+1];
+		// Build iovec buffer, small ones (all sent by the library itself) without allocation
+		struct iovec stackIov[8];
+		std::unique_ptr<struct iovec[]> heapIov;
+		struct iovec* pktdata = stackIov;
+		if(length >= 8){
+			heapIov.reset(new struct iovec[length+1]);
+			pktdata = heapIov.get();
+		}
 		pktdata[0].iov_base = &eh;
 		pktdata[0].iov_len = sizeof(eh);
 		std::memcpy(&pktdata[1], data, length*sizeof(struct iovec));
@@ -116,65 +157,453 @@ protected:
 		msg.msg_iovlen = length+1;
 		// Send msg
 		if(sendmsg(sock, &msg, MSG_DONTROUTE) == -1){
-			//std::cout << "sendmsg error: " << strerror(errno) << " (" << errno << ")" << std::endl;
-			//exit(-errno);
-			//TODO: Error handling
+			if(errno == ENETDOWN || errno == ENXIO || errno == ENODEV){
+				via.down = true; // Lost like on the wire, resent once the link is back
+				return;
+			}
 			throw std::domain_error("Error sending packet: "+std::string(strerror(errno)));
 		}
 	}
-	std::shared_ptr<PktBase> recvPkt(mac_t& src, bool wait = false){
-		std::shared_ptr<PktBase> pkt(NULL, [](PktBase* pkt){
-			delete[] pkt;
-		});
-		struct ethhdr* eth = (ethhdr*)new uint8_t[ETH_FRAME_LEN];
-		int length = recv(sock, (void*)eth, ETH_FRAME_LEN, wait ? 0 : MSG_DONTWAIT);
+	/*
+	 * Returns the next packet and its size (without ethernet header), frames too small for
+	 * the fixed fields of their packet type are dropped. ifIndex is set to the interface it came in on.
+	 */
+	std::shared_ptr<PktBase> recvPkt(mac_t& src, uint16_t& size, bool wait = false, int* ifIndex = nullptr){
+		// The packet is returned in place, pointing behind the ethhdr of the received frame,
+		// which is reused, unless a previously returned packet is still held
+		if(!rxFrame || rxFrame.use_count() > 1)
+			rxFrame.reset(new uint8_t[ETH_FRAME_LEN], [](uint8_t* frame){
+				delete[] frame;
+			});
+		std::shared_ptr<uint8_t>& frame = rxFrame;
+		struct ethhdr* eth = (ethhdr*)frame.get();
+		struct sockaddr_ll from;
+		socklen_t fromLen = sizeof(from);
+		int length = recvfrom(sock, (void*)eth, ETH_FRAME_LEN, wait ? 0 : MSG_DONTWAIT, (struct sockaddr*)&from, &fromLen);
 		if (length == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
 			throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Error receiving packet!"));
-		}else if(length > 0){
-			//TODO: check validity of packet
-			int ethstrLen = length - 14;
-			PktBase* pktb = (PktBase*)new uint8_t[ethstrLen];
-			pkt.reset(pktb);
-			std::memcpy(pktb, &((uint8_t*)eth)[14] /* skip ethhdr */, ethstrLen);
-			if(pktb->type > maxPktType){
-				pkt = NULL;
-			}else{
+		}else if(length >= (int)(sizeof(ethhdr) + sizeof(PktBase))){
+			PktBase* pktb = (PktBase*)&frame.get()[sizeof(ethhdr)];
+			size = length - sizeof(ethhdr); // Includes padding of short frames
+			uint16_t minSize = minPktSize(pktb->type);
+			if(minSize && size >= minSize){
 				std::memcpy(src.bytes, eth->h_source, ETH_ALEN);
+				if(ifIndex)
+					*ifIndex = from.sll_ifindex;
+				return std::shared_ptr<PktBase>(frame, pktb);
 			}
 		}
-		delete[] eth;
-		return pkt;
+		return nullptr;
+	}
+};
+
+/*
+ * Receives the frames of all connections of the process on a single socket and queues each one
+ * for its connection, found by remote MAC and connection id in a ConnectionTable. So the kernel
+ * passes every frame to one socket (and filter), no matter how many connections there are. The
+ * socket receives on all interfaces, like a connection may have paths on several. Frames are taken
+ * from it by the work() of any connection or by dispatch(): whoever waits on the fds of connections
+ * (see ConnectedSocket::getFd()) has to wait on getFd() of the Demux as well. A forked child
+ * receives on a Demux of its own (see shared()), as its parent keeps reading the inherited one.
+ */
+class Demux : private Socket{
+public:
+	// Frame taken from the socket
+	struct Frame{
+		std::shared_ptr<PktBase> pkt;
+		uint16_t size;
+		mac_t src;
+		int ifIndex;
+	};
+	// Frames taken from the socket for a connection, but not handled by it yet
+	struct Inbox{
+		std::deque<Frame> frames;
+		int evFd = -1; // Readable while frames are queued, -1: not created yet
+		bool evSet = false;
+	};
+private:
+	// Frames queued per connection, further ones are dropped (as by a full socket) until it catches up
+	static const size_t inboxMax = 1024;
+	pid_t pid;
+	std::mutex lock; // Guards the routes and all inboxes, connections may work() in several threads
+	ConnectionTable<Inbox*> routes;
+	std::unordered_multimap<uint32_t, Inbox*> connects; // CONNECTs resuming a connection or adding a path come from other MACs
+
+	Demux(): Socket(""), pid(getpid()){
+		setFilter(1 << tCONNECT | 1 << tDATA | 1 << tACK | 1 << tCLOSE, true);
+		int rcvbuf = 4*1024*1024; // Frames of all connections
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)); // Best effort, limited by rmem_max
+	}
+	// Makes the eventfd of inbox readable while frames are queued
+	static void notify(Inbox* inbox){
+		bool ready = !inbox->frames.empty();
+		uint64_t val = 1;
+		if(inbox->evFd == -1 || ready == inbox->evSet)
+			return;
+		if(ready)
+			inbox->evSet = ::write(inbox->evFd, &val, sizeof(val)) == sizeof(val);
+		else
+			inbox->evSet = !(::read(inbox->evFd, &val, sizeof(val)) == sizeof(val));
+	}
+	static void queue(Inbox* inbox, const Frame& frame){
+		if(inbox->frames.size() >= inboxMax)
+			return;
+		inbox->frames.push_back(frame);
+		notify(inbox);
+	}
+	/*
+	 * Reads the socket until a frame for self came (returned in frame) or none is left, the frames
+	 * of other connections are queued for them, the ones of unknown connections dropped.
+	 */
+	bool pump(Inbox* self, Frame& frame){
+		while(true){
+			Frame f; // Not holding the last one, so recvPkt() reuses its buffer
+			f.pkt = recvPkt(f.src, f.size, false, &f.ifIndex);
+			if(!f.pkt)
+				return false;
+			Inbox** inbox = routes.find({f.src, f.pkt->connection});
+			bool mine = inbox && *inbox == self;
+			if(inbox && !mine){
+				queue(*inbox, f);
+			}else if(!inbox && f.pkt->type == tCONNECT){
+				auto range = connects.equal_range(f.pkt->connection);
+				for(auto it = range.first; it != range.second; ++it){
+					if(it->second == self)
+						mine = true;
+					else
+						queue(it->second, f);
+				}
+			}
+			if(mine){
+				frame = f;
+				return true;
+			}
+		}
+	}
+public:
+	// Demux of this process, created with the first connection and closed with the last one
+	static std::shared_ptr<Demux> shared(){
+		static std::mutex guard;
+		static std::weak_ptr<Demux> current;
+		std::lock_guard<std::mutex> g(guard);
+		std::shared_ptr<Demux> demux = current.lock();
+		if(!demux || demux->forked()){
+			demux.reset(new Demux());
+			current = demux;
+		}
+		return demux;
+	}
+	// Whether this Demux was inherited from the parent of a forked process
+	bool forked(){
+		return pid != getpid();
+	}
+	// Readable while frames wait on the socket, call dispatch() (or work() of a connection) then
+	int getFd(){
+		return Socket::getFd();
+	}
+	// Queues the frames of connection from remote for inbox
+	void add(const ConnKey& key, Inbox* inbox){
+		std::lock_guard<std::mutex> guard(lock);
+		routes.insert(key, inbox);
+	}
+	void remove(const ConnKey& key, Inbox* inbox){
+		std::lock_guard<std::mutex> guard(lock);
+		Inbox** cur = routes.find(key);
+		if(cur && *cur == inbox) // A connection started again by the remote with the same id may have taken over
+			routes.erase(key);
+	}
+	// Queues the CONNECTs for connection from MACs without a route for inbox as well
+	void addConnects(uint32_t connection, Inbox* inbox){
+		std::lock_guard<std::mutex> guard(lock);
+		connects.insert({connection, inbox});
+	}
+	void removeConnects(uint32_t connection, Inbox* inbox){
+		std::lock_guard<std::mutex> guard(lock);
+		auto range = connects.equal_range(connection);
+		for(auto it = range.first; it != range.second; ++it){
+			if(it->second == inbox){
+				connects.erase(it);
+				break;
+			}
+		}
+	}
+	// Returns the next frame of inbox, the ones queued before or else the next one read from the socket
+	bool receive(Inbox* inbox, Frame& frame){
+		std::lock_guard<std::mutex> guard(lock);
+		if(!inbox->frames.empty()){
+			frame = inbox->frames.front();
+			inbox->frames.pop_front();
+			notify(inbox);
+			return true;
+		}
+		return pump(inbox, frame);
+	}
+	// Queues the frames waiting on the socket for their connections
+	void dispatch(){
+		std::lock_guard<std::mutex> guard(lock);
+		Frame frame;
+		pump(nullptr, frame);
+	}
+	// The eventfd of inbox, readable while frames are queued for it
+	int eventFd(Inbox* inbox){
+		std::lock_guard<std::mutex> guard(lock);
+		if(inbox->evFd == -1){
+			inbox->evFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if(inbox->evFd == -1)
+				throw std::unique_ptr<std::runtime_error>(new std::runtime_error("Could not create eventfd: "+std::string(strerror(errno))));
+			notify(inbox);
+		}
+		return inbox->evFd;
+	}
+	// Blocks until frames were queued for inbox or wait on the socket
+	void wait(Inbox* inbox){
+		struct pollfd fds[2] = {{getFd(), POLLIN, 0}, {eventFd(inbox), POLLIN, 0}};
+		poll(fds, 2, -1);
+	}
+	void sendPacket(Link& via, mac_t dest, struct iovec data[], uint16_t length){
+		Socket::sendPacket(via, dest, data, length);
 	}
 };
 
-class ConnectedSocket : private Socket{
+/*
+ * Connection to a remote over one or more paths, its frames are received and sent through the
+ * Demux of the process.
+ */
+class ConnectedSocket{
 private:
-	mac_t foreignMac;
+	std::shared_ptr<Demux> demux;
+	Demux::Inbox inbox;
+	std::vector<Path> paths; // [0] is the one the connection was opened on
+	std::vector<mac_t> routed; // Remotes the Demux passes the frames of the connection from
+	// Lets the Demux pass the packets of connection from the remotes of all paths
+	void updateRoutes(){
+		for(const mac_t& remote : routed)
+			demux->remove({remote, connection}, &inbox);
+		routed.clear();
+		for(const Path& path : paths){
+			demux->add({path.remote, connection}, &inbox);
+			routed.push_back(path.remote);
+		}
+	}
+	// Receives on the Demux of this process, the frames queued on the one of the parent are lost for a forked child
+	void attach(){
+		demux = Demux::shared();
+		routed.clear();
+		updateRoutes();
+		demux->addConnects(connection, &inbox);
+	}
 public:
 	mac_t getLMac(){
-		return Socket::getLMac();
+		return paths[0].link.mac;
 	};
 	mac_t getRMac(){
-		return foreignMac;
+		return paths[0].remote;
+	};
+	/*
+	 * eventfd readable while frames for the connection are queued (call work() then). They are queued
+	 * by the Demux, whose fd has to be waited on as well (see getDemux()).
+	 */
+	int getFd(){
+		return demux->eventFd(&inbox);
 	};
+	// Receives the frames of this connection (and all others of the process)
+	std::shared_ptr<Demux> getDemux(){
+		return demux;
+	}
+	// Connection id, chosen by the client
+	uint32_t getConnection(){
+		return connection;
+	};
+	// Payload checksum (chksumType) negotiated for this connection
+	uint8_t getChecksumType(){
+		return chksumType;
+	};
+	const ConnectionOptions& getOptions(){
+		return options;
+	};
+	// Paths of the connection with their round trip time and loss
+	const std::vector<Path>& getPaths(){
+		return paths;
+	}
+	// Counters and state of the connection, can be called from any thread
+	ConnectionStats getStats() const{
+		return stats.snapshot();
+	}
+	// Records the events of the connection in ring (nullptr: stops), which has to outlive it
+	void setTrace(TraceRing* ring){
+		trace = ring;
+	}
 protected:
 	uint32_t connection;
-	ConnectedSocket(std::string iface, mac_t dest, uint32_t connection): Socket(iface), foreignMac(dest), connection(connection){
-
+	uint8_t chksumType = cFLETCHER16;
+	ConnectionOptions options;
+	uint32_t txCount = 0; // Packets sent
+	uint8_t rxPath = 0; // Path the last packet returned by recvPkt() came in on
+	StatCounters stats;
+	TraceRing* trace = nullptr;
+	void traceEvent(uint8_t event, uint8_t type, uint16_t pktNo, uint16_t length, uint8_t path, uint32_t value = 0){
+		if(trace)
+			trace->record(event, connection, type, pktNo, length, path, value);
+	}
+	ConnectedSocket(std::string iface, mac_t dest, uint32_t connection, ConnectionOptions options = ConnectionOptions()):
+		connection(connection), options(options){
+		paths.push_back(Path(Link(iface), dest));
+		attach();
+	}
+	virtual ~ConnectedSocket(){
+		for(const mac_t& remote : routed)
+			demux->remove({remote, connection}, &inbox);
+		demux->removeConnects(connection, &inbox);
+		if(inbox.evFd != -1)
+			::close(inbox.evFd);
+	}
+	// Called once a forked child received on a Demux of its own, frames sent meanwhile may have been lost
+	virtual void reattached(){
+	}
+	// Whether the interfaces of all paths went down or away
+	bool linkDown(){
+		for(const Path& path : paths)
+			if(!path.link.down)
+				return false;
+		return true;
+	}
+	// Looks up the interface of the first path again or switches it to iface (see Link::relink())
+	bool relink(std::string iface = ""){
+		return paths[0].link.relink(iface);
+	}
+	// Looks up the interfaces of all paths, which went down, again
+	void relinkDown(){
+		for(Path& path : paths)
+			if(path.link.down)
+				path.link.relink();
+	}
+	// Continues the first path with the remote at another MAC, which came in on interface ifIndex (after it resumed from there)
+	void setRMac(mac_t mac, int ifIndex = -1){
+		paths[0].remote = mac;
+		if(ifIndex > 0 && ifIndex != paths[0].link.ifIndex){
+			try{
+				paths[0].link = linkOf(ifIndex);
+			}catch(std::unique_ptr<std::runtime_error>&){
+			}
+		}
+		updateRoutes();
+	}
+	// Adds a path to remote over link, returns its index or -1 if there are maxPaths already
+	int addPath(const Link& link, mac_t remote, bool confirmed = true){
+		if(paths.size() >= maxPaths)
+			return -1;
+		paths.push_back(Path(link, remote, confirmed));
+		updateRoutes();
+		return paths.size() - 1;
+	}
+	// Index of the path to remote, preferably over interface ifIndex, -1 if there is none
+	int findPath(mac_t remote, int ifIndex){
+		int found = -1;
+		for(size_t i = 0; i < paths.size(); i++){
+			if(std::memcmp(paths[i].remote.bytes, remote.bytes, sizeof(mac_t)) != 0)
+				continue;
+			if(paths[i].link.ifIndex == ifIndex)
+				return i;
+			if(found < 0)
+				found = i;
+		}
+		return found;
+	}
+	size_t pathCount(){
+		return paths.size();
+	}
+	Path& pathAt(uint8_t i){
+		return paths[i];
+	}
+	/*
+	 * Path for the next DATA packet (forData) or for other packets: the usable one expected to deliver
+	 * first, by its round trip time (and the DATA packets in flight on it). If no path is usable, the
+	 * confirmed one with the least timeouts, whose interface is up.
+	 */
+	uint8_t choosePath(bool forData = true){
+		if(paths.size() == 1)
+			return 0;
+		int64_t unmeasured = -1; // Paths without a measurement count as fast as the fastest one
+		for(const Path& path : paths)
+			if(path.srtt >= 0 && (unmeasured < 0 || path.srtt < unmeasured))
+				unmeasured = path.srtt;
+		if(unmeasured < 0)
+			unmeasured = 1000;
+		int best = -1;
+		int64_t bestCost = 0;
+		for(size_t i = 0; i < paths.size(); i++){
+			if(!paths[i].usable())
+				continue;
+			int64_t cost = (paths[i].srtt < 0 ? unmeasured : paths[i].srtt)*(forData ? paths[i].inFlight + 1 : 1);
+			if(best < 0 || cost < bestCost){
+				best = i;
+				bestCost = cost;
+			}
+		}
+		if(best >= 0)
+			return best;
+		best = 0;
+		for(size_t i = 1; i < paths.size(); i++)
+			if(paths[i].confirmed && !paths[i].link.down && (paths[best].link.down || paths[i].timeouts < paths[best].timeouts))
+				best = i;
+		return best;
 	}
 	void sendPacket(void* data, uint16_t length){
-		Socket::sendPacket(foreignMac, data, length);
+		struct iovec d = {reinterpret_cast<void*>(data), length};
+		sendPacket(-1, &d, 1);
 	}
 	void sendPacket(struct iovec data[], uint16_t length){
-		Socket::sendPacket(foreignMac, data, length);
+		sendPacket(-1, data, length);
 	}
-	std::shared_ptr<PktBase> recvPkt(bool wait = false){
-		mac_t src;
-		auto pkt = Socket::recvPkt(src, wait);
-		if(std::memcmp((void*)src.bytes, (void*)foreignMac.bytes, sizeof(mac_t)) == 0)
-			return pkt;
-		else
+	// Sends on path, -1: the best one for packets other than DATA
+	void sendPacket(int path, struct iovec data[], uint16_t length){
+		Path& via = paths[path < 0 ? choosePath(false) : path];
+		demux->sendPacket(via.link, via.remote, data, length);
+		txCount++;
+		uint32_t bytes = 0;
+		for(uint16_t i = 0; i < length; i++)
+			bytes += data[i].iov_len;
+		stats.sent(bytes);
+		if(trace && data[0].iov_len >= sizeof(PktBase)){
+			const PktBase* pkt = (const PktBase*)data[0].iov_base;
+			// DATA sent before carries its sentCount after the header fields
+			bool resent = pkt->type == tDATA && data[0].iov_len > sizeof(PktBase) && ((const DATA*)pkt)->sentCount > 1;
+			traceEvent(resent ? TRACE_RESEND : TRACE_SEND, pkt->type, pkt->pktNo, bytes, &via - paths.data());
+		}
+	}
+	/*
+	 * Returns packets of connection received on one of its paths (setting rxPath), CONNECTs from
+	 * any source (see Demux::addConnects()). src and ifIndex tell where from.
+	 */
+	std::shared_ptr<PktBase> recvPkt(uint16_t& size, bool wait = false, mac_t* src = nullptr, int* ifIndex = nullptr){
+		if(demux->forked()){
+			attach();
+			reattached();
+		}
+		Demux::Frame frame;
+		while(!demux->receive(&inbox, frame)){
+			if(!wait)
+				return nullptr;
+			demux->wait(&inbox);
+		}
+		std::shared_ptr<PktBase> pkt = frame.pkt;
+		mac_t from = frame.src;
+		int fromIf = frame.ifIndex;
+		size = frame.size;
+		int path = findPath(from, fromIf);
+		if(pkt->type != tCONNECT && path < 0)
 			return nullptr;
+		if(path >= 0){
+			rxPath = path;
+			paths[path].timeouts = 0; // The path works (again)
+		}
+		stats.received(size);
+		traceEvent(TRACE_RECV, pkt->type, pkt->pktNo, size, path < 0 ? 0 : path);
+		if(src)
+			*src = from;
+		if(ifIndex)
+			*ifIndex = fromIf;
+		return pkt;
 	}
 };
 
@@ -0,0 +1,108 @@
+/*
+ * libetherstream.stats.hpp
+ *
+ * Counters of a connection.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace ethstream{
+
+// Snapshot of the counters of a connection (see ConnectedSocket::getStats())
+struct ConnectionStats{
+	uint64_t framesSent = 0; // All packets, including ACKs and resent DATA
+	uint64_t bytesSent = 0; // Of those frames (without ethernet header)
+	uint64_t framesReceived = 0;
+	uint64_t bytesReceived = 0;
+	uint64_t payloadSent = 0; // Payload of DATA packets, counted once (when first sent)
+	uint64_t payloadReceived = 0; // Payload accepted in order
+	uint64_t retransmits = 0; // DATA packets resent
+	uint64_t timeouts = 0; // Retransmission timeouts
+	uint64_t checksumErrors = 0; // DATA packets dropped due to a wrong checksum
+	uint64_t orderErrors = 0; // DATA packets dropped as they were out of order
+	uint64_t duplicates = 0; // DATA packets received again, which were already accepted
+	// State as of the last work()
+	int64_t srtt = -1; // Smoothed round trip time (us), -1: not measured yet
+	uint32_t rto = 0; // Retransmission timeout (ms)
+	uint16_t window = 0; // DATA packets sent without waiting for their ACK
+	uint16_t inFlight = 0;
+	uint32_t sendBuffered = 0; // Bytes written, but not acknowledged yet
+	uint32_t recvBuffered = 0; // Bytes received, but not read yet
+};
+
+/*
+ * Counters of a connection, updated by the thread calling work() and read by any thread. As
+ * there is a single writer, they are updated with relaxed loads and stores (no locked
+ * instructions), a snapshot may mix values of different work() calls.
+ */
+class StatCounters{
+private:
+	template<typename T>
+	static void inc(std::atomic<T>& c, T n){
+		c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	template<typename T>
+	static void set(std::atomic<T>& c, T v){
+		c.store(v, std::memory_order_relaxed);
+	}
+	template<typename T>
+	static T get(const std::atomic<T>& c){
+		return c.load(std::memory_order_relaxed);
+	}
+public:
+	std::atomic<uint64_t> framesSent{0}, bytesSent{0}, framesReceived{0}, bytesReceived{0};
+	std::atomic<uint64_t> payloadSent{0}, payloadReceived{0}, retransmits{0}, timeouts{0};
+	std::atomic<uint64_t> checksumErrors{0}, orderErrors{0}, duplicates{0};
+	std::atomic<int64_t> srtt{-1};
+	std::atomic<uint32_t> rto{0}, sendBuffered{0}, recvBuffered{0};
+	std::atomic<uint16_t> window{0}, inFlight{0};
+
+	void sent(uint32_t bytes){
+		inc<uint64_t>(framesSent, 1);
+		inc<uint64_t>(bytesSent, bytes);
+	}
+	void received(uint32_t bytes){
+		inc<uint64_t>(framesReceived, 1);
+		inc<uint64_t>(bytesReceived, bytes);
+	}
+	void count(std::atomic<uint64_t>& c, uint64_t n = 1){
+		inc(c, n);
+	}
+	// Publishes the state of the sending side
+	void sender(int64_t srtt, uint32_t rto, uint16_t window, uint16_t inFlight, uint32_t buffered){
+		set(this->srtt, srtt);
+		set(this->rto, rto);
+		set(this->window, window);
+		set(this->inFlight, inFlight);
+		set(sendBuffered, buffered);
+	}
+	void receiver(uint32_t buffered){
+		set(recvBuffered, buffered);
+	}
+	ConnectionStats snapshot() const{
+		ConnectionStats s;
+		s.framesSent = get(framesSent);
+		s.bytesSent = get(bytesSent);
+		s.framesReceived = get(framesReceived);
+		s.bytesReceived = get(bytesReceived);
+		s.payloadSent = get(payloadSent);
+		s.payloadReceived = get(payloadReceived);
+		s.retransmits = get(retransmits);
+		s.timeouts = get(timeouts);
+		s.checksumErrors = get(checksumErrors);
+		s.orderErrors = get(orderErrors);
+		s.duplicates = get(duplicates);
+		s.srtt = get(srtt);
+		s.rto = get(rto);
+		s.window = get(window);
+		s.inFlight = get(inFlight);
+		s.sendBuffered = get(sendBuffered);
+		s.recvBuffered = get(recvBuffered);
+		return s;
+	}
+};
+
+};
@@ -0,0 +1,120 @@
+/*
+ * libetherstream.table.hpp
+ *
+ * Table of the connections of a listener, keyed by remote address and connection id.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "libetherstream.packet.hpp"
+
+namespace ethstream{
+
+// Remote end of a connection
+struct ConnKey{
+	mac_t mac;
+	uint32_t connection;
+	bool operator==(const ConnKey& o) const{
+		return connection == o.connection && std::memcmp(mac.bytes, o.mac.bytes, ETH_ALEN) == 0;
+	}
+};
+
+/*
+ * Open addressing hash table (linear probing) from ConnKey to T. Lookups usually touch a
+ * single slot, the capacity is a power of two and doubles before the table is half full.
+ * It routes received frames to their connection (see Demux), holds the CONNECTs a Listener
+ * answered (to drop repeated ones) and the ids of the clients of the process.
+ */
+template<typename T>
+class ConnectionTable{
+private:
+	struct Slot{
+		bool used = false;
+		ConnKey key;
+		T value;
+	};
+	std::vector<Slot> slots;
+	size_t count = 0;
+
+	static size_t hash(const ConnKey& k){
+		uint64_t h = k.connection;
+		for(int i = 0; i < ETH_ALEN; i++)
+			h = (h << 8 | h >> 56) ^ k.mac.bytes[i];
+		// Final mix of murmur3, ids and MACs differ in few bits only
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+	size_t probe(const ConnKey& k) const{
+		size_t mask = slots.size() - 1;
+		size_t i = hash(k) & mask;
+		while(slots[i].used && !(slots[i].key == k))
+			i = (i + 1) & mask;
+		return i;
+	}
+	void grow(){
+		std::vector<Slot> old(slots.size()*2);
+		old.swap(slots);
+		for(Slot& s : old)
+			if(s.used)
+				slots[probe(s.key)] = s;
+	}
+public:
+	ConnectionTable(size_t capacity = 16){
+		size_t cap = 16;
+		while(cap < capacity*2)
+			cap *= 2;
+		slots.resize(cap);
+	}
+	size_t size() const{
+		return count;
+	}
+	// Returns the value of key or nullptr, valid until the next insert()/erase()
+	T* find(const ConnKey& key){
+		Slot& s = slots[probe(key)];
+		return s.used ? &s.value : nullptr;
+	}
+	// Inserts or replaces the value of key
+	T& insert(const ConnKey& key, const T& value){
+		if((count + 1)*2 > slots.size())
+			grow();
+		Slot& s = slots[probe(key)];
+		if(!s.used){
+			s.used = true;
+			s.key = key;
+			count++;
+		}
+		s.value = value;
+		return s.value;
+	}
+	bool erase(const ConnKey& key){
+		size_t mask = slots.size() - 1;
+		size_t i = probe(key);
+		if(!slots[i].used)
+			return false;
+		// Shifts following entries of the probe sequence back, so no tombstones are needed
+		size_t j = i;
+		while(true){
+			j = (j + 1) & mask;
+			if(!slots[j].used)
+				break;
+			size_t home = hash(slots[j].key) & mask;
+			if(((j - home) & mask) >= ((j - i) & mask)){
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+		slots[i] = Slot();
+		count--;
+		return true;
+	}
+};
+
+};
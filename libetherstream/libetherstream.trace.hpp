@@ -0,0 +1,133 @@
+/*
+ * libetherstream.trace.hpp
+ *
+ * Ring of the recent events of connections, for debugging.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "libetherstream.packet.hpp"
+
+namespace ethstream{
+
+enum traceEvent : uint8_t{
+	TRACE_SEND = 0, // Frame sent
+	TRACE_RESEND = 1, // DATA packet sent again
+	TRACE_RECV = 2, // Frame of the connection received
+	TRACE_ACKED = 3, // length packets up to pktNo were acknowledged, value: round trip time (us) measured, 0: none
+	TRACE_TIMEOUT = 4, // Retransmission timeout, pktNo is the oldest one in flight, value: the new timeout (ms)
+	TRACE_DROP = 5, // DATA packet dropped, value: ACKERR_CHKSUM, ACKERR_PKGORDER, ACKERR_PKGIGNORED (no room) or 0 (duplicate)
+};
+
+// One event, times are of the steady clock (ns)
+struct TraceRecord{
+	int64_t time;
+	uint32_t connection;
+	uint32_t value;
+	uint16_t pktNo;
+	uint16_t length;
+	uint8_t event;
+	uint8_t type; // Packet type
+	uint8_t path;
+};
+
+/*
+ * Ring of the last events of the connections it is set on (see ConnectedSocket::setTrace()),
+ * older ones are overwritten. Recording is a few stores, without locks or allocation, so it can
+ * stay enabled in production and be dumped once something went wrong. Connections of several
+ * threads may share a ring.
+ */
+class TraceRing{
+private:
+	struct Slot{
+		std::atomic<uint64_t> seq{0}; // Index + 1 of the record written last, 0: empty
+		TraceRecord rec;
+	};
+	std::unique_ptr<Slot[]> slots;
+	uint64_t mask;
+	std::atomic<uint64_t> head{0};
+public:
+	// Keeps the last capacity events (rounded up to a power of two)
+	TraceRing(size_t capacity = 65536){
+		size_t cap = 1;
+		while(cap < capacity)
+			cap *= 2;
+		slots.reset(new Slot[cap]);
+		mask = cap - 1;
+	}
+	void record(uint8_t event, uint32_t connection, uint8_t type, uint16_t pktNo, uint16_t length, uint8_t path = 0, uint32_t value = 0){
+		uint64_t idx = head.fetch_add(1, std::memory_order_relaxed);
+		Slot& slot = slots[idx & mask];
+		slot.seq.store(0, std::memory_order_relaxed); // Marks it as being written
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.rec.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		slot.rec.connection = connection;
+		slot.rec.value = value;
+		slot.rec.pktNo = pktNo;
+		slot.rec.length = length;
+		slot.rec.event = event;
+		slot.rec.type = type;
+		slot.rec.path = path;
+		slot.seq.store(idx + 1, std::memory_order_release);
+	}
+	// Events recorded so far, including overwritten ones
+	uint64_t recorded() const{
+		return head.load(std::memory_order_relaxed);
+	}
+	// The events kept, oldest first. Ones being written meanwhile are skipped
+	std::vector<TraceRecord> records() const{
+		std::vector<TraceRecord> list;
+		uint64_t end = head.load(std::memory_order_acquire);
+		uint64_t start = end > mask + 1 ? end - mask - 1 : 0;
+		list.reserve(end - start);
+		for(uint64_t idx = start; idx < end; idx++){
+			const Slot& slot = slots[idx & mask];
+			if(slot.seq.load(std::memory_order_acquire) != idx + 1)
+				continue;
+			TraceRecord rec = slot.rec;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if(slot.seq.load(std::memory_order_relaxed) == idx + 1)
+				list.push_back(rec);
+		}
+		return list;
+	}
+	// Forgets all events
+	void clear(){
+		for(uint64_t i = 0; i <= mask; i++)
+			slots[i].seq.store(0, std::memory_order_relaxed);
+		head.store(0, std::memory_order_relaxed);
+	}
+	/*
+	 * Writes the events kept as text, one per line: time (us, relative to the first one),
+	 * connection, event, packet type, packet number (with the server bit), length, path and value.
+	 */
+	void dump(std::ostream& os) const{
+		static const char* events[] = {"SEND", "RESEND", "RECV", "ACKED", "TIMEOUT", "DROP"};
+		static const char* types[] = {"CONNECT", "DATA", "ACK", "CLOSE", "DISCOVER", "ANNOUNCE", "MDATA", "NAK"};
+		auto list = records();
+		int64_t t0 = list.empty() ? 0 : list.front().time;
+		std::ios_base::fmtflags flags = os.flags();
+		std::streamsize precision = os.precision();
+		os << std::fixed << std::setprecision(3);
+		for(const TraceRecord& rec : list){
+			os << (rec.time - t0)/1000.0 << "\t"
+				<< std::hex << rec.connection << std::dec << "\t"
+				<< (rec.event <= TRACE_DROP ? events[rec.event] : "?") << "\t"
+				<< (rec.type <= maxPktType ? types[rec.type] : "?") << "\t"
+				<< (SERVERBIT_ISSET(rec.pktNo) ? "S" : "C") << REALPKTNO(rec.pktNo) << "\t"
+				<< rec.length << "\t" << (int)rec.path << "\t" << rec.value << "\n";
+		}
+		os.flags(flags);
+		os.precision(precision);
+	}
+};
+
+};
@@ -0,0 +1,200 @@
+/*
+ * test.buffer.cpp
+ *
+ * The ring buffer keeps its bytes in order across wrap around and growth, a fixed one does not
+ * allocate and refuses to overflow. The slab queue splits data into preframed DATA packets,
+ * whose headers describe their payload, and calls the completion of zero copy data once, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.buffer.cpp -o test.buffer && ./test.buffer
+ */
+
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "libetherstream.buffer.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+// Bytes of ring from offset, read with segments()
+template<typename Ring>
+static string segmentsOf(const Ring& ring, uint32_t n, uint32_t offset = 0){
+	struct iovec iov[2];
+	int cnt = ring.segments(iov, n, offset);
+	string str;
+	for(int i = 0; i < cnt; i++)
+		str.append((const char*)iov[i].iov_base, iov[i].iov_len);
+	return str;
+}
+
+// Random pushes and consumes compared against a deque
+template<typename Ring>
+static void model(Ring& ring, size_t maxLen){
+	mt19937 rnd(1);
+	deque<char> expected;
+	char next = 0;
+	for(int i = 0; i < 20000; i++){
+		if(rnd() % 2 && expected.size() < maxLen){
+			uint32_t n = rnd() % min<size_t>(3000, maxLen - expected.size() + 1);
+			vector<char> data(n);
+			for(char& c : data)
+				c = next++;
+			if(rnd() % 2){
+				ring.push(data.data(), n);
+			}else{
+				struct iovec iov[2];
+				int cnt = ring.prepare(iov, n);
+				size_t at = 0;
+				for(int j = 0; j < cnt; j++){
+					memcpy(iov[j].iov_base, &data[at], iov[j].iov_len);
+					at += iov[j].iov_len;
+				}
+				CHECK(at == n);
+				ring.commit(n);
+			}
+			expected.insert(expected.end(), data.begin(), data.end());
+		}else{
+			uint32_t n = rnd() % 3000;
+			uint32_t offset = rnd() % 100;
+			vector<char> got(n);
+			uint32_t r = ring.peek(got.data(), n, offset);
+			uint32_t avail = expected.size() > offset ? expected.size() - offset : 0;
+			CHECK(r == min(n, avail));
+			CHECK(equal(got.begin(), got.begin() + r, expected.begin() + offset));
+			CHECK(segmentsOf(ring, n, offset) == string(got.begin(), got.begin() + r));
+			ring.consume(n);
+			expected.erase(expected.begin(), expected.begin() + min<size_t>(n, expected.size()));
+		}
+		CHECK(ring.size() == expected.size());
+		CHECK(ring.empty() == expected.empty());
+	}
+}
+
+static void growing(){
+	RingBuffer ring;
+	model(ring, 200000);
+	// Growing while wrapped keeps the order
+	RingBuffer wrapped;
+	string a(3000, 'a'), b(3000, 'b'), c(10000, 'c');
+	wrapped.push(a.data(), a.size());
+	wrapped.consume(2000);
+	wrapped.push(b.data(), b.size()); // Wraps around the 4096 bytes
+	wrapped.push(c.data(), c.size()); // Grows
+	CHECK(segmentsOf(wrapped, UINT32_MAX) == a.substr(2000) + b + c);
+}
+
+static void fixed(){
+	BasicRingBuffer<8192> ring;
+	CHECK(ring.space() == 8192);
+	model(ring, 8192);
+	ring.consume(ring.size());
+	string full(8192, 'x');
+	ring.push(full.data(), full.size());
+	CHECK(ring.space() == 0);
+	bool thrown = false;
+	try{
+		ring.push("y", 1);
+	}catch(std::unique_ptr<std::runtime_error>&){
+		thrown = true;
+	}
+	CHECK(thrown);
+	CHECK(ring.size() == 8192);
+}
+
+// Bytes of the frame of slab (header and payload)
+static string frameOf(SlabQueue::Slab* slab){
+	struct iovec iov[2];
+	int cnt = slab->iov(iov);
+	string str;
+	for(int i = 0; i < cnt; i++)
+		str.append((const char*)iov[i].iov_base, iov[i].iov_len);
+	return str;
+}
+
+// Data is split into slabs of slabSize, which describe their payload once sealed
+static void slabs(){
+	string data(10000, 0);
+	for(size_t i = 0; i < data.size(); i++)
+		data[i] = (char)(i*13 + i/7);
+	for(uint8_t type : {cFLETCHER16, cCRC32C, cNONE}){
+		SlabQueue queue;
+		queue.setSlabSize(1000);
+		CHECK(queue.append(data.data(), 300, type) == 300);
+		CHECK(queue.append(&data[300], data.size() - 300, type) == data.size() - 300); // Fills up the first slab
+		CHECK(queue.count() == 10);
+		CHECK(queue.size() == data.size() && queue.buffered() == data.size());
+		string got;
+		while(!queue.empty()){
+			SlabQueue::Slab* slab = queue.front();
+			DATA* hdr = slab->seal(type);
+			string frame = frameOf(slab);
+			CHECK(frame.size() == dataHdrLen(type) + 1000u);
+			CHECK(hdr->type == tDATA);
+			CHECK(dataLength(hdr, type) == 1000);
+			CHECK(dataChecksum(hdr, type) == checksum(type, 1000, dataPayload(hdr, type)));
+			// The checksum follows a change of the type
+			CHECK(slab->checksum(cFLETCHER16) == checksum(cFLETCHER16, 1000, slab->payload()));
+			got.append(dataPayload(hdr, type), dataLength(hdr, type));
+			queue.pop();
+		}
+		CHECK(got == data);
+		CHECK(queue.size() == 0 && queue.buffered() == 0 && queue.count() == 0);
+	}
+}
+
+// Zero copy data is sent from where it is, its completion is called after the last slab was popped
+static void references(){
+	string data(2500, 'r');
+	SlabQueue queue;
+	queue.setSlabSize(1000);
+	int done = 0;
+	queue.append("abc", 3, cCRC32C);
+	CHECK(queue.appendRef(data.data(), data.size(), [&]{ done++; }));
+	queue.append("def", 3, cCRC32C); // Not added to the slab of the reference
+	CHECK(queue.count() == 5);
+	CHECK(queue.size() == 2506 && queue.buffered() == 6);
+	queue.pop();
+	SlabQueue::Slab* slab = queue.front();
+	DATA* hdr = slab->seal(cCRC32C);
+	struct iovec iov[2] = {};
+	CHECK(slab->iov(iov) == 2);
+	CHECK(iov[1].iov_base == data.data());
+	CHECK(dataChecksum(hdr, cCRC32C) == crc32c(1000, data.data()));
+	queue.pop();
+	queue.pop();
+	CHECK(done == 0);
+	queue.pop();
+	CHECK(done == 1);
+	queue.pop();
+	CHECK(queue.empty() && done == 1);
+}
+
+// With fixed slabs the queue takes what fits and works again once slabs were popped
+static void fixedSlabs(){
+	BasicSlabQueue<ChecksumNegotiated, 4> queue;
+	queue.setSlabSize(1000);
+	CHECK(queue.space() == 4000);
+	string data(5000, 'f');
+	CHECK(queue.append(data.data(), data.size(), cFLETCHER16) == 4000);
+	CHECK(queue.space() == 0);
+	CHECK(queue.append(data.data(), 1, cFLETCHER16) == 0);
+	CHECK(!queue.appendRef(data.data(), 1, nullptr));
+	queue.pop();
+	queue.pop();
+	CHECK(queue.space() == 2000);
+	CHECK(!queue.appendRef(data.data(), 2001, nullptr)); // Nothing is queued then
+	CHECK(queue.count() == 2);
+	CHECK(queue.appendRef(data.data(), 2000, nullptr));
+	CHECK(queue.count() == 4 && queue.size() == 4000);
+}
+
+int main(int argc, char** argv){
+	growing();
+	fixed();
+	slabs();
+	references();
+	fixedSlabs();
+	return test::result("test.buffer");
+}
@@ -0,0 +1,131 @@
+/*
+ * test.capture.cpp
+ *
+ * Captures a transfer between two interfaces and reads the pcapng file back: each frame has to
+ * be in it once per interface it passed, with the direction and a kernel timestamp within the
+ * transfer, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.capture.cpp -o test.capture && ./test.capture va vb
+ */
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <vector>
+
+#include "libetherstream.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+static const uint16_t service = 210;
+static const char* path = "/tmp/test.capture.pcapng";
+
+struct Frame{
+	string iface;
+	bool outbound;
+	uint64_t time;
+	vector<uint8_t> data;
+};
+
+static uint32_t get32(const vector<uint8_t>& f, size_t at){
+	uint32_t v;
+	memcpy(&v, &f[at], 4);
+	return v;
+}
+static uint16_t get16(const vector<uint8_t>& f, size_t at){
+	uint16_t v;
+	memcpy(&v, &f[at], 2);
+	return v;
+}
+
+// Parses the blocks of the file, false if it is malformed
+static bool parse(vector<Frame>& frames){
+	ifstream in(path, ios::binary);
+	vector<uint8_t> f((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	if(f.size() < 28 || get32(f, 0) != 0x0A0D0D0A || get32(f, 8) != 0x1A2B3C4D)
+		return false;
+	vector<string> ifaces;
+	size_t at = 0;
+	while(at + 12 <= f.size()){
+		uint32_t type = get32(f, at), len = get32(f, at + 4);
+		if(len < 12 || len % 4 || at + len > f.size() || get32(f, at + len - 4) != len)
+			return false;
+		if(type == 1){ // IDB, the name is its first option
+			if(get16(f, at + 8) != 1 || get16(f, at + 16) != 2)
+				return false;
+			ifaces.push_back(string((char*)&f[at + 20], get16(f, at + 18)));
+		}else if(type == 6){ // EPB
+			uint32_t id = get32(f, at + 8), capLen = get32(f, at + 20);
+			if(id >= ifaces.size() || 28 + capLen + 4 > len)
+				return false;
+			Frame frame;
+			frame.iface = ifaces[id];
+			frame.time = (uint64_t)get32(f, at + 12) << 32 | get32(f, at + 16);
+			frame.data.assign(&f[at + 28], &f[at + 28 + capLen]);
+			size_t opt = at + 28 + ((capLen + 3) & ~3u);
+			frame.outbound = get16(f, opt) == 2 && get32(f, opt + 4) == 2;
+			frames.push_back(frame);
+		}
+		at += len;
+	}
+	return at == f.size();
+}
+
+static uint64_t now(){
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char** argv){
+	string a, b;
+	test::interfaces(argc, argv, a, b);
+	uint64_t start = now();
+	ConnectionStats clientStats, serverStats;
+	{
+		Capture capture(path);
+		Listener listener(a, service);
+		Client client(b, listener.getLMac(), service);
+		unique_ptr<ServerConnection> server;
+		CHECK(test::until([&]{
+			client.work();
+			if(!server)
+				server.reset(listener.listen());
+			return server && client.connected();
+		}));
+		string data(100000, 'x'), got;
+		client.write(data);
+		CHECK(test::until([&]{
+			char buf[4096];
+			client.work();
+			server->work();
+			got.append(buf, server->read(buf, sizeof(buf)));
+			return got.size() == data.size() && !client.pending();
+		}));
+		test::until([&]{ client.work(); server->work(); return false; }, 50);
+		clientStats = client.getStats();
+		serverStats = server->getStats();
+		CHECK(capture.dropped() == 0);
+	}
+	uint64_t end = now();
+	vector<Frame> frames;
+	CHECK(parse(frames));
+	map<pair<string, bool>, int> count; // (interface, outbound) -> frames
+	int connects = 0;
+	for(const Frame& frame : frames){
+		CHECK(frame.data.size() >= 15 && frame.data[12] == 0xFF && frame.data[13] == 0xF0);
+		CHECK(frame.time >= start && frame.time <= end);
+		count[{frame.iface, frame.outbound}]++;
+		if(frame.iface == a && !frame.outbound && frame.data[14] == tCONNECT)
+			connects++;
+	}
+	// Sent once on b and received once on a (and the other way), even if several sockets received it
+	CHECK(count[{b, true}] == (int)clientStats.framesSent);
+	CHECK(count[{a, false}] == (int)clientStats.framesSent);
+	CHECK(count[{a, true}] >= (int)serverStats.framesSent);
+	CHECK(count[{b, false}] == count[{a, true}]);
+	CHECK(connects == 1);
+	unlink(path);
+	return test::result("test.capture");
+}
@@ -0,0 +1,137 @@
+/*
+ * test.checksum.cpp
+ *
+ * The checksum implementations selected for this CPU agree with the portable ones. The Listener
+ * picks the checksum out of the ones offered and accepted (none before crc32c before fletcher16)
+ * and data arrives unchanged with each of them, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.checksum.cpp -o test.checksum && ./test.checksum va vb
+ */
+
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "libetherstream.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+static const uint16_t service = 204;
+
+// Dispatched and portable implementations give the same sums, also when continued and while copying
+static void implementations(){
+	CHECK(crc32c(9, "123456789") == 0xE3069283); // Check value of RFC 3720
+	vector<uint8_t> buf(4096 + 64), dst(buf.size());
+	mt19937 rnd(1);
+	for(auto& b : buf)
+		b = rnd();
+	for(int i = 0; i < 5000; i++){
+		int offs = rnd() % 64;
+		int len = i < 600 ? i : rnd() % 4096;
+		int split = len ? rnd() % len : 0;
+		const uint8_t* p = &buf[offs];
+		uint32_t f = ChecksumFixed<cFLETCHER16, true>::sum(cFLETCHER16, len, p);
+		uint32_t c = ChecksumFixed<cCRC32C, true>::sum(cCRC32C, len, p);
+		CHECK(checksum(cFLETCHER16, len, p) == f);
+		CHECK(checksum(cCRC32C, len, p) == c);
+		CHECK(checksum(cNONE, len, p) == 0);
+		CHECK(checksum(cFLETCHER16, len - split, p + split, checksum(cFLETCHER16, split, p)) == f);
+		CHECK(checksum(cCRC32C, len - split, p + split, checksum(cCRC32C, split, p)) == c);
+		for(uint8_t type : {cFLETCHER16, cCRC32C, cNONE}){
+			memset(&dst[0], 0, dst.size());
+			CHECK(checksumCopy(type, &dst[offs], p, len) == (type == cFLETCHER16 ? f : type == cCRC32C ? c : 0));
+			CHECK(memcmp(&dst[offs], p, len) == 0);
+		}
+	}
+	if(test::failures)
+		fprintf(stderr, "fletcher16: %s, crc32c: %s\n", fletcher16Impl().name, crc32cImpl().name);
+}
+
+// Checksum type the listener answers a CONNECT offering offered with, -1: no answer
+template<typename Policy>
+static int negotiate(string a, string b, uint16_t accepted, uint16_t offered){
+	static uint32_t id = 0x2000;
+	ConnectionOptions options;
+	options.checksums = accepted;
+	BasicListener<Policy> listener(a, service, options);
+	test::RawSocket raw(b);
+	mac_t server = listener.getLMac();
+	CONNECT cpkt;
+	cpkt.connection = id++;
+	cpkt.service = service;
+	cpkt.flags = offered;
+	raw.sendPacket(server, &cpkt, sizeof(cpkt));
+	vector<unique_ptr<BasicServerConnection<Policy>>> conns;
+	shared_ptr<PktBase> ack;
+	uint16_t size;
+	test::until([&]{
+		while(auto conn = listener.listen())
+			conns.emplace_back(conn);
+		ack = raw.receive(server, tACK, size, 0);
+		return ack != nullptr;
+	}, 300);
+	if(!ack)
+		return -1;
+	CHECK(ack->connection == cpkt.connection);
+	return ACKFLAGS_CHKSUM_GET(((ACK*)ack.get())->errflags);
+}
+
+static void negotiation(string a, string b){
+	uint16_t fletcher = CONNFLAG_CHKSUM(cFLETCHER16), crc = CONNFLAG_CHKSUM(cCRC32C), none = CONNFLAG_CHKSUM(cNONE);
+	CHECK(negotiate<DefaultPolicy>(a, b, crc, 0) == cFLETCHER16); // v1 clients offer nothing
+	CHECK(negotiate<DefaultPolicy>(a, b, crc, crc) == cCRC32C);
+	CHECK(negotiate<DefaultPolicy>(a, b, crc, crc | none) == cCRC32C); // none only if accepted
+	CHECK(negotiate<DefaultPolicy>(a, b, crc | none, crc | none) == cNONE);
+	CHECK(negotiate<DefaultPolicy>(a, b, 0, crc | none) == cFLETCHER16);
+	CHECK(negotiate<DefaultPolicy>(a, b, 0, fletcher) == cFLETCHER16);
+	CHECK(negotiate<ThroughputPolicy>(a, b, 0, crc) == cCRC32C);
+	CHECK(negotiate<ThroughputPolicy>(a, b, 0, 0) == -1); // Has to support fletcher16 to answer
+}
+
+// Transfers with the checksum type offered by the client
+static void transfer(string a, string b, uint8_t type){
+	const size_t len = 200000;
+	ConnectionOptions options;
+	options.window = 8;
+	options.checksums = CONNFLAG_CHKSUM(cCRC32C) | CONNFLAG_CHKSUM(cNONE);
+	Listener listener(a, service, options);
+	options.checksums = CONNFLAG_CHKSUM(type);
+	Client client(b, listener.getLMac(), service, options);
+	unique_ptr<ServerConnection> conn;
+	CHECK(test::until([&]{
+		client.work();
+		if(!conn)
+			conn.reset(listener.listen());
+		return conn && client.connected();
+	}));
+	if(!conn)
+		return;
+	vector<char> data(len), got;
+	for(size_t i = 0; i < len; i++)
+		data[i] = (char)(i*11 + i/509);
+	size_t sent = 0;
+	char buf[4096];
+	CHECK(test::until([&]{
+		if(sent < len)
+			sent += client.write(&data[sent], min<size_t>(len - sent, 8192));
+		client.work();
+		conn->work();
+		uint32_t r = conn->read(buf, sizeof(buf));
+		got.insert(got.end(), buf, buf + r);
+		return got.size() >= len;
+	}));
+	CHECK(got == data);
+	CHECK(conn->getStats().checksumErrors == 0);
+	CHECK(client.getStats().retransmits == 0);
+}
+
+int main(int argc, char** argv){
+	string a, b;
+	test::interfaces(argc, argv, a, b);
+	implementations();
+	negotiation(a, b);
+	for(uint8_t type : {cFLETCHER16, cCRC32C, cNONE})
+		transfer(a, b, type);
+	return test::result("test.checksum");
+}
@@ -0,0 +1,454 @@
+/*
+ * test.connection.cpp
+ *
+ * Transfers over a lossless link: the data has to arrive unchanged and nothing may be resent,
+ * even though the receiver stalls now and then (as while writing to a slow disk). The minimal
+ * policy stays stop and wait with its fixed buffers, whatever window is asked for. Early data
+ * given to the Client has to arrive completely, even beyond the send buffer limit. Many clients
+ * of one process share its Demux and each one gets only its own data. A sender held back by a full
+ * receive buffer resumes as soon as it is read. Gathered and zero copy writes arrive byte-exact,
+ * the latter handed back only once acknowledged. A connection driven by
+ * poll() on its fds wakes up for everything, also for data written to its stream socket, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.connection.cpp -o test.connection && ./test.connection va vb
+ */
+
+extern "C"{
+#include <poll.h>
+}
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "libetherstream.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+static const uint16_t service = 201;
+
+static vector<char> pattern(size_t len){
+	vector<char> data(len);
+	for(size_t i = 0; i < len; i++)
+		data[i] = (char)(i*7 + i/251);
+	return data;
+}
+
+// Forks a server on iface a, which echoes everything until the client closed
+static pid_t echo(string a, ConnectionOptions options = ConnectionOptions()){
+	return test::fork([=]{
+		Listener listener(a, service, options);
+		ServerConnection* conn = nullptr;
+		if(!test::until([&]{ return (conn = listener.listen()) != nullptr; }))
+			return 1;
+		char buf[4096];
+		test::until([&]{
+			conn->work();
+			uint32_t r = conn->read(buf, sizeof(buf));
+			if(r)
+				conn->write(buf, r);
+			return conn->closed();
+		}, 60000);
+		delete conn;
+		return 0;
+	});
+}
+
+static bool readable(int fd){
+	struct pollfd pfd = {fd, POLLIN, 0};
+	return poll(&pfd, 1, 0) == 1;
+}
+
+// Sleeps in poll() on the fds of client until one is readable or its nextTimeout() passed (at most ms), then works
+static void pollWork(Client& client, int ms){
+	int tmout = client.nextTimeout();
+	struct pollfd fds[4] = {
+		{client.getFd(), POLLIN, 0},
+		{client.getDemux()->getFd(), POLLIN, 0},
+		{client.readyFd(), POLLIN, 0},
+		{client.streamWorkFd(), POLLIN, 0},
+	};
+	poll(fds, 4, tmout < 0 || tmout > ms ? ms : tmout);
+	if(fds[1].revents)
+		client.getDemux()->dispatch();
+	client.work();
+}
+
+// Sends len bytes with window from iface b to a, the receiver stalls up to stallUs every ~100 reads
+static void transfer(string a, string b, size_t len, uint16_t window, int stallUs){
+	ConnectionOptions options;
+	options.window = window;
+	mac_t server = test::macOf(a);
+	pid_t pid = test::fork([&]{
+		Listener listener(a, service, options);
+		ServerConnection* conn = nullptr;
+		if(!test::until([&]{ return (conn = listener.listen()) != nullptr; }))
+			return 1;
+		vector<char> expected = pattern(len), got;
+		mt19937 rnd(1);
+		char buf[4096];
+		test::until([&]{
+			conn->work();
+			uint32_t r = conn->read(buf, sizeof(buf));
+			got.insert(got.end(), buf, buf + r);
+			if(stallUs && rnd() % 100 == 0)
+				usleep(rnd() % stallUs);
+			return got.size() >= len;
+		}, 60000);
+		CHECK(got == expected);
+		test::until([&]{ conn->work(); return false; }, 200); // Acknowledge the last packets again if needed
+		return test::failures;
+	});
+	usleep(100000);
+	Client client(b, server, service, options);
+	CHECK(test::until([&]{ client.work(); return client.connected(); }));
+	vector<char> data = pattern(len);
+	size_t sent = 0;
+	CHECK(test::until([&]{
+		if(sent < len)
+			sent += client.write(&data[sent], min<size_t>(4096, len - sent));
+		client.work();
+		return sent == len && !client.pending();
+	}, 60000));
+	ConnectionStats stats = client.getStats();
+	CHECK(stats.payloadSent == len);
+	CHECK(stats.retransmits == 0);
+	CHECK(stats.timeouts == 0);
+	if(stats.retransmits)
+		printf("window %u: %llu retransmits, %llu timeouts, srtt %lldus\n", window,
+			(unsigned long long)stats.retransmits, (unsigned long long)stats.timeouts, (long long)stats.srtt);
+	CHECK(test::join(pid));
+}
+
+/*
+ * Sends len bytes from iface b to a with a client and server of Policy (fixed buffers and slabs),
+ * whatever window the options ask for, a stop and wait policy keeps one packet in flight.
+ */
+template<typename Policy>
+static void transferWith(string a, string b, size_t len, uint16_t window){
+	ConnectionOptions options;
+	options.window = window;
+	mac_t server = test::macOf(a);
+	pid_t pid = test::fork([&]{
+		BasicListener<Policy> listener(a, service, options);
+		BasicServerConnection<Policy>* conn = nullptr;
+		if(!test::until([&]{ return (conn = listener.listen()) != nullptr; }))
+			return 1;
+		vector<char> got;
+		char buf[4096];
+		test::until([&]{
+			conn->work();
+			uint32_t r = conn->read(buf, sizeof(buf));
+			got.insert(got.end(), buf, buf + r);
+			return got.size() >= len;
+		}, 60000);
+		CHECK(got == pattern(len));
+		CHECK(conn->getChecksumType() == cFLETCHER16);
+		test::until([&]{ conn->work(); return false; }, 200);
+		delete conn;
+		return test::failures;
+	});
+	usleep(100000);
+	BasicClient<Policy> client(b, server, service, options);
+	CHECK(test::until([&]{ client.work(); return client.connected(); }));
+	vector<char> data = pattern(len);
+	size_t sent = 0;
+	uint16_t maxInFlight = 0;
+	CHECK(test::until([&]{
+		if(sent < len)
+			sent += client.write(&data[sent], min<size_t>(4096, len - sent)); // Limited by the fixed slabs
+		client.work();
+		maxInFlight = max(maxInFlight, client.getStats().inFlight);
+		return sent == len && !client.pending();
+	}, 60000));
+	ConnectionStats stats = client.getStats();
+	CHECK(stats.payloadSent == len);
+	CHECK(stats.window == 1 && maxInFlight == 1);
+	CHECK(stats.retransmits == 0);
+	CHECK(test::join(pid));
+}
+
+// Early data of len bytes with a send buffer limited to 4KB
+static void earlyData(string a, string b, size_t len){
+	ConnectionOptions options;
+	options.sendBufHigh = 4096;
+	options.sendBufLow = 1024;
+	mac_t server = test::macOf(a);
+	pid_t pid = test::fork([&]{
+		Listener listener(a, service, options);
+		ServerConnection* conn = nullptr;
+		if(!test::until([&]{ return (conn = listener.listen()) != nullptr; }))
+			return 1;
+		vector<char> got;
+		char buf[4096];
+		test::until([&]{
+			conn->work();
+			uint32_t r = conn->read(buf, sizeof(buf));
+			got.insert(got.end(), buf, buf + r);
+			return got.size() >= len;
+		});
+		CHECK(got == pattern(len));
+		test::until([&]{ conn->work(); return false; }, 200);
+		return test::failures;
+	});
+	usleep(100000);
+	vector<char> data = pattern(len);
+	Client client(b, server, service, options, string(data.begin(), data.end()));
+	CHECK(client.pending() == len);
+	CHECK(client.writable() == (len < options.sendBufHigh));
+	CHECK(test::until([&]{ client.work(); return client.connected() && !client.pending(); }));
+	CHECK(client.writable());
+	CHECK(test::join(pid));
+}
+
+// Clients of one process echoed by a server accepting them all, frames are routed by MAC and connection id
+static void concurrent(string a, string b, size_t clients){
+	mac_t server = test::macOf(a);
+	pid_t pid = test::fork([&]{
+		Listener listener(a, service);
+		listener.setAcceptQueue(clients, 30000);
+		vector<unique_ptr<ServerConnection>> conns;
+		char buf[4096];
+		test::until([&]{
+			while(ServerConnection* conn = listener.listen())
+				conns.emplace_back(conn);
+			size_t closed = 0;
+			for(auto& conn : conns){
+				conn->work();
+				uint32_t r = conn->read(buf, sizeof(buf));
+				if(r)
+					conn->write(buf, r);
+				closed += conn->closed();
+			}
+			return closed == clients;
+		}, 60000);
+		CHECK(conns.size() == clients);
+		return test::failures;
+	});
+	usleep(100000);
+	vector<unique_ptr<Client>> conns;
+	vector<string> data(clients), got(clients);
+	for(size_t i = 0; i < clients; i++){
+		conns.emplace_back(new Client(b, server, service));
+		data[i] = "client " + to_string(i) + string(i*37 % 3000, 'a' + i % 26);
+	}
+	CHECK(conns.front()->getDemux() == conns.back()->getDemux());
+	vector<bool> written(clients);
+	char buf[4096];
+	CHECK(test::until([&]{
+		size_t done = 0;
+		for(size_t i = 0; i < clients; i++){
+			Client& c = *conns[i];
+			c.work();
+			if(c.connected() && !written[i])
+				written[i] = c.write(data[i]) == data[i].size();
+			uint32_t r = c.read(buf, sizeof(buf));
+			got[i].append(buf, r);
+			done += got[i].size() >= data[i].size();
+		}
+		return done == clients;
+	}, 30000));
+	for(size_t i = 0; i < clients; i++)
+		CHECK(got[i] == data[i]);
+	for(auto& c : conns){
+		c->close();
+		c->work();
+	}
+	CHECK(test::join(pid));
+}
+
+/*
+ * The receiver stops reading until its buffer is full, the limited send buffer holds the writer back
+ * meanwhile. Once it reads again, the sender resumes right away instead of after its backed off
+ * retransmission timeout (up to 1.6s after the 1.5s stall) and the writer is called back.
+ */
+static void backpressure(string a, string b, size_t len){
+	ConnectionOptions options;
+	options.window = 4;
+	options.recvBufSize = 16384;
+	Listener listener(a, service, options);
+	Client client(b, listener.getLMac(), service, options);
+	unique_ptr<ServerConnection> conn;
+	CHECK(test::until([&]{
+		client.work();
+		if(!conn)
+			conn.reset(listener.listen());
+		return conn && client.connected();
+	}));
+	if(!conn)
+		return;
+	client.setSendBuffer(8192, 2048);
+	int called = 0;
+	client.onWritable([&]{ called++; });
+	vector<char> data = pattern(len), got;
+	size_t sent = 0;
+	bool limited = false;
+	char buf[4096];
+	auto step = [&](bool reading){
+		if(sent < len && client.writable()){
+			uint32_t w = client.write(&data[sent], min<size_t>(3000, len - sent));
+			limited |= w < min<size_t>(3000, len - sent);
+			sent += w;
+		}
+		client.work();
+		conn->work();
+		uint32_t r = reading ? conn->read(buf, sizeof(buf)) : 0;
+		got.insert(got.end(), buf, buf + r);
+	};
+	test::until([&]{ step(false); return false; }, 1500);
+	uint32_t full = conn->available();
+	CHECK(full > options.recvBufSize - 2*ETH_DATA_LEN && full <= options.recvBufSize);
+	CHECK(limited && !client.writable());
+	int stalled = called;
+	CHECK(client.getStats().timeouts >= 2); // Backed off
+	auto start = chrono::steady_clock::now();
+	CHECK(test::until([&]{ step(true); return got.size() + conn->available() > full; }, 3000));
+	CHECK(chrono::steady_clock::now() - start < chrono::milliseconds(500));
+	CHECK(test::until([&]{ step(true); return got.size() >= len; }, 20000));
+	CHECK(got == data);
+	CHECK(called > stalled);
+	CHECK(client.writable() && sent == len);
+}
+
+/*
+ * writev() fills slabs across the boundaries of its iovecs, writeRef() sends from the caller's memory
+ * and hands it back only once all of it was acknowledged. Everything arrives byte-exact and in order.
+ */
+static void gather(string a, string b){
+	ConnectionOptions options;
+	options.window = 4;
+	Listener listener(a, service, options);
+	Client client(b, listener.getLMac(), service, options);
+	unique_ptr<ServerConnection> conn;
+	CHECK(test::until([&]{
+		client.work();
+		if(!conn)
+			conn.reset(listener.listen());
+		return conn && client.connected();
+	}));
+	if(!conn)
+		return;
+	vector<char> data = pattern(30000), got;
+	size_t offs = 0;
+	auto writev = [&](vector<size_t> sizes){
+		vector<struct iovec> iov;
+		size_t total = 0;
+		for(size_t size : sizes){
+			iov.push_back({&data[offs + total], size});
+			total += size;
+		}
+		CHECK(client.writev(iov.data(), iov.size()) == total);
+		offs += total;
+	};
+	writev({1, 700, 1499, 3000, 13, 1800});
+	bool done = false;
+	size_t arrived = 0; // When done was called
+	CHECK(client.writeRef(&data[offs], 20000, [&]{ done = true; arrived = got.size() + conn->available(); }));
+	offs += 20000;
+	writev({987, 1, 1999});
+	CHECK(offs == data.size());
+	CHECK(!test::until([&]{ client.work(); return done; }, 300)); // Sent, but not acknowledged
+	char buf[4096];
+	CHECK(test::until([&]{
+		client.work();
+		conn->work();
+		uint32_t r = conn->read(buf, sizeof(buf));
+		got.insert(got.end(), buf, buf + r);
+		return got.size() >= data.size() && !client.pending();
+	}));
+	CHECK(got == data);
+	CHECK(done && arrived >= offs - 2987);
+}
+
+// The client sleeps in poll() and wakes up by its fds: a poll() running into its 3s limit fails the 2s ones of the checks
+static void events(string a, string b){
+	pid_t pid = echo(a);
+	usleep(100000);
+	Client client(b, test::macOf(a), service);
+	int ready = client.readyFd();
+	CHECK(test::until([&]{ pollWork(client, 3000); return client.connected(); }, 2000));
+	CHECK(test::until([&]{ pollWork(client, 3000); return client.nextTimeout() == -1; }, 2000)); // CONNECT acknowledged
+	CHECK(!readable(ready));
+	string data = "woken up by poll";
+	CHECK(client.write(data) == data.size());
+	CHECK(client.nextTimeout() == 0); // Not sent yet
+	client.work();
+	int tmout = client.nextTimeout();
+	CHECK(tmout > 0 && tmout <= (int)client.getStats().rto); // Waits for the ACK
+	CHECK(test::until([&]{ pollWork(client, 3000); return readable(ready); }, 2000));
+	char buf[64];
+	CHECK(client.read(buf, sizeof(buf)) == data.size() && memcmp(buf, data.data(), data.size()) == 0);
+	CHECK(!readable(ready));
+	client.close();
+	CHECK(readable(ready)); // Closed
+	CHECK(test::join(pid));
+}
+
+// Data written to the stream socket is sent without other events, splice moves len bytes from a file and back into one
+static void stream(string a, string b, size_t len){
+	pid_t pid = echo(a);
+	usleep(100000);
+	Client client(b, test::macOf(a), service);
+	CHECK(test::until([&]{ pollWork(client, 3000); return client.connected(); }, 2000));
+	int fd = client.streamFd();
+	string data = "through the socket", back;
+	CHECK(::write(fd, data.data(), data.size()) == (ssize_t)data.size());
+	char buf[4096];
+	CHECK(test::until([&]{
+		pollWork(client, 3000);
+		ssize_t r = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if(r > 0)
+			back.append(buf, r);
+		return back.size() >= data.size();
+	}, 2000));
+	CHECK(back == data);
+
+	vector<char> expected = pattern(len), got(len);
+	FILE* in = tmpfile();
+	FILE* out = tmpfile();
+	CHECK(fwrite(expected.data(), 1, len, in) == len && fflush(in) == 0);
+	rewind(in);
+	size_t sent = 0, received = 0;
+	CHECK(test::until([&]{
+		if(sent < len){
+			ssize_t r = client.spliceFrom(fileno(in), len - sent);
+			if(r > 0)
+				sent += r;
+		}
+		pollWork(client, 3000);
+		ssize_t r = client.spliceTo(fileno(out), len - received);
+		if(r > 0)
+			received += r;
+		return received >= len;
+	}, 5000));
+	CHECK(sent == len && received == len);
+	CHECK(pread(fileno(out), got.data(), len, 0) == (ssize_t)len && got == expected);
+	fclose(in);
+	fclose(out);
+	client.close();
+	client.work();
+	CHECK(test::join(pid));
+}
+
+int main(int argc, char** argv){
+	string a, b;
+	test::interfaces(argc, argv, a, b);
+	transfer(a, b, 300000, 1, 0);
+	transfer(a, b, 5000000, 16, 0);
+	transfer(a, b, 5000000, 16, 60000);
+	transferWith<MinimalPolicy<>>(a, b, 300000, 1);
+	transferWith<MinimalPolicy<>>(a, b, 300000, 16);
+	transferWith<MinimalPolicy<4096, 2>>(a, b, 100000, 16);
+	earlyData(a, b, 100);
+	earlyData(a, b, 100000);
+	concurrent(a, b, 200);
+	backpressure(a, b, 200000);
+	gather(a, b);
+	events(a, b);
+	stream(a, b, 12813);
+	return test::result("test.connection");
+}
@@ -0,0 +1,162 @@
+/*
+ * test.coro.cpp
+ *
+ * The EventLoop works a source only when its fd became readable or its timer expired and
+ * resumes the coroutines waiting for it. Several coroutine clients echo through one server, e.g.:
+ *   g++ -std=c++20 -O2 -pthread test.coro.cpp -o test.coro && ./test.coro va vb
+ */
+
+extern "C"{
+#include <fcntl.h>
+}
+#include <string>
+#include <vector>
+
+#include "libetherstream.coro.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+static const uint16_t service = 203;
+static const int clients = 3;
+static const int rounds = 20;
+
+struct Pipe{
+	int fds[2];
+	Pipe(){
+		if(pipe2(fds, O_NONBLOCK) == -1)
+			std::abort();
+	}
+	~Pipe(){
+		::close(fds[0]);
+		::close(fds[1]);
+	}
+};
+
+// Waits until a byte can be read from the pipe, which has to be attached
+class PipeRead: public EventLoop::Awaitable{
+private:
+	Pipe* pipe;
+	char& byte;
+	bool got = false;
+protected:
+	bool ready() override{
+		if(!got)
+			got = ::read(pipe->fds[0], &byte, 1) == 1;
+		return got;
+	}
+public:
+	PipeRead(EventLoop& loop, Pipe* pipe, char& byte): EventLoop::Awaitable(loop, pipe), pipe(pipe), byte(byte){
+	}
+};
+
+static Task waitPipe(EventLoop& loop, Pipe* pipe, char* got){
+	co_await PipeRead(loop, pipe, *got);
+}
+
+// Idle sources are not worked, a timer source is worked as its timeout() asks for
+static void dispatch(){
+	EventLoop loop;
+	vector<Pipe> idle(100);
+	vector<int> idleWorked(idle.size());
+	for(size_t i = 0; i < idle.size(); i++)
+		loop.attach(&idle[i], idle[i].fds[0], [&idleWorked, i]{ idleWorked[i]++; });
+	Pipe timer, wake;
+	int ticks = 0;
+	auto start = chrono::steady_clock::now();
+	loop.attach(&timer, timer.fds[0], [&]{
+		if(++ticks == 20)
+			CHECK(::write(wake.fds[1], "x", 1) == 1);
+	}, [&]{
+		return ticks < 20 ? 10 : -1;
+	});
+	loop.attach(&wake, wake.fds[0], []{});
+	char got = 0;
+	waitPipe(loop, &wake, &got);
+	loop.run();
+	auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+	CHECK(got == 'x');
+	CHECK(ticks == 20);
+	CHECK(ms >= 190 && ms < 900);
+	for(int w : idleWorked)
+		CHECK(w == 0);
+}
+
+static Task session(EventLoop& loop, ServerConnection* c, int* done){
+	{
+		AsyncConnection<ServerConnection> conn(loop, c);
+		char buf[4096];
+		uint32_t r;
+		while((r = co_await conn.read(buf)))
+			co_await conn.write(buf, r);
+	}
+	delete c;
+	(*done)++;
+}
+
+static Task server(EventLoop& loop, Listener* l, int* done){
+	AsyncListener al(loop, l);
+	for(int i = 0; i < clients; i++){
+		ServerConnection* c = co_await al.accept();
+		session(loop, c, done);
+	}
+}
+
+static Task client(EventLoop& loop, Client* cl, int id, int* ok){
+	AsyncClient c(loop, cl);
+	if(!co_await c.connect())
+		co_return;
+	for(int i = 0; i < rounds; i++){
+		string msg = to_string(id) + ":" + to_string(i) + string(i == rounds/2 ? 100000 : 10, 'a' + id);
+		co_await c.write(msg);
+		string back;
+		char buf[4096];
+		while(back.size() < msg.size()){
+			uint32_t r = co_await c.read(buf);
+			if(!r)
+				co_return;
+			back.append(buf, r);
+		}
+		if(back == msg)
+			(*ok)++;
+	}
+	c.close();
+}
+
+// Clients in one loop echo through a server, which serves them in one loop as well
+static void echo(string a, string b){
+	mac_t server = test::macOf(a);
+	pid_t pid = test::fork([&]{
+		EventLoop loop;
+		Listener l(a, service);
+		int done = 0;
+		::server(loop, &l, &done);
+		loop.run();
+		CHECK(done == clients);
+		return test::failures;
+	});
+	usleep(100000);
+	EventLoop loop;
+	vector<Client*> conns;
+	int ok = 0;
+	for(int i = 0; i < clients; i++){
+		conns.push_back(new Client(b, server, service));
+		client(loop, conns.back(), i, &ok);
+	}
+	loop.run();
+	CHECK(ok == clients*rounds);
+	for(Client* c : conns){
+		test::until([&]{ c->work(); return false; }, 100); // Let the CLOSE go out
+		delete c;
+	}
+	CHECK(test::join(pid));
+}
+
+int main(int argc, char** argv){
+	string a, b;
+	test::interfaces(argc, argv, a, b);
+	dispatch();
+	echo(a, b);
+	return test::result("test.coro");
+}
@@ -0,0 +1,123 @@
+/*
+ * test.discovery.cpp
+ *
+ * A Listener answers DISCOVERs to the broadcast and the discovery group with its services, name
+ * and checksums, only for the services it offers. The answers of several listeners of a host are
+ * merged. Answers are cached for later lookups by name and malformed ones are dropped, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.discovery.cpp -o test.discovery && ./test.discovery va vb
+ */
+
+#include <csignal>
+#include <string>
+#include <vector>
+
+#include "libetherstream.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+static const uint16_t service = 207;
+
+static bool sameMac(const mac_t& x, const mac_t& y){
+	return memcmp(x.bytes, y.bytes, sizeof(mac_t)) == 0;
+}
+
+static void announced(string a, string b){
+	mac_t server = test::macOf(a);
+	pid_t pid = test::fork([&]{
+		Listener listener(a);
+		listener.addService(service);
+		listener.addService(service + 1);
+		listener.setName("dev-a");
+		test::until([&]{ delete listener.listen(); return false; }, 60000);
+		return 0;
+	});
+	usleep(100000);
+	Discovery discovery(b);
+	vector<Peer> found = discovery.discover();
+	CHECK(found.size() == 1);
+	if(found.size() == 1){
+		const Peer& peer = found[0];
+		CHECK(sameMac(peer.mac, server));
+		CHECK(peer.name == "dev-a");
+		CHECK(peer.services.size() == 2 && peer.offers(service) && peer.offers(service + 1));
+		CHECK(peer.flags & CONNFLAG_CHKSUM(cCRC32C));
+		CHECK(peer.flags & CONNFLAG_RESUMABLE);
+	}
+	CHECK(discovery.discover(service + 2, 300).empty()); // Not offered, not answered
+	CHECK(discovery.discover(service, 300, discoveryGroup).size() == 1);
+	kill(pid, SIGKILL);
+	test::join(pid);
+	// Answered from the cache, the host is gone
+	mac_t mac;
+	CHECK(discovery.resolve("dev-a", service + 1, mac) && sameMac(mac, server));
+	CHECK(!discovery.resolve("dev-a", service + 2, mac, 100));
+	CHECK(!discovery.resolve("dev-b", service, mac, 100));
+	CHECK(discovery.cached().size() == 1);
+	discovery.clear();
+	CHECK(!discovery.resolve("dev-a", service, mac, 100));
+}
+
+// Two listeners of a host answer on their own, the host is found once with the services of both
+static void twoListeners(string a, string b){
+	mac_t server = test::macOf(a);
+	pid_t pid = test::fork([&]{
+		Listener first(a, service);
+		Listener second(a, service + 1);
+		first.setName("dev-a");
+		second.setName("dev-a");
+		test::until([&]{ delete first.listen(); delete second.listen(); return false; }, 60000);
+		return 0;
+	});
+	usleep(100000);
+	Discovery discovery(b);
+	vector<Peer> found = discovery.discover();
+	CHECK(found.size() == 1);
+	if(found.size() == 1){
+		CHECK(sameMac(found[0].mac, server) && found[0].name == "dev-a");
+		CHECK(found[0].services.size() == 2 && found[0].offers(service) && found[0].offers(service + 1));
+	}
+	vector<Peer> cached = discovery.cached();
+	CHECK(cached.size() == 1 && cached[0].services.size() == 2);
+	// Only the second one answers, the service of the first one stays cached
+	found = discovery.discover(service + 1, 300);
+	CHECK(found.size() == 1 && found[0].offers(service) && found[0].offers(service + 1));
+	mac_t mac;
+	CHECK(discovery.resolve("dev-a", service, mac, 100) && sameMac(mac, server));
+	kill(pid, SIGKILL);
+	test::join(pid);
+}
+
+// An ANNOUNCE listing more services than it carries is not taken
+static void malformed(string a, string b){
+	pid_t pid = test::fork([&]{
+		test::RawSocket raw(a);
+		uint16_t size;
+		auto dpkt = raw.receive(test::macOf(b), tDISCOVER, size, 5000);
+		if(!dpkt)
+			return 1;
+		char frame[sizeof(ANNOUNCE) + 4] = {0};
+		ANNOUNCE apkt;
+		apkt.connection = dpkt->connection;
+		apkt.serviceCount = 50;
+		apkt.nameLen = 4;
+		memcpy(frame, &apkt, sizeof(apkt));
+		raw.sendPacket(test::macOf(b), frame, sizeof(frame));
+		return 0;
+	});
+	usleep(100000);
+	Discovery discovery(b);
+	CHECK(discovery.discover(0, 300).empty());
+	CHECK(discovery.cached().empty());
+	CHECK(test::join(pid));
+}
+
+int main(int argc, char** argv){
+	string a, b;
+	test::interfaces(argc, argv, a, b);
+	announced(a, b);
+	twoListeners(a, b);
+	malformed(a, b);
+	return test::result("test.discovery");
+}
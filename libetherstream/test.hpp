@@ -0,0 +1,124 @@
+/*
+ * test.hpp
+ *
+ * Helpers of the test.*.cpp programs. Each one is built and run on its own and exits with 1 if
+ * a check failed, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.buffer.cpp -o test.buffer && ./test.buffer
+ * The ones sending frames need root and two connected interfaces (a veth pair):
+ *   ip link add va type veth peer name vb && ip link set va up && ip link set vb up
+ */
+
+#pragma once
+
+extern "C"{
+#include <sys/wait.h>
+#include <unistd.h>
+}
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <string>
+
+#include "libetherstream.socket.hpp"
+
+namespace ethstream{
+namespace test{
+
+static int failures = 0;
+
+#define CHECK(...) ethstream::test::check((__VA_ARGS__), #__VA_ARGS__, __FILE__, __LINE__)
+
+inline bool check(bool ok, const char* what, const char* file, int line){
+	if(!ok){
+		std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+		failures++;
+	}
+	return ok;
+}
+
+// Prints the outcome of the named test, returns the exit code of main()
+inline int result(const char* name){
+	std::printf("%s: %s\n", name, failures ? "FAILED" : "OK");
+	return failures ? 1 : 0;
+}
+
+// The two interfaces given as arguments, exits if they are missing
+inline void interfaces(int argc, char** argv, std::string& a, std::string& b){
+	if(argc < 3){
+		std::fprintf(stderr, "Usage: %s <iface> <peer iface>\n", argv[0]);
+		std::exit(2);
+	}
+	a = argv[1];
+	b = argv[2];
+}
+
+// Address of the interface iface
+inline mac_t macOf(std::string iface){
+	std::ifstream file("/sys/class/net/" + iface + "/address");
+	std::string str;
+	mac_t mac = {};
+	if(!(file >> str) || !parseMac(str, mac)){
+		std::fprintf(stderr, "Interface %s not found\n", iface.c_str());
+		std::exit(2);
+	}
+	return mac;
+}
+
+// Runs fn in a child process, its return value is the exit code
+inline pid_t fork(std::function<int()> fn){
+	std::fflush(stdout);
+	std::fflush(stderr);
+	pid_t pid = ::fork();
+	if(pid == 0){
+		failures = 0; // Counts the ones of the child from here
+		int code = fn();
+		std::fflush(stdout);
+		std::fflush(stderr);
+		_exit(code);
+	}
+	return pid;
+}
+
+// Waits for the child started with fork(), true if it exited with 0
+inline bool join(pid_t pid){
+	int status;
+	if(waitpid(pid, &status, 0) != pid)
+		return false;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Calls fn until it returns true or ms passed, returns its last result
+inline bool until(std::function<bool()> fn, int ms = 10000){
+	auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+	while(!fn()){
+		if(std::chrono::steady_clock::now() > end)
+			return false;
+	}
+	return true;
+}
+
+// Sends and receives raw packets, e.g. to play a remote not behaving like the library
+class RawSocket: public Socket{
+public:
+	RawSocket(std::string iface): Socket(iface){
+	}
+	using Socket::getLMac;
+	using Socket::joinGroup;
+	using Socket::sendPacket;
+	using Socket::recvPkt;
+	// Next packet of type from src within ms, nullptr if none came
+	std::shared_ptr<PktBase> receive(mac_t src, uint8_t type, uint16_t& size, int ms = 1000){
+		std::shared_ptr<PktBase> pkt;
+		mac_t from;
+		bool found = until([&]{
+			pkt = recvPkt(from, size);
+			return pkt && pkt->type == type && std::memcmp(from.bytes, src.bytes, sizeof(mac_t)) == 0;
+		}, ms);
+		return found ? pkt : nullptr;
+	}
+};
+
+};
+};
@@ -0,0 +1,141 @@
+/*
+ * test.listener.cpp
+ *
+ * CONNECT de-duplication of the Listener: retries of a CONNECT are answered again, but start no
+ * other connection, and a client keeps its retry counter at 255 instead of wrapping to a first
+ * CONNECT. Connections are dispatched by service, unknown services are not answered, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.listener.cpp -o test.listener && ./test.listener va vb
+ */
+
+#include <memory>
+#include <vector>
+
+#include "libetherstream.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+static const uint16_t service = 202;
+
+/*
+ * Sends CONNECTs with increasing retry counters, each is answered by the listener or the
+ * connection, but only one connection is started
+ */
+static void retries(string a, string b){
+	Listener listener(a, service);
+	test::RawSocket raw(b);
+	mac_t server = listener.getLMac();
+	vector<unique_ptr<ServerConnection>> conns;
+	auto pump = [&]{
+		while(ServerConnection* conn = listener.listen())
+			conns.emplace_back(conn);
+		for(auto& conn : conns)
+			conn->work();
+	};
+	CONNECT cpkt;
+	cpkt.connection = 0x12345678;
+	cpkt.service = service;
+	for(int sent : {1, 2, 3, 200, 255}){
+		cpkt.sentCount = sent;
+		raw.sendPacket(server, &cpkt, sizeof(cpkt));
+		shared_ptr<PktBase> ack;
+		uint16_t size;
+		CHECK(test::until([&]{
+			pump();
+			ack = raw.receive(server, tACK, size, 0);
+			return ack != nullptr;
+		}, 1000));
+		CHECK(ack && ack->connection == cpkt.connection && ack->pktNo == 0);
+	}
+	test::until([&]{ pump(); return false; }, 100);
+	CHECK(conns.size() == 1);
+	cpkt.connection = 0x12345679; // Another connection
+	cpkt.sentCount = 1;
+	raw.sendPacket(server, &cpkt, sizeof(cpkt));
+	test::until([&]{ pump(); return false; }, 100);
+	CHECK(conns.size() == 2);
+}
+
+// The client retries to a host, which does not answer, more than 255 times
+static void saturation(string a, string b){
+	test::RawSocket raw(a);
+	ConnectionOptions options;
+	options.connectRetry = 1;
+	options.connectRetryMax = 1;
+	Client client(b, raw.getLMac(), service, options);
+	mac_t clientMac = client.getLMac();
+	int connects = 0, last = 0;
+	bool wrapped = false;
+	test::until([&]{
+		client.work();
+		uint16_t size;
+		auto pkt = raw.receive(clientMac, tCONNECT, size, 0);
+		if(pkt){
+			connects++;
+			int sent = ((CONNECT*)pkt.get())->sentCount;
+			wrapped |= sent < last;
+			last = sent;
+		}
+		return connects >= 300;
+	});
+	CHECK(connects >= 300);
+	CHECK(!wrapped && last == 255);
+}
+
+// Accepted connections go to the handler of their service or are returned, other services are not answered
+static void services(string a, string b){
+	Listener listener(a);
+	vector<unique_ptr<ServerConnection>> first, second, returned;
+	listener.addService(service, [&](ServerConnection* conn){ first.emplace_back(conn); });
+	listener.addService(service + 1, [&](ServerConnection* conn){ second.emplace_back(conn); });
+	listener.addService(service + 2);
+	mac_t server = listener.getLMac();
+	vector<unique_ptr<Client>> clients;
+	for(int offs : {0, 1, 1, 2})
+		clients.emplace_back(new Client(b, server, service + offs));
+	auto pump = [&]{
+		while(ServerConnection* conn = listener.listen())
+			returned.emplace_back(conn);
+		for(auto& c : clients)
+			c->work();
+	};
+	CHECK(test::until([&]{
+		pump();
+		for(auto& c : clients)
+			if(!c->connected())
+				return false;
+		return true;
+	}));
+	CHECK(first.size() == 1 && second.size() == 2 && returned.size() == 1);
+	for(auto& conn : first)
+		CHECK(conn->getService() == service);
+	for(auto& conn : second)
+		CHECK(conn->getService() == service + 1);
+	for(auto& conn : returned)
+		CHECK(conn->getService() == service + 2);
+
+	// Neither a service never added nor a removed one is answered
+	listener.removeService(service + 1);
+	test::RawSocket raw(b);
+	for(int offs : {3, 1}){
+		CONNECT cpkt;
+		cpkt.connection = 0x2345678 + offs;
+		cpkt.service = service + offs;
+		raw.sendPacket(server, &cpkt, sizeof(cpkt));
+		uint16_t size;
+		CHECK(!test::until([&]{ pump(); return raw.receive(server, tACK, size, 0) != nullptr; }, 300));
+	}
+	Client unknown(b, server, service + 3);
+	CHECK(!test::until([&]{ pump(); unknown.work(); return unknown.connected(); }, 500));
+	CHECK(first.size() == 1 && second.size() == 2 && returned.size() == 1);
+}
+
+int main(int argc, char** argv){
+	string a, b;
+	test::interfaces(argc, argv, a, b);
+	retries(a, b);
+	saturation(a, b);
+	services(a, b);
+	return test::result("test.listener");
+}
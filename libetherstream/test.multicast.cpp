@@ -0,0 +1,145 @@
+/*
+ * test.multicast.cpp
+ *
+ * Losses of a multicast transfer are repaired by NAKs: the receiver reports exactly the packets
+ * it missed and confirms once complete, the sender resends only the packets reported and stops
+ * once all receivers confirmed. Raw sockets play the other side and drop packets, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.multicast.cpp -o test.multicast && ./test.multicast va vb
+ */
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "libetherstream.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+static const uint32_t packets = 11;
+static const uint32_t len = (packets - 1)*mcastChunk + 100;
+
+static vector<char> pattern(){
+	vector<char> data(len);
+	for(size_t i = 0; i < len; i++)
+		data[i] = (char)(i*7 + i/1000);
+	return data;
+}
+
+// Sends packet seq of the transfer session of data to the group
+static void sendSeq(test::RawSocket& raw, uint32_t session, const vector<char>& data, uint32_t seq){
+	MDATA mpkt;
+	mpkt.connection = session;
+	mpkt.seq = seq;
+	mpkt.size = data.size();
+	mpkt.length = min<uint32_t>(mcastChunk, data.size() - seq*mcastChunk);
+	mpkt.checksum = crc32c(mpkt.length, &data[seq*mcastChunk]);
+	struct iovec iov[2] = {{&mpkt, sizeof(MDATA)}, {(void*)&data[seq*mcastChunk], mpkt.length}};
+	raw.sendPacket(multicastGroup, iov, 2);
+}
+
+// Next NAK of session from src, its ranges are appended to missing
+static bool nakOf(test::RawSocket& raw, mac_t src, uint32_t session, vector<NakRange>& missing, int ms){
+	uint16_t size;
+	shared_ptr<PktBase> pkt;
+	bool found = test::until([&]{
+		pkt = raw.receive(src, tNAK, size, 0);
+		return pkt && pkt->connection == session;
+	}, ms);
+	if(!found)
+		return false;
+	const NAK* npkt = (const NAK*)pkt.get();
+	const NakRange* range = (const NakRange*)(npkt + 1);
+	for(uint16_t i = 0; i < npkt->count && sizeof(NAK) + (i + 1)*sizeof(NakRange) <= size; i++)
+		missing.push_back(range[i]);
+	return true;
+}
+
+// The receiver reports the hole in the middle, completes with the repairs and confirms it
+static void receiver(string a, string b){
+	vector<char> data = pattern();
+	test::RawSocket raw(a);
+	MulticastReceiver rx(b);
+	const uint32_t session = 0x4711;
+	for(uint32_t seq = 0; seq < packets; seq++)
+		if(seq < 3 || seq > 5)
+			sendSeq(raw, session, data, seq);
+	vector<NakRange> missing;
+	CHECK(test::until([&]{
+		rx.work(10);
+		return nakOf(raw, rx.getLMac(), session, missing, 0);
+	}, 2000));
+	CHECK(missing.size() == 1 && missing[0].first == 3 && missing[0].count == 3);
+	for(uint32_t seq = 3; seq <= 5; seq++)
+		sendSeq(raw, session, data, seq);
+	CHECK(test::until([&]{ return rx.work(10); }, 2000));
+	CHECK(rx.data() == data);
+	// Confirmed with a NAK without ranges
+	missing.clear();
+	CHECK(nakOf(raw, rx.getLMac(), session, missing, 1000) && missing.empty());
+}
+
+// The sender resends only the packets reported missing and stops once the receiver confirmed
+static void sender(string a, string b){
+	vector<char> data = pattern();
+	mac_t server = test::macOf(a);
+	pid_t pid = test::fork([&]{
+		test::RawSocket raw(b);
+		raw.joinGroup(multicastGroup);
+		multiset<uint32_t> first, repaired;
+		uint32_t session = 0;
+		bool reported = false;
+		test::until([&]{
+			uint16_t size;
+			auto pkt = raw.receive(server, tMDATA, size, 0);
+			if(!pkt)
+				return false;
+			const MDATA* mpkt = (const MDATA*)pkt.get();
+			CHECK(mpkt->size == len);
+			CHECK(crc32c(mpkt->length, mpkt + 1) == mpkt->checksum);
+			session = mpkt->connection;
+			uint32_t seq = mpkt->seq;
+			if(!reported){
+				first.insert(seq);
+				if(seq == packets - 1){
+					char frame[sizeof(NAK) + 2*sizeof(NakRange)];
+					NAK npkt;
+					npkt.connection = session;
+					npkt.count = 2;
+					NakRange ranges[2];
+					ranges[0].first = 2;
+					ranges[0].count = 2;
+					ranges[1].first = 7;
+					ranges[1].count = 1;
+					memcpy(frame, &npkt, sizeof(npkt));
+					memcpy(frame + sizeof(npkt), ranges, sizeof(ranges));
+					usleep(20000); // Packets sent just before the NAK are not resent, they may still be on their way
+					raw.sendPacket(server, frame, sizeof(frame));
+					reported = true;
+				}
+			}else if(seq != packets - 1){ // The last one is repeated as heartbeat
+				repaired.insert(seq);
+			}
+			return repaired.size() >= 3;
+		}, 5000);
+		CHECK(first.size() == packets);
+		CHECK(repaired == multiset<uint32_t>({2, 3, 7}));
+		NAK done;
+		done.connection = session;
+		raw.sendPacket(server, &done, sizeof(done));
+		return test::failures;
+	});
+	usleep(100000);
+	MulticastSender tx(a);
+	CHECK(tx.distribute(data.data(), data.size(), 1, 1000, 10000) == 1);
+	CHECK(test::join(pid));
+}
+
+int main(int argc, char** argv){
+	string a, b;
+	test::interfaces(argc, argv, a, b);
+	receiver(a, b);
+	sender(a, b);
+	return test::result("test.multicast");
+}
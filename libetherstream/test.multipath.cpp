@@ -0,0 +1,100 @@
+/*
+ * test.multipath.cpp
+ *
+ * A connection over two paths spreads its DATA over both, and an echo transfer completes intact
+ * when the link of one of them goes down in the middle, on the client's or on the server's side.
+ * Needs root and two veth pairs, the server on a and c, the client on b and d, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.multipath.cpp -o test.multipath && ./test.multipath va vb vc vd
+ */
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "libetherstream.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+static const uint16_t service = 208;
+
+static void ip(string args){
+	if(system(("ip link set " + args).c_str()) != 0)
+		test::check(false, args.c_str(), __FILE__, __LINE__);
+}
+
+// Echoes len bytes over the paths b-a and d-c, the link down goes down once half of it came back
+static void failover(string a, string b, string c, string d, string down, size_t len){
+	ConnectionOptions options;
+	options.window = 32;
+	mac_t server = test::macOf(a), server2 = test::macOf(c);
+	pid_t pid = test::fork([&]{
+		Listener listener(a, service, options);
+		ServerConnection* conn = nullptr;
+		if(!test::until([&]{ return (conn = listener.listen()) != nullptr; }))
+			return 1;
+		char buf[4096];
+		test::until([&]{
+			conn->work();
+			uint32_t r = conn->read(buf, sizeof(buf));
+			if(r)
+				conn->write(buf, r);
+			return conn->closed();
+		}, 60000);
+		CHECK(conn->getPaths().size() == 2);
+		delete conn;
+		return test::failures;
+	});
+	usleep(100000);
+	vector<char> data(len), back;
+	for(size_t i = 0; i < len; i++)
+		data[i] = (char)(i*7 + i/251);
+	Client client(b, server, service, options);
+	CHECK(test::until([&]{ client.work(); return client.connected(); }));
+	CHECK(client.addPath(d, server2));
+	size_t sent = 0;
+	bool pulled = false;
+	vector<uint32_t> sentBefore;
+	char buf[4096];
+	CHECK(test::until([&]{
+		if(sent < len && client.pending() < 256*1024)
+			sent += client.write(&data[sent], min<size_t>(4096, len - sent));
+		client.work();
+		uint32_t r = client.read(buf, sizeof(buf));
+		back.insert(back.end(), buf, buf + r);
+		if(!pulled && back.size() > len/2){
+			pulled = true;
+			for(auto& path : client.getPaths())
+				sentBefore.push_back(path.sent);
+			ip(down + " down");
+		}
+		return back.size() >= len;
+	}, 50000));
+	ip(down + " up");
+	CHECK(back == data);
+	auto paths = client.getPaths();
+	CHECK(paths.size() == 2 && sentBefore.size() == 2);
+	if(paths.size() == 2 && sentBefore.size() == 2){
+		CHECK(paths[1].confirmed);
+		CHECK(sentBefore[0] > 0 && sentBefore[1] > 0); // Striped
+		CHECK(paths[0].sent > sentBefore[0]); // Took over
+		CHECK(paths[1].lost > 0 || paths[1].link.down);
+	}
+	client.close();
+	client.work();
+	CHECK(test::join(pid));
+}
+
+int main(int argc, char** argv){
+	string a, b;
+	test::interfaces(argc, argv, a, b);
+	if(argc < 5){
+		fprintf(stderr, "Usage: %s <iface> <peer iface> <2nd iface> <2nd peer iface>\n", argv[0]);
+		return 2;
+	}
+	string c = argv[3], d = argv[4];
+	failover(a, b, c, d, d, 2000000);
+	failover(a, b, c, d, c, 2000000);
+	return test::result("test.multipath");
+}
@@ -0,0 +1,157 @@
+/*
+ * test.packet.cpp
+ *
+ * Packet fields are stored little endian and unaligned, independent of the host, and views
+ * only report packets valid whose fields fit into the buffer. Received frames too short for
+ * their type, of unknown types or DATA announcing more payload than it carries are dropped, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.packet.cpp -o test.packet && ./test.packet va vb
+ */
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "libetherstream.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+static const uint16_t service = 205;
+
+static bool bytesAre(const void* p, vector<uint8_t> expected){
+	return memcmp(p, expected.data(), expected.size()) == 0;
+}
+
+// Fields are little endian at fixed, unaligned offsets
+static void layout(){
+	CHECK(sizeof(le16) == 2 && sizeof(le32) == 4 && sizeof(le64) == 8);
+	CHECK(sizeof(CONNECT) == 12 && sizeof(ACK) == 10 && sizeof(CLOSE) == 7);
+	CHECK(dataHdrLen(cFLETCHER16) == 12 && dataHdrLen(cCRC32C) == 14 && dataHdrLen(cNONE) == 10);
+
+	uint8_t buf[16] = {0};
+	setLE<uint32_t>(buf + 1, 0x12345678);
+	CHECK(bytesAre(buf, {0, 0x78, 0x56, 0x34, 0x12, 0}));
+	CHECK(getLE<uint32_t>(buf + 1) == 0x12345678);
+	le64 v = 0x0102030405060708ull;
+	CHECK(bytesAre(&v, {8, 7, 6, 5, 4, 3, 2, 1}));
+	CHECK((uint64_t)v == 0x0102030405060708ull);
+
+	CONNECT cpkt;
+	cpkt.connection = 0xA1B2C3D4;
+	cpkt.service = 0x0102;
+	cpkt.flags = CONNFLAG_CHKSUM(cCRC32C) | CONNFLAG_DATA;
+	CHECK(bytesAre(&cpkt, {tCONNECT, 0xD4, 0xC3, 0xB2, 0xA1, 0, 0, 1, 0x02, 0x01, 0x0A, 0x00}));
+
+	ACK apkt;
+	apkt.connection = 1;
+	apkt.pktNo = 0x8003; // Server bit set
+	apkt.receivedCount = 2;
+	apkt.errflags = ACKFLAGS_CHKSUM(cNONE) | ACKFLAGS_TOKEN;
+	CHECK(bytesAre(&apkt, {tACK, 1, 0, 0, 0, 3, 0x80, 2, 0x80, 0x02}));
+}
+
+// The DATA header is sized for the checksum type, a view is only valid if the payload fits
+static void views(){
+	char frame[64] = {0};
+	DATA* d = (DATA*)frame;
+	for(uint8_t type : {cFLETCHER16, cCRC32C, cNONE}){
+		memset(frame, 0, sizeof(frame));
+		d->type = tDATA;
+		d->pktNo = 5;
+		setDataHdr(d, type, 0xCAFEBABE, 20);
+		memcpy(frame + dataHdrLen(type), "payload", 7);
+		DataView view(frame, dataHdrLen(type) + 20, type);
+		CHECK(view.valid());
+		CHECK(view->pktNo == 5);
+		CHECK(view.length() == 20);
+		CHECK(view.checksum() == (type == cCRC32C ? 0xCAFEBABE : type == cFLETCHER16 ? 0xBABE : 0));
+		CHECK(memcmp(view.payload(), "payload", 7) == 0);
+		CHECK(!DataView(frame, dataHdrLen(type) + 19, type).valid()); // Payload beyond the buffer
+		CHECK(!DataView(frame, dataHdrLen(type) - 1, type).valid());
+		CHECK(!DataView(nullptr, 0, type).valid());
+	}
+	CHECK(PktView<ACK>(frame, sizeof(ACK)).valid());
+	CHECK(!PktView<ACK>(frame, sizeof(ACK) - 1).valid());
+	CHECK(minPktSize(tACK) == sizeof(ACK));
+	CHECK(minPktSize(tDATA) == dataHdrLen(cNONE));
+	CHECK(minPktSize(0x7F) == 0);
+}
+
+// Only the frames valid for their type are returned by recvPkt()
+static void frames(string a, string b){
+	test::RawSocket tx(b), rx(a);
+	mac_t from = tx.getLMac();
+	ACK apkt;
+	apkt.connection = 0x3000;
+	char unknown[sizeof(ACK)] = {0x7F};
+	tx.sendPacket(rx.getLMac(), &apkt, 5); // Shorter than any packet
+	tx.sendPacket(rx.getLMac(), &apkt, sizeof(ACK) - 1);
+	tx.sendPacket(rx.getLMac(), unknown, sizeof(unknown));
+	apkt.pktNo = 7;
+	tx.sendPacket(rx.getLMac(), &apkt, sizeof(ACK));
+	int received = 0;
+	test::until([&]{
+		mac_t src;
+		uint16_t size;
+		auto pkt = rx.recvPkt(src, size);
+		if(pkt && memcmp(src.bytes, from.bytes, sizeof(mac_t)) == 0){
+			received++;
+			CHECK(pkt->type == tACK && pkt->pktNo == 7 && size >= sizeof(ACK));
+		}
+		return false;
+	}, 300);
+	CHECK(received == 1);
+}
+
+// DATA whose length reaches beyond the frame is ignored by the connection, a valid one is accepted
+static void oversized(string a, string b){
+	ConnectionOptions options;
+	options.checksums = CONNFLAG_CHKSUM(cNONE); // Nothing but the length stops reading beyond the frame
+	Listener listener(a, service, options);
+	Client client(b, listener.getLMac(), service, options);
+	unique_ptr<ServerConnection> conn;
+	CHECK(test::until([&]{
+		client.work();
+		if(!conn)
+			conn.reset(listener.listen());
+		return conn && client.connected();
+	}));
+	if(!conn)
+		return;
+	test::RawSocket raw(b); // Plays the client
+	uint8_t type = conn->getChecksumType();
+	CHECK(type == cNONE);
+	char frame[100] = {0};
+	DATA* d = (DATA*)frame;
+	d->type = tDATA;
+	d->connection = client.getConnection();
+	d->pktNo = 1;
+	memcpy(frame + dataHdrLen(type), "oversized", 9);
+	setDataHdr(d, type, checksum(type, 1000, frame + dataHdrLen(type)), 1000);
+	raw.sendPacket(listener.getLMac(), frame, sizeof(frame));
+	test::until([&]{ conn->work(); return false; }, 100);
+	CHECK(conn->available() == 0);
+	CHECK(conn->getStats().payloadReceived == 0);
+	setDataHdr(d, type, checksum(type, 9, frame + dataHdrLen(type)), 9);
+	raw.sendPacket(listener.getLMac(), frame, dataHdrLen(type) + 9);
+	char buf[100];
+	uint32_t r = 0;
+	CHECK(test::until([&]{
+		conn->work();
+		r = conn->read(buf, sizeof(buf));
+		return r > 0;
+	}, 1000));
+	CHECK(string(buf, r) == "oversized");
+}
+
+int main(int argc, char** argv){
+	string a, b;
+	test::interfaces(argc, argv, a, b);
+	layout();
+	views();
+	frames(a, b);
+	oversized(a, b);
+	return test::result("test.packet");
+}
@@ -0,0 +1,147 @@
+/*
+ * test.resume.cpp
+ *
+ * A connection is only resumed with the token the server handed out, and an echo transfer goes
+ * on unchanged after the client's link went down and came back with another MAC. Needs root to
+ * flap the link, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.resume.cpp -o test.resume && ./test.resume va vb
+ */
+
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "libetherstream.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+static const uint16_t service = 206;
+
+// Answer of the server to the resume CONNECT with token, nullptr if none came
+static shared_ptr<PktBase> resumeWith(test::RawSocket& raw, ServerConnection* conn, uint64_t token){
+	char frame[sizeof(CONNECT) + sizeof(le64)];
+	CONNECT cpkt;
+	cpkt.connection = conn->getConnection();
+	cpkt.service = service;
+	cpkt.flags = CONNFLAG_RESUME;
+	memcpy(frame, &cpkt, sizeof(cpkt));
+	setLE<uint64_t>(frame + sizeof(cpkt), token);
+	raw.sendPacket(conn->getLMac(), frame, sizeof(frame));
+	shared_ptr<PktBase> ack;
+	uint16_t size;
+	test::until([&]{
+		conn->work();
+		ack = raw.receive(conn->getLMac(), tACK, size, 0);
+		return ack && ack->pktNo == 0;
+	}, 300);
+	return ack && ack->pktNo == 0 ? ack : nullptr;
+}
+
+// The token comes with the answer to the CONNECT, only it resumes the connection
+static void tokens(string a, string b){
+	test::RawSocket raw(b); // Sees the answers to the client as well
+	Listener listener(a, service);
+	Client client(b, listener.getLMac(), service);
+	unique_ptr<ServerConnection> conn;
+	uint64_t token = 0;
+	CHECK(test::until([&]{
+		client.work();
+		if(!conn)
+			conn.reset(listener.listen());
+		uint16_t size;
+		auto ack = raw.receive(listener.getLMac(), tACK, size, 0);
+		if(ack && ack->pktNo == 0 && (((ACK*)ack.get())->errflags & ACKFLAGS_TOKEN) && size >= sizeof(ACK) + sizeof(le64))
+			token = getLE<uint64_t>((char*)ack.get() + sizeof(ACK));
+		return conn && client.connected() && token;
+	}));
+	if(!conn)
+		return;
+	CHECK(!resumeWith(raw, conn.get(), token + 1));
+	CHECK(!resumeWith(raw, conn.get(), 0));
+	auto ack = resumeWith(raw, conn.get(), token);
+	CHECK(ack && (((ACK*)ack.get())->errflags & ACKFLAGS_TOKEN));
+
+	ConnectionOptions options;
+	options.resumable = false;
+	Listener plain(a, service + 1, options);
+	Client other(b, plain.getLMac(), service + 1, options);
+	CHECK(test::until([&]{
+		other.work();
+		delete plain.listen();
+		return other.connected();
+	}));
+	CHECK(!other.resume());
+}
+
+static void ip(string args){
+	if(system(("ip link set " + args).c_str()) != 0)
+		test::check(false, args.c_str(), __FILE__, __LINE__);
+}
+
+// The client's link goes down and comes back with another MAC during an echo transfer
+static void flap(string a, string b){
+	const size_t len = 300000;
+	mac_t server = test::macOf(a);
+	mac_t original = test::macOf(b);
+	pid_t pid = test::fork([&]{
+		Listener listener(a, service);
+		ServerConnection* conn = nullptr;
+		if(!test::until([&]{ return (conn = listener.listen()) != nullptr; }))
+			return 1;
+		char buf[4096];
+		test::until([&]{
+			conn->work();
+			uint32_t r = conn->read(buf, sizeof(buf));
+			if(r)
+				conn->write(buf, r);
+			return conn->closed();
+		}, 60000);
+		delete conn;
+		return 0;
+	});
+	usleep(100000);
+	vector<char> data(len), back;
+	for(size_t i = 0; i < len; i++)
+		data[i] = (char)(i*7 + i/251);
+	{
+		Client client(b, server, service);
+		CHECK(test::until([&]{ client.work(); return client.connected(); }));
+		size_t sent = 0;
+		int phase = 0;
+		char buf[4096];
+		CHECK(test::until([&]{
+			if(sent < len)
+				sent += client.write(&data[sent], min<size_t>(4096, len - sent));
+			client.work();
+			uint32_t r = client.read(buf, sizeof(buf));
+			back.insert(back.end(), buf, buf + r);
+			if(phase == 0 && back.size() > len/3){
+				phase = 1;
+				ip(b + " down");
+				test::until([&]{ client.work(); return false; }, 300);
+				ip(b + " address 02:11:22:33:44:55");
+				ip(b + " up");
+			}
+			return back.size() >= len;
+		}, 50000));
+		CHECK(back == data);
+		CHECK(phase == 1);
+		client.close();
+	}
+	char addr[18];
+	snprintf(addr, sizeof(addr), "%02x:%02x:%02x:%02x:%02x:%02x", original.bytes[0], original.bytes[1],
+			original.bytes[2], original.bytes[3], original.bytes[4], original.bytes[5]);
+	ip(b + " address " + addr);
+	CHECK(test::join(pid));
+}
+
+int main(int argc, char** argv){
+	string a, b;
+	test::interfaces(argc, argv, a, b);
+	tokens(a, b);
+	flap(a, b);
+	return test::result("test.resume");
+}
@@ -0,0 +1,88 @@
+/*
+ * test.table.cpp
+ *
+ * The connection table finds every entry after inserts, replacements, growth and deletes, which
+ * shift the following entries of the probe sequence back instead of leaving tombstones, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.table.cpp -o test.table && ./test.table
+ */
+
+#include <map>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "libetherstream.table.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+static ConnKey key(uint8_t host, uint32_t connection){
+	ConnKey k;
+	k.mac.bytes[0] = 0x02;
+	k.mac.bytes[5] = host;
+	k.connection = connection;
+	return k;
+}
+
+// Random operations compared against a map, few hosts and ids so probe sequences overlap
+static void model(){
+	ConnectionTable<int> table(4);
+	map<pair<int, uint32_t>, int> expected;
+	mt19937 rnd(1);
+	for(int i = 0; i < 200000; i++){
+		uint8_t host = rnd() % 4;
+		uint32_t id = rnd() % 300;
+		ConnKey k = key(host, id);
+		auto it = expected.find({host, id});
+		switch(rnd() % 3){
+		case 0:
+			table.insert(k, i);
+			expected[{host, id}] = i;
+			break;
+		case 1:
+			CHECK(table.erase(k) == (it != expected.end()));
+			if(it != expected.end())
+				expected.erase(it);
+			break;
+		default:
+			int* v = table.find(k);
+			CHECK((v != nullptr) == (it != expected.end()));
+			if(v && it != expected.end())
+				CHECK(*v == it->second);
+		}
+		CHECK(table.size() == expected.size());
+	}
+	for(auto& e : expected){
+		int* v = table.find(key(e.first.first, e.first.second));
+		CHECK(v && *v == e.second);
+	}
+}
+
+// Deleting from the middle of a cluster keeps the entries behind it reachable
+static void clusters(){
+	ConnectionTable<uint32_t> table(1000);
+	vector<ConnKey> keys;
+	for(uint32_t id = 0; id < 1000; id++){
+		keys.push_back(key(1, id));
+		table.insert(keys.back(), id);
+	}
+	for(uint32_t id = 0; id < 1000; id += 2)
+		CHECK(table.erase(keys[id]));
+	CHECK(table.size() == 500);
+	for(uint32_t id = 0; id < 1000; id++){
+		uint32_t* v = table.find(keys[id]);
+		CHECK(id % 2 ? v && *v == id : v == nullptr);
+	}
+	for(uint32_t id = 1; id < 1000; id += 2)
+		CHECK(table.erase(keys[id]));
+	CHECK(table.size() == 0);
+	CHECK(!table.erase(keys[1]));
+	CHECK(table.find(keys[1]) == nullptr);
+}
+
+int main(int argc, char** argv){
+	model();
+	clusters();
+	return test::result("test.table");
+}
@@ -0,0 +1,109 @@
+/*
+ * test.trace.cpp
+ *
+ * The TraceRing keeps the newest events in order once it wrapped around, dump() writes exactly
+ * the records kept, and events recorded by several threads are never returned half written, e.g.:
+ *   g++ -std=c++14 -O2 -pthread test.trace.cpp -o test.trace && ./test.trace
+ */
+
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libetherstream.trace.hpp"
+#include "test.hpp"
+
+using namespace ethstream;
+using namespace std;
+
+// Records count events of connection, pktNo and value count up from first
+static void fill(TraceRing& ring, uint32_t connection, uint32_t first, uint32_t count){
+	for(uint32_t i = first; i < first + count; i++)
+		ring.record(i % (TRACE_DROP + 1), connection, i % (maxPktType + 1), (uint16_t)i, i % 1500, i % 3, i*3);
+}
+
+// More events than the ring holds: the newest ones are kept, oldest first
+static void wraparound(){
+	TraceRing ring(100); // Rounded up to 128
+	CHECK(ring.records().empty());
+	fill(ring, 0x1234, 0, 300);
+	CHECK(ring.recorded() == 300);
+	auto list = ring.records();
+	CHECK(list.size() == 128);
+	for(size_t i = 0; i < list.size(); i++){
+		uint32_t n = 300 - 128 + i;
+		const TraceRecord& rec = list[i];
+		CHECK(rec.pktNo == n && rec.value == n*3 && rec.connection == 0x1234);
+		CHECK(rec.event == n % (TRACE_DROP + 1) && rec.type == n % (maxPktType + 1));
+		CHECK(rec.length == n % 1500 && rec.path == n % 3);
+		CHECK(i == 0 || rec.time >= list[i - 1].time);
+	}
+	ring.clear();
+	CHECK(ring.records().empty() && ring.recorded() == 0);
+	fill(ring, 0x1234, 0, 5);
+	CHECK(ring.records().size() == 5 && ring.records().front().pktNo == 0);
+}
+
+// Each line of dump() describes the record kept at its position
+static void dump(){
+	static const char* events[] = {"SEND", "RESEND", "RECV", "ACKED", "TIMEOUT", "DROP"};
+	static const char* types[] = {"CONNECT", "DATA", "ACK", "CLOSE", "DISCOVER", "ANNOUNCE", "MDATA", "NAK"};
+	TraceRing ring(16);
+	fill(ring, 0xabcdef01, 0x7FF0, 40); // The server bit is set from 0x8000 on
+	auto list = ring.records();
+	stringstream out;
+	ring.dump(out);
+	CHECK(out.precision() == 6 && !(out.flags() & ios::fixed)); // The format of the stream is restored
+	string line;
+	size_t i = 0;
+	for(; getline(out, line) && i < list.size(); i++){
+		const TraceRecord& rec = list[i];
+		stringstream fields(line);
+		double us;
+		uint32_t connection, length, path, value;
+		string event, type, pktNo;
+		fields >> us >> hex >> connection >> dec >> event >> type >> pktNo >> length >> path >> value;
+		CHECK(!fields.fail());
+		double expectedUs = (rec.time - list.front().time)/1000.0;
+		CHECK(us >= expectedUs - 0.001 && us <= expectedUs + 0.001);
+		CHECK(connection == rec.connection && event == events[rec.event] && type == types[rec.type]);
+		CHECK(pktNo == (SERVERBIT_ISSET(rec.pktNo) ? "S" : "C") + to_string(REALPKTNO(rec.pktNo)));
+		CHECK(length == rec.length && path == rec.path && value == rec.value);
+	}
+	CHECK(i == 16 && list.size() == 16);
+	CHECK(!getline(out, line));
+}
+
+// Threads sharing a ring: every record returned is whole, the ones of each thread in order
+static void threads(){
+	TraceRing ring(1024);
+	vector<thread> writers;
+	for(uint32_t t = 0; t < 4; t++)
+		writers.emplace_back([&ring, t]{ fill(ring, t, 1, 200000); });
+	bool whole = true, ordered = true;
+	for(int round = 0; round < 200; round++){
+		uint32_t last[4] = {0, 0, 0, 0};
+		for(const TraceRecord& rec : ring.records()){
+			uint32_t n = rec.value/3;
+			whole &= rec.connection < 4 && rec.value % 3 == 0 && rec.pktNo == (uint16_t)n
+					&& rec.length == n % 1500 && rec.path == n % 3 && rec.event == n % (TRACE_DROP + 1);
+			if(rec.connection < 4){
+				ordered &= n > last[rec.connection];
+				last[rec.connection] = n;
+			}
+		}
+	}
+	for(auto& w : writers)
+		w.join();
+	CHECK(whole && ordered);
+	CHECK(ring.recorded() == 800000);
+	CHECK(ring.records().size() == 1024);
+}
+
+int main(int argc, char** argv){
+	wraparound();
+	dump();
+	threads();
+	return test::result("test.trace");
+}